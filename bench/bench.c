@@ -0,0 +1,520 @@
+// Userspace driver for the kernel-wasm microbenchmarks.
+//
+// Needs kernel-wasm and kwasm-bench loaded. Guest code is a small hand-assembled x86-64 image instead of
+// a compiled module, so that results do not depend on a Wasmer build and only measure the runtime.
+// Every benchmark prints one JSON object per line to stdout, with percentiles of its samples.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+// Mirrors of request.h.
+#define WASM_LOAD_CODE 0x1001
+#define WASM_RUN_CODE 0x1002
+#define WASM_READ_MEMORY 0x1003
+#define WASM_WRITE_MEMORY 0x1004
+#define WASM_START_RUNNER 0x1007
+#define WASM_SETUP_RING 0x1008
+#define WASM_RING_ENTER 0x1009
+#define WASM_START_ASYNC_RUNNER 0x100d
+
+#define WASM_MMAP_RING_OFFSET 0ul
+
+struct import_request {
+    char name[64];
+    uint32_t param_count;
+};
+
+struct load_code_request {
+    uint8_t *code;
+    uint32_t code_len;
+    uint8_t *memory;
+    uint32_t memory_len;
+    uint32_t memory_max;
+    void *table;
+    uint32_t table_count;
+    uint64_t *globals;
+    uint32_t global_count;
+    struct import_request *imported_funcs;
+    uint32_t imported_func_count;
+    uint32_t *dynamic_sigindices;
+    uint32_t dynamic_sigindice_count;
+};
+
+struct run_code_result {
+    uint32_t success;
+    uint64_t retval;
+};
+
+struct run_code_request {
+    uint32_t entry_offset;
+    uint64_t *params;
+    uint32_t param_count;
+    struct run_code_result *result;
+};
+
+struct memory_request {
+    uint8_t *buf;
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct setup_ring_request {
+    uint32_t entries;
+    uint32_t mmap_size;
+};
+
+struct run_ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;
+    uint32_t sqe_offset;
+    uint32_t cqe_offset;
+    uint32_t reserved;
+};
+
+struct run_ring_sqe {
+    uint64_t user_data;
+    uint32_t entry_offset;
+    uint32_t param_count;
+    uint64_t params[8];
+};
+
+struct run_ring_cqe {
+    uint64_t user_data;
+    uint64_t retval;
+    uint32_t success;
+    uint32_t reserved;
+};
+
+// Guest code. Functions take the vmctx in %rdi like generated code, and call imports and intrinsics
+// through the vmctx in the same way (`imported_funcs` at offset 48, `intrinsics` at offset 64).
+#define ENTRY_EMPTY 0 // () -> 0
+#define ENTRY_HOST_CALLS 16 // (import_index, count): calls the import `count` times
+#define ENTRY_MEMORY_GROW 80 // (count): grows memory by one wasm page `count` times
+
+static const uint8_t guest_code[] = {
+    // ENTRY_EMPTY
+    0x31, 0xc0, // xor %eax, %eax
+    0xc3, // ret
+    0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+
+    // ENTRY_HOST_CALLS
+    0x53, // push %rbx
+    0x41, 0x54, // push %r12
+    0x41, 0x55, // push %r13
+    0x48, 0x89, 0xfb, // mov %rdi, %rbx
+    0x49, 0x89, 0xf4, // mov %rsi, %r12
+    0x49, 0x89, 0xd5, // mov %rdx, %r13
+    0x4d, 0x85, 0xed, // test %r13, %r13
+    0x74, 0x1d, // jz done
+    // loop:
+    0x48, 0x8b, 0x43, 0x30, // mov 48(%rbx), %rax
+    0x4c, 0x89, 0xe1, // mov %r12, %rcx
+    0x48, 0xc1, 0xe1, 0x04, // shl $4, %rcx
+    0x48, 0x8b, 0x04, 0x08, // mov (%rax, %rcx), %rax
+    0x48, 0x89, 0xdf, // mov %rbx, %rdi
+    0x31, 0xf6, // xor %esi, %esi
+    0x31, 0xd2, // xor %edx, %edx
+    0xff, 0xd0, // call *%rax
+    0x49, 0xff, 0xcd, // dec %r13
+    0x75, 0xe3, // jnz loop
+    // done:
+    0x31, 0xc0, // xor %eax, %eax
+    0x41, 0x5d, // pop %r13
+    0x41, 0x5c, // pop %r12
+    0x5b, // pop %rbx
+    0xc3, // ret
+    0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+
+    // ENTRY_MEMORY_GROW
+    0x53, // push %rbx
+    0x41, 0x54, // push %r12
+    0x41, 0x55, // push %r13
+    0x48, 0x89, 0xfb, // mov %rdi, %rbx
+    0x49, 0x89, 0xf4, // mov %rsi, %r12
+    0x4d, 0x85, 0xe4, // test %r12, %r12
+    0x74, 0x18, // jz done
+    // loop:
+    0x48, 0x8b, 0x43, 0x40, // mov 64(%rbx), %rax
+    0x48, 0x8b, 0x00, // mov (%rax), %rax
+    0x48, 0x89, 0xdf, // mov %rbx, %rdi
+    0x31, 0xf6, // xor %esi, %esi
+    0xba, 0x01, 0x00, 0x00, 0x00, // mov $1, %edx
+    0xff, 0xd0, // call *%rax
+    0x49, 0xff, 0xcc, // dec %r12
+    0x75, 0xe8, // jnz loop
+    // done:
+    0x31, 0xc0, // xor %eax, %eax
+    0x41, 0x5d, // pop %r13
+    0x41, 0x5c, // pop %r12
+    0x5b, // pop %rbx
+    0xc3, // ret
+
+    // Varied per load by the cold load benchmark, to defeat the code cache.
+    0, 0, 0, 0,
+};
+#define GUEST_CODE_NONCE_OFFSET (sizeof(guest_code) - 4)
+_Static_assert(GUEST_CODE_NONCE_OFFSET == ENTRY_MEMORY_GROW + 48, "guest code layout changed");
+
+static const struct import_request guest_imports[] = {
+    { "bench##nop0", 0 },
+    { "bench##nop2", 2 },
+    { "bench##nop6", 6 },
+};
+
+#define MEMORY_LEN 65536 // one wasm page
+#define RW_MEMORY_LEN (4 * 1048576)
+#define HOST_CALL_BATCH 1000
+#define MEMORY_GROW_BATCH 64
+#define RING_BATCH 64
+
+static const char *device = "/dev/wasmctl";
+static int sample_count = 1000;
+static const char *filter = NULL;
+static uint8_t *memory_image;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, double p) {
+    int i = (int) (p * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+// Sorts `samples` in place and prints their distribution. `bytes` (0 if none) is processed per sample.
+static void report(const char *name, uint64_t *samples, int n, uint64_t bytes) {
+    uint64_t sum = 0;
+    int i;
+
+    if(n == 0) return;
+    for(i = 0; i < n; i++) sum += samples[i];
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+
+    printf(
+        "{\"name\": \"%s\", \"unit\": \"ns\", \"samples\": %d, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, "
+        "\"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %llu",
+        name, n,
+        (unsigned long long) samples[0],
+        (unsigned long long) percentile(samples, n, 0.5),
+        (unsigned long long) percentile(samples, n, 0.9),
+        (unsigned long long) percentile(samples, n, 0.99),
+        (unsigned long long) percentile(samples, n, 0.999),
+        (unsigned long long) samples[n - 1],
+        (unsigned long long) (sum / n)
+    );
+    if(bytes) {
+        printf(", \"bytes\": %llu", (unsigned long long) bytes);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int enabled(const char *name) {
+    return !filter || strstr(name, filter);
+}
+
+static int load(int fd, uint8_t *code, uint32_t memory_len) {
+    struct load_code_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.code = code;
+    req.code_len = sizeof(guest_code);
+    req.memory = memory_image;
+    req.memory_len = memory_len;
+    req.imported_funcs = (struct import_request *) guest_imports;
+    req.imported_func_count = sizeof(guest_imports) / sizeof(guest_imports[0]);
+    return ioctl(fd, WASM_LOAD_CODE, &req);
+}
+
+// Returns a session with the guest loaded and, if `runner` is not 0, a runner of that kind started.
+static int open_session(int runner, uint32_t memory_len) {
+    int fd;
+
+    fd = open(device, O_RDWR);
+    if(fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if(load(fd, (uint8_t *) guest_code, memory_len) < 0) {
+        perror("WASM_LOAD_CODE");
+        close(fd);
+        return -1;
+    }
+    if(runner && ioctl(fd, runner, NULL) < 0) {
+        perror("start runner");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run(int fd, uint32_t entry, uint64_t *params, uint32_t param_count, uint64_t *elapsed) {
+    struct run_code_result result;
+    struct run_code_request req = {
+        .entry_offset = entry,
+        .params = params,
+        .param_count = param_count,
+        .result = &result,
+    };
+    uint64_t start = now_ns();
+
+    if(ioctl(fd, WASM_RUN_CODE, &req) < 0 || !result.success) {
+        return -1;
+    }
+    *elapsed = now_ns() - start;
+    return 0;
+}
+
+static void bench_load_code(uint64_t *samples) {
+    uint8_t code[sizeof(guest_code)];
+    uint64_t start;
+    uint32_t nonce;
+    int i, n, fd;
+
+    memcpy(code, guest_code, sizeof(guest_code));
+    for(n = 0; n < 2; n++) {
+        const char *name = n ? "load_code_cold" : "load_code_cached";
+        if(!enabled(name)) continue;
+
+        for(i = 0; i < sample_count; i++) {
+            if((fd = open(device, O_RDWR)) < 0) break;
+            if(n) {
+                nonce = (uint32_t) now_ns() ^ (uint32_t) i;
+                memcpy(code + GUEST_CODE_NONCE_OFFSET, &nonce, sizeof(nonce));
+            }
+            start = now_ns();
+            if(load(fd, code, MEMORY_LEN) < 0) {
+                perror(name);
+                close(fd);
+                break;
+            }
+            samples[i] = now_ns() - start;
+            close(fd);
+        }
+        report(name, samples, i, 0);
+    }
+}
+
+static uint64_t median_empty_run(int fd, uint64_t *samples) {
+    int i;
+
+    for(i = 0; i < sample_count; i++) {
+        if(run(fd, ENTRY_EMPTY, NULL, 0, &samples[i]) < 0) return 0;
+    }
+    qsort(samples, sample_count, sizeof(uint64_t), cmp_u64);
+    return percentile(samples, sample_count, 0.5);
+}
+
+static void bench_run_code(uint64_t *samples) {
+    static const struct {
+        const char *name;
+        int runner;
+    } kinds[] = {
+        { "run_code_empty_oneshot", 0 },
+        { "run_code_empty_persistent", WASM_START_RUNNER },
+        { "run_code_empty_async", WASM_START_ASYNC_RUNNER },
+    };
+    unsigned k;
+    int i, fd;
+
+    for(k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        if(!enabled(kinds[k].name)) continue;
+        if((fd = open_session(kinds[k].runner, MEMORY_LEN)) < 0) continue;
+
+        for(i = 0; i < sample_count; i++) {
+            if(run(fd, ENTRY_EMPTY, NULL, 0, &samples[i]) < 0) {
+                fprintf(stderr, "%s: run failed\n", kinds[k].name);
+                break;
+            }
+        }
+        report(kinds[k].name, samples, i, 0);
+        close(fd);
+    }
+}
+
+static void bench_ring(uint64_t *samples) {
+    struct setup_ring_request setup = { .entries = RING_BATCH };
+    struct run_ring_header *header;
+    struct run_ring_sqe *sqes;
+    uint8_t *base;
+    uint64_t start;
+    int i, j, fd, done;
+
+    if(!enabled("ring_empty")) return;
+    if((fd = open_session(WASM_START_RUNNER, MEMORY_LEN)) < 0) return;
+    if(ioctl(fd, WASM_SETUP_RING, &setup) < 0) {
+        perror("WASM_SETUP_RING");
+        close(fd);
+        return;
+    }
+    base = mmap(NULL, setup.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, WASM_MMAP_RING_OFFSET);
+    if(base == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return;
+    }
+    header = (struct run_ring_header *) base;
+    sqes = (struct run_ring_sqe *) (base + header->sqe_offset);
+
+    for(i = 0; i < sample_count; i++) {
+        for(j = 0; j < RING_BATCH; j++) {
+            memset(&sqes[(header->sq_tail + j) & (RING_BATCH - 1)], 0, sizeof(struct run_ring_sqe));
+            sqes[(header->sq_tail + j) & (RING_BATCH - 1)].entry_offset = ENTRY_EMPTY;
+        }
+        __atomic_store_n(&header->sq_tail, header->sq_tail + RING_BATCH, __ATOMIC_RELEASE);
+
+        start = now_ns();
+        done = ioctl(fd, WASM_RING_ENTER, NULL);
+        samples[i] = (now_ns() - start) / RING_BATCH;
+        if(done != RING_BATCH) {
+            fprintf(stderr, "ring_empty: %d completions\n", done);
+            break;
+        }
+        __atomic_store_n(&header->cq_head, header->cq_tail, __ATOMIC_RELEASE);
+    }
+    report("ring_empty", samples, i, 0);
+    munmap(base, setup.mmap_size);
+    close(fd);
+}
+
+// Per-call cost, net of the round trip of an empty call on the same runner.
+static void bench_host_calls(uint64_t *samples) {
+    char name[64];
+    uint64_t base, params[2];
+    unsigned k;
+    int i, fd;
+
+    for(k = 0; k < sizeof(guest_imports) / sizeof(guest_imports[0]); k++) {
+        snprintf(name, sizeof(name), "host_call_%s", guest_imports[k].name + strlen("bench##"));
+        if(!enabled(name)) continue;
+        if((fd = open_session(WASM_START_RUNNER, MEMORY_LEN)) < 0) continue;
+
+        base = median_empty_run(fd, samples);
+        params[0] = k;
+        params[1] = HOST_CALL_BATCH;
+        for(i = 0; i < sample_count; i++) {
+            if(run(fd, ENTRY_HOST_CALLS, params, 2, &samples[i]) < 0) break;
+            samples[i] = samples[i] > base ? (samples[i] - base) / HOST_CALL_BATCH : 0;
+        }
+        report(name, samples, i, 0);
+        close(fd);
+    }
+}
+
+// Per-grow cost of one wasm page. Every sample starts from a new engine, so that memory keeps its initial size.
+static void bench_memory_grow(uint64_t *samples) {
+    uint64_t base, params[1] = { MEMORY_GROW_BATCH };
+    uint64_t *scratch;
+    int i, fd;
+
+    if(!enabled("memory_grow")) return;
+    scratch = calloc(sample_count, sizeof(uint64_t));
+    if(!scratch) return;
+
+    if((fd = open_session(WASM_START_RUNNER, MEMORY_LEN)) < 0) {
+        free(scratch);
+        return;
+    }
+    base = median_empty_run(fd, scratch);
+    close(fd);
+
+    for(i = 0; i < sample_count; i++) {
+        if((fd = open_session(WASM_START_RUNNER, MEMORY_LEN)) < 0) break;
+        if(run(fd, ENTRY_MEMORY_GROW, params, 1, &samples[i]) < 0) {
+            close(fd);
+            break;
+        }
+        samples[i] = samples[i] > base ? (samples[i] - base) / MEMORY_GROW_BATCH : 0;
+        close(fd);
+    }
+    report("memory_grow", samples, i, 0);
+    free(scratch);
+}
+
+static void bench_memory_rw(uint64_t *samples) {
+    struct memory_request req = { .offset = 0, .len = RW_MEMORY_LEN };
+    uint64_t start;
+    uint8_t *buf;
+    int i, n, fd;
+
+    if(!enabled("read_memory") && !enabled("write_memory")) return;
+    buf = malloc(RW_MEMORY_LEN);
+    if(!buf) return;
+    memset(buf, 0x5a, RW_MEMORY_LEN);
+    req.buf = buf;
+
+    if((fd = open_session(0, RW_MEMORY_LEN)) < 0) {
+        free(buf);
+        return;
+    }
+    for(n = 0; n < 2; n++) {
+        const char *name = n ? "write_memory" : "read_memory";
+        if(!enabled(name)) continue;
+
+        for(i = 0; i < sample_count; i++) {
+            start = now_ns();
+            if(ioctl(fd, n ? WASM_WRITE_MEMORY : WASM_READ_MEMORY, &req) < 0) {
+                perror(name);
+                break;
+            }
+            samples[i] = now_ns() - start;
+        }
+        report(name, samples, i, RW_MEMORY_LEN);
+    }
+    close(fd);
+    free(buf);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n samples] [-d device] [-b name-filter]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t *samples;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:d:b:")) != -1) {
+        switch(opt) {
+            case 'n': sample_count = atoi(optarg); break;
+            case 'd': device = optarg; break;
+            case 'b': filter = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(sample_count <= 0) usage(argv[0]);
+
+    samples = calloc(sample_count, sizeof(uint64_t));
+    memory_image = calloc(1, RW_MEMORY_LEN);
+    if(!samples || !memory_image) {
+        perror("calloc");
+        return 1;
+    }
+
+    bench_load_code(samples);
+    bench_run_code(samples);
+    bench_ring(samples);
+    bench_host_calls(samples);
+    bench_memory_grow(samples);
+    bench_memory_rw(samples);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <linux/module.h>
+#include "../kapi.h"
+#include "../vm.h"
+
+// Host functions that do nothing, so that the benchmark driver can measure the cost of a host call
+// itself for different arities. Stateless, so loading this module adds no per-engine setup cost.
+
+struct import_resolver *resolver;
+
+uint64_t __bench_nop0(struct vmctx *ctx) {
+    return 0;
+}
+
+uint64_t __bench_nop2(struct vmctx *ctx, uint64_t a, uint64_t b) {
+    return a;
+}
+
+uint64_t __bench_nop6(struct vmctx *ctx, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f) {
+    return a;
+}
+
+static const struct import_entry bench_imports[] = {
+    { "bench##nop0", __bench_nop0, 0 },
+    { "bench##nop2", __bench_nop2, 2 },
+    { "bench##nop6", __bench_nop6, 6 },
+};
+
+int __init init_module(void) {
+    struct import_resolver tmp = {
+        .imports = bench_imports,
+        .import_count = ARRAY_SIZE(bench_imports),
+    };
+    resolver = kwasm_resolver_register(&tmp);
+    if(IS_ERR(resolver)) {
+        return PTR_ERR(resolver);
+    }
+    return 0;
+}
+
+void __exit cleanup_module(void) {
+    kwasm_resolver_deregister(resolver);
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Throughput of the echo-server and http-server examples under kernel-wasm and natively, as JSON lines
+# in the same format as `bench`. Binaries are taken from the environment:
+#
+#   ECHO_WASM, HTTP_WASM      example modules, run with `$WASMER run --backend singlepass --loader kernel`
+#   ECHO_NATIVE, HTTP_NATIVE  native builds of the same examples
+#   WASMER, TCPKALI, WRK      tools (default: found in PATH)
+#   ECHO_PORT, HTTP_PORT      ports the examples listen on (default: 2001 and 2002)
+#   DURATION                  seconds per measurement (default: 10)
+#
+# Servers that are not given are skipped.
+
+WASMER=${WASMER:-wasmer}
+TCPKALI=${TCPKALI:-tcpkali}
+WRK=${WRK:-wrk}
+ECHO_PORT=${ECHO_PORT:-2001}
+HTTP_PORT=${HTTP_PORT:-2002}
+DURATION=${DURATION:-10}
+
+start_server() {
+    "$@" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+}
+
+stop_server() {
+    kill "$SERVER_PID" 2> /dev/null
+    wait "$SERVER_PID" 2> /dev/null
+}
+
+# Converts a wrk latency such as 1.23ms to nanoseconds.
+to_ns() {
+    echo "$1" | awk '
+        /us$/ { sub(/us$/, ""); printf "%d\n", $0 * 1000; next }
+        /ms$/ { sub(/ms$/, ""); printf "%d\n", $0 * 1000000; next }
+        /s$/ { sub(/s$/, ""); printf "%d\n", $0 * 1000000000; next }
+    '
+}
+
+bench_echo() {
+    name=$1
+    shift
+    [ -n "$1" ] || return
+    start_server "$@"
+    mbps=$("$TCPKALI" -T "${DURATION}s" -c 64 -m 'hello' "127.0.0.1:$ECHO_PORT" 2> /dev/null |
+        awk '/Aggregate bandwidth/ { gsub(/[^0-9.]/, " ", $0); split($0, v, " "); print v[1] }')
+    stop_server
+    printf '{"name": "%s", "unit": "mbps", "value": %s}\n' "$name" "${mbps:-0}"
+}
+
+bench_http() {
+    name=$1
+    shift
+    [ -n "$1" ] || return
+    start_server "$@"
+    out=$("$WRK" -d "${DURATION}s" -c 128 -t 4 --latency "http://127.0.0.1:$HTTP_PORT/")
+    stop_server
+    rps=$(echo "$out" | awk '/Requests\/sec/ { print $2 }')
+    p50=$(to_ns "$(echo "$out" | awk '$1 == "50%" { print $2 }')")
+    p90=$(to_ns "$(echo "$out" | awk '$1 == "90%" { print $2 }')")
+    p99=$(to_ns "$(echo "$out" | awk '$1 == "99%" { print $2 }')")
+    printf '{"name": "%s", "unit": "rps", "value": %s, "latency_p50": %s, "latency_p90": %s, "latency_p99": %s}\n' \
+        "$name" "${rps:-0}" "${p50:-0}" "${p90:-0}" "${p99:-0}"
+}
+
+WASM_RUN="$WASMER run --backend singlepass --disable-cache --loader kernel"
+
+[ -n "$ECHO_WASM" ] && bench_echo echo_kernel_wasm $WASM_RUN "$ECHO_WASM"
+bench_echo echo_native "$ECHO_NATIVE"
+[ -n "$HTTP_WASM" ] && bench_http http_kernel_wasm $WASM_RUN "$HTTP_WASM"
+bench_http http_native "$HTTP_NATIVE"
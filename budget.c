@@ -0,0 +1,52 @@
+#include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include "vm.h"
+
+// Fires at the earliest time the budget can be used up. CPU time never runs ahead of wall time,
+// so a CPU time budget only has to be checked again for what is left of it.
+static enum hrtimer_restart ee_budget_expire(struct hrtimer *timer) {
+    struct execution_engine *ee = container_of(timer, struct execution_engine, budget_timer);
+    uint64_t wall, cpu;
+
+    if(ee->budget_kind == WASM_BUDGET_CPU_TIME) {
+        ee_stats_run_usage(ee, &wall, &cpu);
+        if(!READ_ONCE(ee->run_start_ns)) {
+            cpu = 0; // not started yet, or finished and about to be stopped
+        }
+        if(cpu < ee->budget_ns) {
+            hrtimer_forward_now(timer, ns_to_ktime(ee->budget_ns - cpu));
+            return HRTIMER_RESTART;
+        }
+    }
+
+    ee_interrupt(ee);
+    WRITE_ONCE(ee->budget_exceeded, 1);
+    up(ee->budget_wake); // the controlling thread kills the runner
+    return HRTIMER_NORESTART;
+}
+
+// Arms the budget of the next call of `ee`. Once it is used up, the engine is interrupted and
+// `wake`, which the controlling thread waits on for the call to complete, is raised once more.
+void ee_budget_start(struct execution_engine *ee, int kind, uint64_t budget_ns, struct semaphore *wake) {
+    ee->budget_kind = kind;
+    ee->budget_ns = budget_ns;
+    ee->budget_wake = wake;
+    ee->budget_exceeded = 0;
+
+    hrtimer_init(&ee->budget_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ee->budget_timer.function = ee_budget_expire;
+    hrtimer_start(&ee->budget_timer, ns_to_ktime(budget_ns), HRTIMER_MODE_REL);
+}
+
+// Disarms the budget once the call has completed or its runner is gone. Returns 1 if the budget
+// was used up, in which case `wake` has been raised.
+int ee_budget_stop(struct execution_engine *ee) {
+    if(!ee->budget_kind) return 0; // not armed
+    hrtimer_cancel(&ee->budget_timer);
+    ee->budget_kind = 0;
+    if(!ee->budget_exceeded) return 0;
+
+    ee_interrupt_clear(ee); // the timer may have fired after the call returned
+    return 1;
+}
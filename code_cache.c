@@ -0,0 +1,326 @@
+#include <linux/module.h>
+#include <linux/hashtable.h>
+#include <linux/xxhash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ctype.h>
+#include "vm.h"
+
+#define CODE_CACHE_BITS 8
+#define MAX_SYMBOL_COUNT 1048576
+#define CODE_CACHE_CHUNK_SIZE 65536
+
+static DEFINE_HASHTABLE(code_cache, CODE_CACHE_BITS);
+static DEFINE_MUTEX(code_cache_mu);
+
+static struct code_image *code_image_alloc(uint32_t code_len) {
+    struct code_image *img;
+
+    img = kzalloc(sizeof(struct code_image), GFP_KERNEL);
+    if(!img) return ERR_PTR(-ENOMEM);
+
+    img->code = __vmalloc(round_up_to_page_size(code_len), GFP_KERNEL, PAGE_KERNEL); // only run through `code_image_map`
+    if(img->code == NULL) {
+        kfree(img);
+        return ERR_PTR(-ENOMEM);
+    }
+    if((((unsigned long) img->code) & 4095) != 0) {
+        printk(KERN_INFO "Executable memory not aligned to page boundary\n");
+        vfree(img->code);
+        kfree(img);
+        return ERR_PTR(-EINVAL);
+    }
+    img->code_len = code_len;
+    INIT_LIST_HEAD(&img->maps);
+    return img;
+}
+
+static void code_image_free(struct code_image *img) {
+    vfree(img->code);
+    kfree(img);
+}
+
+// Adds the new image `img`, filled with the code, to the cache, unless an identical image is already
+// there: then `img` is freed and the cached one returned instead. Only kernel memory is read under the lock.
+static struct code_image *code_image_insert(struct code_image *img, uint64_t import_hash) {
+    struct code_image *cached;
+
+    img->hash = xxh64(img->code, img->code_len, import_hash);
+    img->import_hash = import_hash;
+
+    mutex_lock(&code_cache_mu);
+    hash_for_each_possible(code_cache, cached, node, img->hash) {
+        if(
+            cached->hash != img->hash || cached->import_hash != import_hash ||
+            cached->code_len != img->code_len || memcmp(cached->code, img->code, img->code_len)
+        ) {
+            continue;
+        }
+        if(!kref_get_unless_zero(&cached->ref)) continue; // being released
+        mutex_unlock(&code_cache_mu);
+        code_image_free(img);
+        return cached;
+    }
+    kref_init(&img->ref);
+    hash_add(code_cache, &img->node, img->hash);
+    mutex_unlock(&code_cache_mu);
+
+    return img;
+}
+
+// Hashes user `code` as `code_image_insert` hashes images, reading it in chunks through `buf`.
+static int code_hash_user(const uint8_t __user *code, uint32_t code_len, uint64_t import_hash, uint8_t *buf, uint64_t *hash) {
+    struct xxh64_state state;
+    uint32_t done, n;
+
+    xxh64_reset(&state, import_hash);
+    for(done = 0; done < code_len; done += n) {
+        n = min_t(uint32_t, code_len - done, CODE_CACHE_CHUNK_SIZE);
+        if(copy_from_user(buf, code + done, n)) return -EFAULT;
+        xxh64_update(&state, buf, n);
+    }
+    *hash = xxh64_digest(&state);
+    return 0;
+}
+
+// Returns 1 if user `code` is the code of `img`, reading it in chunks through `buf`.
+static int code_image_matches_user(struct code_image *img, const uint8_t __user *code, uint8_t *buf) {
+    uint32_t done, n;
+
+    for(done = 0; done < img->code_len; done += n) {
+        n = min_t(uint32_t, img->code_len - done, CODE_CACHE_CHUNK_SIZE);
+        if(copy_from_user(buf, code + done, n)) return -EFAULT;
+        if(memcmp(buf, img->code + done, n)) return 0;
+    }
+    return 1;
+}
+
+// Returns a referenced cached image that may hold code hashing to `hash`, or NULL.
+static struct code_image *code_cache_lookup(uint64_t hash, uint64_t import_hash, uint32_t code_len) {
+    struct code_image *img;
+
+    mutex_lock(&code_cache_mu);
+    hash_for_each_possible(code_cache, img, node, hash) {
+        if(img->hash != hash || img->import_hash != import_hash || img->code_len != code_len) continue;
+        if(!kref_get_unless_zero(&img->ref)) continue; // being released
+        mutex_unlock(&code_cache_mu);
+        return img;
+    }
+    mutex_unlock(&code_cache_mu);
+    return NULL;
+}
+
+// Returns a referenced executable image of `code`, sharing it with other engines that loaded identical code
+// with the same import layout. User memory is only read outside the cache lock: the code is hashed and
+// compared with a cached candidate in chunks, and only copied into a new image on a miss.
+struct code_image *code_image_get(const uint8_t __user *code, uint32_t code_len, uint64_t import_hash) {
+    struct code_image *img;
+    uint8_t *buf;
+    uint64_t hash;
+    int ret;
+
+    buf = kmalloc(min_t(uint32_t, code_len, CODE_CACHE_CHUNK_SIZE), GFP_KERNEL);
+    if(!buf) return ERR_PTR(-ENOMEM);
+
+    if((ret = code_hash_user(code, code_len, import_hash, buf, &hash)) < 0) {
+        kfree(buf);
+        return ERR_PTR(ret);
+    }
+    img = code_cache_lookup(hash, import_hash, code_len);
+    if(img) {
+        ret = code_image_matches_user(img, code, buf);
+        if(ret > 0) {
+            kfree(buf);
+            return img;
+        }
+        code_image_put(img);
+        if(ret < 0) {
+            kfree(buf);
+            return ERR_PTR(ret);
+        }
+    }
+    kfree(buf);
+
+    img = code_image_alloc(code_len);
+    if(IS_ERR(img)) return img;
+
+    if(copy_from_user(img->code, code, code_len)) {
+        code_image_free(img);
+        return ERR_PTR(-EFAULT);
+    }
+    return code_image_insert(img, import_hash);
+}
+
+// Like `code_image_get`, for code read from `f` at `pos`. The code is read only once, so this also works
+// with files that cannot be read twice, such as pipes.
+struct code_image *code_image_get_from_file(struct file *f, loff_t pos, uint32_t code_len, uint64_t import_hash) {
+    int err;
+    struct code_image *img;
+
+    img = code_image_alloc(code_len);
+    if(IS_ERR(img)) return img;
+
+    if((err = kwasm_read_file(f, img->code, code_len, pos)) < 0) {
+        code_image_free(img);
+        return ERR_PTR(err);
+    }
+    return code_image_insert(img, import_hash);
+}
+
+void code_image_ref(struct code_image *img) {
+    kref_get(&img->ref);
+}
+
+static void code_image_release(struct kref *ref) {
+    struct code_image *img = container_of(ref, struct code_image, ref);
+
+    hash_del(&img->node);
+    mutex_unlock(&code_cache_mu);
+
+    kvfree(img->symbols);
+    code_image_free(img);
+}
+
+void code_image_put(struct code_image *img) {
+    kref_put_mutex(&img->ref, code_image_release, &code_cache_mu);
+}
+
+// Returns a new executable mapping of the pages of `img`, for one engine to run it from.
+uint8_t *code_image_map(struct code_image *img) {
+    unsigned long i, page_count = round_up_to_page_size(img->code_len) / PAGE_SIZE;
+    struct page **pages;
+    struct code_map *map;
+
+    map = kmalloc(sizeof(struct code_map), GFP_KERNEL);
+    if(!map) return NULL;
+
+    pages = kvmalloc_array(page_count, sizeof(struct page *), GFP_KERNEL);
+    if(!pages) {
+        kfree(map);
+        return NULL;
+    }
+    for(i = 0; i < page_count; i++) {
+        pages[i] = vmalloc_to_page(img->code + i * PAGE_SIZE);
+    }
+    map->code = vmap(pages, page_count, VM_MAP, PAGE_KERNEL_EXEC);
+    kvfree(pages);
+    if(!map->code) {
+        kfree(map);
+        return NULL;
+    }
+
+    mutex_lock(&code_cache_mu);
+    list_add(&map->node, &img->maps);
+    mutex_unlock(&code_cache_mu);
+    return map->code;
+}
+
+void code_image_unmap(struct code_image *img, uint8_t *code) {
+    struct code_map *map;
+
+    mutex_lock(&code_cache_mu);
+    list_for_each_entry(map, &img->maps, node) {
+        if(map->code != code) continue;
+        list_del(&map->node);
+        mutex_unlock(&code_cache_mu);
+
+        vunmap(map->code);
+        kfree(map);
+        return;
+    }
+    mutex_unlock(&code_cache_mu);
+    WARN_ON(1);
+}
+
+// Replaces the symbols of `img`. Engines sharing the image share its symbols too, which is fine since
+// they loaded identical code.
+int code_image_set_symbols(struct code_image *img, const struct symbol_entry_request __user *symbols, uint32_t count) {
+    struct code_symbol *syms = NULL, *old;
+    uint32_t i;
+    char *c;
+
+    if(count > MAX_SYMBOL_COUNT) return -EINVAL;
+
+    if(count) {
+        syms = kvmalloc_array(count, sizeof(struct code_symbol), GFP_KERNEL);
+        if(!syms) return -ENOMEM;
+
+        BUILD_BUG_ON(sizeof(struct code_symbol) != sizeof(struct symbol_entry_request));
+        if(copy_from_user(syms, symbols, sizeof(struct code_symbol) * count)) {
+            kvfree(syms);
+            return -EFAULT;
+        }
+
+        for(i = 0; i < count; i++) {
+            if((uint64_t) syms[i].offset + syms[i].size > img->code_len) {
+                kvfree(syms);
+                return -EINVAL;
+            }
+            syms[i].name[sizeof(syms[i].name) - 1] = 0;
+            if(!syms[i].name[0]) {
+                kvfree(syms);
+                return -EINVAL;
+            }
+
+            // Keep the kallsyms-format output parseable.
+            for(c = syms[i].name; *c; c++) {
+                if(!isalnum(*c) && *c != '_' && *c != '.' && *c != '$') *c = '_';
+            }
+        }
+    }
+
+    mutex_lock(&code_cache_mu);
+    old = img->symbols;
+    img->symbols = syms;
+    img->symbol_count = count;
+    mutex_unlock(&code_cache_mu);
+
+    kvfree(old);
+    return 0;
+}
+
+// Lists the functions of all loaded code in /proc/kallsyms format, so that `perf report --kallsyms`
+// can resolve samples in guest code. Images without symbols appear as one function each, once for
+// each engine mapping them.
+static int code_cache_kallsyms_show(struct seq_file *m, void *_unused) {
+    struct code_image *img;
+    struct code_map *map;
+    uint32_t i;
+    int bkt;
+
+    mutex_lock(&code_cache_mu);
+    hash_for_each(code_cache, bkt, img, node) {
+        list_for_each_entry(map, &img->maps, node) {
+            if(!img->symbol_count) {
+                seq_printf(m, "%px t wasm_code_%016llx\t[kwasm]\n", map->code, img->hash);
+                continue;
+            }
+            for(i = 0; i < img->symbol_count; i++) {
+                seq_printf(m, "%px t %s\t[kwasm]\n", map->code + img->symbols[i].offset, img->symbols[i].name);
+            }
+        }
+    }
+    mutex_unlock(&code_cache_mu);
+    return 0;
+}
+
+static int code_cache_kallsyms_open(struct inode *inode, struct file *f) {
+    return single_open(f, code_cache_kallsyms_show, NULL);
+}
+
+static const struct file_operations code_cache_kallsyms_ops = {
+    .owner = THIS_MODULE,
+    .open = code_cache_kallsyms_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void code_cache_debugfs_init(struct dentry *dir) {
+    debugfs_create_file("kallsyms", 0400, dir, NULL, &code_cache_kallsyms_ops);
+}
+
+uint64_t code_import_hash_update(uint64_t hash, const struct import_request *req) {
+    hash = xxh64(req->name, strnlen(req->name, sizeof(req->name)), hash);
+    return xxh64(&req->param_count, sizeof(req->param_count), hash);
+}
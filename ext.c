@@ -9,6 +9,18 @@ void destroy_global_registry(void);
 int vm_init(void);
 void vm_cleanup(void);
 
+int pool_init(void);
+void pool_cleanup(void);
+
+int stats_init(void);
+void stats_cleanup(void);
+
+int sched_init(void);
+void sched_cleanup(void);
+
+int hook_init(void);
+void hook_cleanup(void);
+
 int __init init_module(void) {
     if(uapi_init() != 0) {
         return -EINVAL;
@@ -22,11 +34,45 @@ int __init init_module(void) {
         uapi_cleanup();
         return -EINVAL;
     }
+    if(sched_init() != 0) {
+        vm_cleanup();
+        destroy_global_registry();
+        uapi_cleanup();
+        return -EINVAL;
+    }
+    if(stats_init() != 0) {
+        sched_cleanup();
+        vm_cleanup();
+        destroy_global_registry();
+        uapi_cleanup();
+        return -EINVAL;
+    }
+    if(pool_init() != 0) {
+        stats_cleanup();
+        sched_cleanup();
+        vm_cleanup();
+        destroy_global_registry();
+        uapi_cleanup();
+        return -EINVAL;
+    }
+    if(hook_init() != 0) {
+        pool_cleanup();
+        stats_cleanup();
+        sched_cleanup();
+        vm_cleanup();
+        destroy_global_registry();
+        uapi_cleanup();
+        return -EINVAL;
+    }
     printk(KERN_INFO "linux-ext-wasm: Module loaded\n");
     return 0;
 }
 
 void __exit cleanup_module(void) {
+    hook_cleanup();
+    pool_cleanup();
+    stats_cleanup();
+    sched_cleanup();
     vm_cleanup();
     destroy_global_registry();
     uapi_cleanup();
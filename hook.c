@@ -0,0 +1,281 @@
+#include <linux/module.h>
+#include <linux/netfilter.h>
+#include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/kdebug.h>
+#include <linux/percpu.h>
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
+#include <asm/irq_regs.h>
+#include "vm.h"
+#include "coroutine.h"
+
+// Packet hooks run a module from netfilter, in softirq context or with BH disabled, on a per-CPU
+// instance of it created from a snapshot of the session. Nothing there may sleep, so hook engines
+// must be FPU-free, have no imports and cannot grow their memory.
+//
+// A guest cannot be killed like a runner thread there: an oops in softirq context is fatal. Instead,
+// traps in guest code and guests running past their budget are redirected to `hook_trap_landing`
+// on their own stack, which switches back to the host as if the call had returned.
+//
+// Page faults cannot be caught before the kernel prints an oops and taints itself, so hook engines
+// must also check their memory accesses explicitly (WASM_LOAD_OPTION_BOUNDS_CHECKED) rather than
+// fault on the linear memory guard pages.
+
+static int hook_budget_us = 1000;
+module_param(hook_budget_us, int, 0644);
+MODULE_PARM_DESC(hook_budget_us, "Default time a packet hook call may run before it is interrupted (us)");
+
+#define HOOK_BUDGET_RETRY_NS 20000
+
+struct hook_call {
+    struct execution_engine *ee;
+    uint32_t entry_offset;
+    uint64_t params[2];
+    uint64_t ret;
+    int trapped;
+    struct Coroutine co;
+};
+
+struct hook_cpu {
+    struct hrtimer timer;
+    struct hook_call *call; // running on this CPU, if any
+};
+
+static DEFINE_PER_CPU(struct hook_cpu, hook_cpus);
+
+struct wasm_hook {
+    struct nf_hook_ops ops;
+    struct net *net;
+    struct execution_engine **engines; // by CPU
+    struct attach_hook_request req;
+    uint64_t budget_ns;
+};
+
+static void hook_trap_landing(struct Coroutine *co) {
+    struct hook_call *call = co->private_data;
+
+    call->trapped = 1;
+    co->terminated = 1;
+    co_switch(&co->stack);
+}
+
+static int hook_call_owns(struct hook_call *call, struct pt_regs *regs) {
+    struct execution_engine *ee = call->ee;
+
+    return !user_mode(regs) &&
+        regs->ip >= (unsigned long) ee->code && regs->ip < (unsigned long) ee->code + ee->code_len &&
+        regs->sp >= (unsigned long) ee->stack_begin && regs->sp < (unsigned long) ee->stack_end;
+}
+
+// Makes `regs` return into `hook_trap_landing`, as if called from the top of the guest stack.
+static void hook_call_redirect(struct hook_call *call, struct pt_regs *regs) {
+    regs->sp = ((unsigned long) call->ee->stack_end & ~15ul) - 64 - 8;
+    regs->ip = (unsigned long) hook_trap_landing;
+    regs->di = (unsigned long) &call->co;
+}
+
+// Guests hitting their stack check (see `ee_interrupt`), or failing any other check of generated code,
+// end up here before the kernel would oops. Page faults in guest code, which bounds-checked code only
+// makes on a stack guard page, arrive as DIE_OOPS once the oops has been printed; the call is still
+// ended rather than the kernel brought down.
+static int hook_die_notify(struct notifier_block *nb, unsigned long val, void *data) {
+    struct die_args *args = data;
+    struct hook_call *call;
+
+    if(val != DIE_TRAP && val != DIE_GPF && val != DIE_OOPS) return NOTIFY_DONE;
+
+    call = this_cpu_read(hook_cpus.call);
+    if(!call || !args->regs || !hook_call_owns(call, args->regs)) return NOTIFY_DONE;
+
+    hook_call_redirect(call, args->regs);
+    return NOTIFY_STOP;
+}
+
+static struct notifier_block hook_die_nb = {
+    .notifier_call = hook_die_notify,
+};
+
+// Runs in hardirq context on the CPU of the call. If it interrupted guest code, the call is ended
+// right away, which also covers loops without calls; otherwise the guest is in an intrinsic and traps
+// at its next call.
+static enum hrtimer_restart hook_budget_expire(struct hrtimer *timer) {
+    struct hook_call *call = this_cpu_read(hook_cpus.call);
+    struct pt_regs *regs = get_irq_regs();
+
+    if(!call) return HRTIMER_NORESTART;
+
+    if(regs && hook_call_owns(call, regs)) {
+        hook_call_redirect(call, regs);
+        return HRTIMER_NORESTART;
+    }
+
+    ee_interrupt(call->ee);
+    hrtimer_forward_now(timer, ns_to_ktime(HOOK_BUDGET_RETRY_NS));
+    return HRTIMER_RESTART;
+}
+
+static void hook_call_inner(struct Coroutine *co) {
+    struct hook_call *call = co->private_data;
+
+    call->ret = ee_call(call->ee, call->entry_offset, call->params, 2);
+}
+
+static unsigned int hook_run(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+    struct wasm_hook *hook = priv;
+    struct hook_cpu *hc;
+    struct execution_engine *ee;
+    struct hook_call call;
+    uint32_t len;
+    unsigned int verdict;
+
+    // Netfilter may call us with only RCU held from process context.
+    local_bh_disable();
+
+    hc = this_cpu_ptr(&hook_cpus);
+    ee = hook->engines[smp_processor_id()];
+
+    len = min_t(uint32_t, skb->len, hook->req.scratch_len);
+    if(skb_copy_bits(skb, 0, ee->ctx.memory_base + hook->req.scratch_offset, len) < 0) {
+        local_bh_enable();
+        return hook->req.trap_verdict == WASM_HOOK_DROP ? NF_DROP : NF_ACCEPT;
+    }
+
+    call.ee = ee;
+    call.entry_offset = hook->req.entry_offset;
+    call.params[0] = len;
+    call.params[1] = skb->len;
+    call.ret = 0;
+    call.trapped = 0;
+    call.co.stack = ee->stack_end;
+    call.co.entry = hook_call_inner;
+    call.co.terminated = 0;
+    call.co.private_data = &call;
+
+    hc->call = &call;
+    hrtimer_start(&hc->timer, ns_to_ktime(hook->budget_ns), HRTIMER_MODE_REL_PINNED);
+
+    start_coroutine(&call.co);
+    while(!call.co.terminated) {
+        co_switch(&call.co.stack);
+    }
+
+    hrtimer_try_to_cancel(&hc->timer);
+    hc->call = NULL;
+    ee_interrupt_clear(ee); // the timer may have interrupted it without a trap
+
+    if(call.trapped) {
+        ee_stats_record_kill(ee);
+        verdict = hook->req.trap_verdict;
+    } else {
+        verdict = (uint32_t) call.ret;
+    }
+    local_bh_enable();
+
+    return verdict == WASM_HOOK_DROP ? NF_DROP : NF_ACCEPT;
+}
+
+static void hook_free(struct wasm_hook *hook) {
+    int cpu;
+
+    if(hook->engines) {
+        for_each_possible_cpu(cpu) {
+            if(!hook->engines[cpu]) continue;
+            destroy_execution_engine(hook->engines[cpu]);
+            kfree(hook->engines[cpu]);
+        }
+        kfree(hook->engines);
+    }
+    if(hook->net) put_net(hook->net);
+    kfree(hook);
+}
+
+// Registers a netfilter hook running `req->entry_offset` of the module of `ee` in the caller's network
+// namespace. Instances of the module are created for each CPU from its current state.
+struct wasm_hook *hook_attach(struct execution_engine *ee, const struct attach_hook_request *req) {
+    int cpu, err = 0;
+    struct wasm_hook *hook;
+    struct ee_snapshot *snap;
+    struct execution_engine *inst;
+
+    if(!ee->fpu_free || !ee->bounds_checked || ee->imported_func_count) return ERR_PTR(-EINVAL);
+    if(req->entry_offset >= ee->code_len) return ERR_PTR(-EINVAL);
+    if(req->trap_verdict != WASM_HOOK_DROP && req->trap_verdict != WASM_HOOK_ACCEPT) return ERR_PTR(-EINVAL);
+    if(req->pf >= NFPROTO_NUMPROTO || req->hooknum >= NF_MAX_HOOKS) return ERR_PTR(-EINVAL);
+    if(!vmctx_get_memory_slice(&ee->ctx, req->scratch_offset, req->scratch_len)) return ERR_PTR(-EINVAL);
+
+    hook = kzalloc(sizeof(struct wasm_hook), GFP_KERNEL);
+    if(!hook) return ERR_PTR(-ENOMEM);
+    hook->req = *req;
+    hook->budget_ns = (uint64_t) (req->budget_us ? req->budget_us : max(READ_ONCE(hook_budget_us), 1)) * NSEC_PER_USEC;
+
+    hook->engines = kcalloc(nr_cpu_ids, sizeof(struct execution_engine *), GFP_KERNEL);
+    if(!hook->engines) {
+        err = -ENOMEM;
+        goto fail;
+    }
+
+    snap = ee_snapshot_create(ee);
+    if(IS_ERR(snap)) {
+        err = PTR_ERR(snap);
+        goto fail;
+    }
+    for_each_possible_cpu(cpu) {
+        inst = kzalloc(sizeof(struct execution_engine), GFP_KERNEL);
+        if(!inst) {
+            err = -ENOMEM;
+            break;
+        }
+        if((err = init_execution_engine_from_snapshot(snap, inst)) < 0) {
+            kfree(inst);
+            break;
+        }
+        inst->no_sleep = 1;
+        hook->engines[cpu] = inst;
+    }
+    ee_snapshot_put(snap);
+    if(err < 0) goto fail;
+
+    hook->net = get_net(current->nsproxy->net_ns);
+    hook->ops.hook = hook_run;
+    hook->ops.priv = hook;
+    hook->ops.pf = req->pf;
+    hook->ops.hooknum = req->hooknum;
+    hook->ops.priority = req->priority;
+    if((err = nf_register_net_hook(hook->net, &hook->ops)) < 0) {
+        goto fail;
+    }
+    return hook;
+
+    fail:
+    hook_free(hook);
+    return ERR_PTR(err);
+}
+
+void hook_detach(struct wasm_hook *hook) {
+    // Waits for calls in progress.
+    nf_unregister_net_hook(hook->net, &hook->ops);
+    hook_free(hook);
+}
+
+int hook_init(void) {
+    int cpu;
+    struct hook_cpu *hc;
+
+    for_each_possible_cpu(cpu) {
+        hc = per_cpu_ptr(&hook_cpus, cpu);
+        hrtimer_init(&hc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        hc->timer.function = hook_budget_expire;
+        hc->call = NULL;
+    }
+    return register_die_notifier(&hook_die_nb);
+}
+
+void hook_cleanup(void) {
+    int cpu;
+
+    unregister_die_notifier(&hook_die_nb);
+    for_each_possible_cpu(cpu) {
+        hrtimer_cancel(&per_cpu_ptr(&hook_cpus, cpu)->timer);
+    }
+}
@@ -1,26 +1,48 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/stringhash.h>
 
 #include "kapi.h"
+#include "vm.h"
+
+#define IMPORT_INDEX_BITS 9
+
+struct import_index_entry {
+    struct hlist_node node;
+    const struct import_entry *import;
+    unsigned int hash;
+};
 
 struct resolver_entry {
     struct import_resolver inner;
     struct list_head list;
+    struct import_index_entry *index_entries;
 };
 
 struct registry {
     struct mutex mu;
     struct list_head resolvers;
     int resolver_count;
+    int dynamic_resolver_count; // resolvers with `get_instance`
 };
 
 static struct registry global_registry;
 
+// Static imports of all registered resolvers, by name. Written under `global_registry.mu`, read under RCU.
+static DEFINE_HASHTABLE(import_index, IMPORT_INDEX_BITS);
+
+static unsigned int import_name_hash(const char *name) {
+    return full_name_hash(NULL, name, strlen(name));
+}
+
 int init_global_registry(void) {
     mutex_init(&global_registry.mu);
     INIT_LIST_HEAD(&global_registry.resolvers);
     global_registry.resolver_count = 0;
+    global_registry.dynamic_resolver_count = 0;
     return 0;
 }
 
@@ -28,23 +50,45 @@ void destroy_global_registry(void) {
     struct list_head *x;
     struct resolver_entry *last = NULL;
     list_for_each(x, &global_registry.resolvers) {
+        if(last) kfree(last->index_entries);
         kfree(last);
         last = container_of(x, struct resolver_entry, list);
     }
+    if(last) kfree(last->index_entries);
     kfree(last);
 }
 
 struct import_resolver * kwasm_resolver_register(struct import_resolver *resolver) {
     struct resolver_entry *entry;
+    struct import_index_entry *ie;
+    int i;
     
     entry = kmalloc(sizeof(struct resolver_entry), GFP_KERNEL);
     if(!entry) return ERR_PTR(-ENOMEM);
 
     memcpy(&entry->inner, resolver, sizeof(struct import_resolver));
 
+    entry->index_entries = NULL;
+    if(resolver->imports && resolver->import_count) {
+        entry->index_entries = kcalloc(resolver->import_count, sizeof(struct import_index_entry), GFP_KERNEL);
+        if(!entry->index_entries) {
+            kfree(entry);
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+
     mutex_lock(&global_registry.mu);
     list_add(&entry->list, &global_registry.resolvers);
     global_registry.resolver_count++;
+    if(entry->inner.get_instance) global_registry.dynamic_resolver_count++;
+
+    // Newer registrations shadow older ones with the same name, as with dynamic resolution.
+    for(i = 0; entry->index_entries && i < resolver->import_count; i++) {
+        ie = &entry->index_entries[i];
+        ie->import = &resolver->imports[i];
+        ie->hash = import_name_hash(ie->import->name);
+        hash_add_rcu(import_index, &ie->node, ie->hash);
+    }
     resolver = &entry->inner;
     mutex_unlock(&global_registry.mu);
 
@@ -54,24 +98,52 @@ EXPORT_SYMBOL(kwasm_resolver_register);
 
 void kwasm_resolver_deregister(struct import_resolver *resolver) {
     struct resolver_entry *entry;
+    int i;
 
     mutex_lock(&global_registry.mu);
     entry = container_of(resolver, struct resolver_entry, inner);
     list_del(&entry->list);
-    kfree(entry);
+    for(i = 0; entry->index_entries && i < entry->inner.import_count; i++) {
+        hash_del_rcu(&entry->index_entries[i].node);
+    }
     global_registry.resolver_count--;
+    if(entry->inner.get_instance) global_registry.dynamic_resolver_count--;
     mutex_unlock(&global_registry.mu);
+
+    synchronize_rcu();
+    kfree(entry->index_entries);
+    kfree(entry);
 }
 EXPORT_SYMBOL(kwasm_resolver_deregister);
 
+// Returns the private data of the instance `resolver` created for `ee`, for use by stateful host functions.
+void *kwasm_resolver_instance_data(struct execution_engine *ee, struct import_resolver *resolver) {
+    int i;
+
+    for(i = 0; i < ee->resolver.resolver_count; i++) {
+        if(ee->resolver.resolvers[i].owner == resolver) return ee->resolver.resolvers[i].private_data;
+    }
+    return NULL;
+}
+EXPORT_SYMBOL(kwasm_resolver_instance_data);
+
 int get_module_resolver(struct execution_engine *ee, struct module_resolver *out) {
     int i;
     int err;
     struct resolver_entry *entry;
     struct list_head *x;
 
+    out->resolvers = NULL;
+    out->resolver_count = 0;
+
     mutex_lock(&global_registry.mu);
-    out->resolvers = kmalloc(sizeof(struct import_resolver_instance) * global_registry.resolver_count, GFP_KERNEL);
+    if(global_registry.dynamic_resolver_count == 0) {
+        // Only stateless providers; everything is resolved through the import index.
+        mutex_unlock(&global_registry.mu);
+        return 0;
+    }
+
+    out->resolvers = kmalloc(sizeof(struct import_resolver_instance) * global_registry.dynamic_resolver_count, GFP_KERNEL);
     if(!out->resolvers) {
         mutex_unlock(&global_registry.mu);
         return -ENOMEM;
@@ -80,17 +152,22 @@ int get_module_resolver(struct execution_engine *ee, struct module_resolver *out
     i = 0;
     list_for_each(x, &global_registry.resolvers) {
         entry = container_of(x, struct resolver_entry, list);
+        if(!entry->inner.get_instance) continue;
+
         memset(&out->resolvers[i], 0, sizeof(out->resolvers[i]));
         err = entry->inner.get_instance(ee, &entry->inner, &out->resolvers[i]);
         if(err) {
-            kfree(out->resolvers);
+            out->resolver_count = i;
+            release_module_resolver(out);
             out->resolvers = NULL;
+            out->resolver_count = 0;
             mutex_unlock(&global_registry.mu);
             return err;
         }
+        out->resolvers[i].owner = &entry->inner;
         i++;
     }
-    out->resolver_count = global_registry.resolver_count;
+    out->resolver_count = i;
 
     mutex_unlock(&global_registry.mu);
     return 0;
@@ -105,10 +182,32 @@ void release_module_resolver(struct module_resolver *in) {
     kfree(in->resolvers);
 }
 
+static int lookup_static_import(const char *name, struct import_info *out) {
+    unsigned int hash = import_name_hash(name);
+    struct import_index_entry *ie;
+    int found = 0;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(import_index, ie, node, hash) {
+        if(ie->hash == hash && strcmp(ie->import->name, name) == 0) {
+            out->fn = ie->import->fn;
+            out->param_count = ie->import->param_count;
+            found = 1;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return found;
+}
+
 void * module_resolver_resolve_import(struct module_resolver *r, const char *name, int param_count) {
     int i, err;
     struct import_info info;
 
+    if(lookup_static_import(name, &info)) {
+        return info.param_count == param_count ? info.fn : NULL;
+    }
+
     for(i = 0; i < r->resolver_count; i++) {
         if(r->resolvers[i].resolve) {
             err = r->resolvers[i].resolve(&r->resolvers[i], name, &info);
@@ -122,4 +221,4 @@ void * module_resolver_resolve_import(struct module_resolver *r, const char *nam
         }
     }
     return NULL;
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <linux/wait.h>
+
 struct execution_engine;
 
 struct import_info {
@@ -7,10 +9,13 @@ struct import_info {
     int param_count;
 };
 
+struct import_resolver;
+
 struct import_resolver_instance {
     int (*resolve)(struct import_resolver_instance *self, const char *name, struct import_info *info_out);
     void (*release)(struct import_resolver_instance *self);
     void *private_data;
+    struct import_resolver *owner; // set by the registry
 };
 
 struct module_resolver {
@@ -18,13 +23,43 @@ struct module_resolver {
     int resolver_count;
 };
 
+// An import provided by a stateless function, declared statically by its provider.
+struct import_entry {
+    const char *name;
+    void *fn;
+    int param_count;
+};
+
+// A provider either declares its imports statically through `imports`, which are then indexed by name
+// at registration, or resolves them per engine through `get_instance`, or both.
+// Static imports take precedence over dynamically resolved ones.
 struct import_resolver {
     int (*get_instance)(struct execution_engine *ee, struct import_resolver *self, struct import_resolver_instance *out);
     void *private_data;
+    const struct import_entry *imports;
+    int import_count;
 };
 
 struct import_resolver * kwasm_resolver_register(struct import_resolver *resolver);
 void kwasm_resolver_deregister(struct import_resolver *resolver);
+void *kwasm_resolver_instance_data(struct execution_engine *ee, struct import_resolver *resolver);
+
+struct file;
+int kwasm_map_file(struct execution_engine *ee, struct file *f, uint64_t file_offset, uint32_t len, uint32_t *offset_out);
+int kwasm_unmap_file(struct execution_engine *ee, uint32_t offset);
+
+// Async host calls. Guests run by an async runner share their CPU's executor thread, so a host call
+// must not block it: instead, it waits with `kwasm_wait_event` or `kwasm_wait_file`, which park the
+// guest and let the executor run others until woken. For other guests, these block as usual.
+// Both return like `wait_event_interruptible_timeout`, with `timeout` in jiffies.
+//
+// The executor has no time slice: a guest keeps it until it parks or its call returns, and so does a
+// host call that blocks without going through these. Calls of async runners without a budget of
+// their own get an `async_cpu_budget_ms` CPU time budget, after which they are interrupted and killed.
+struct vmctx;
+int kwasm_is_async(struct vmctx *ctx);
+long kwasm_wait_event(struct vmctx *ctx, wait_queue_head_t *wq, int (*cond)(void *data), void *data, long timeout);
+long kwasm_wait_file(struct vmctx *ctx, struct file *f, unsigned int events, long timeout);
 
 int get_module_resolver(struct execution_engine *ee, struct module_resolver *out);
 void release_module_resolver(struct module_resolver *in);
@@ -2,8 +2,20 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 #include <linux/net.h>
+#include <linux/socket.h>
+#include <linux/uio.h>
 #include <linux/nsproxy.h>
 #include <linux/kallsyms.h>
+#include <linux/fdtable.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
+#include <linux/tcp.h>
+#include <linux/splice.h>
 #include <uapi/linux/eventpoll.h>
 #include "../kapi.h"
 #include "../vm.h"
@@ -22,19 +34,206 @@ struct __itimerspec {
 	struct __timespec it_value;       /* timer expiration */
 };
 
+// Guest-side layout of message headers for the msg/mmsg calls. Control messages are not supported.
+struct __net_iovec {
+    wasm_pointer_t buf;
+    uint32_t buf_len;
+};
+
+struct __net_msghdr {
+    wasm_pointer_t name;
+    uint32_t namelen; // in/out for receives
+    wasm_pointer_t iov;
+    uint32_t iovlen;
+    uint32_t flags; // out: message flags for receives
+};
+
+struct __net_mmsghdr {
+    struct __net_msghdr hdr;
+    uint32_t len; // out: bytes transferred
+};
+
+#define NET_SOCK_TABLE_SIZE 256
+
+// Sockets of an engine by fd, so that hot host functions can skip the fd table and syscall layers.
+//
+// Entries hold no reference. An entry is valid as long as the fd still refers to the cached file:
+// the runner has a private file table that only it modifies, so a file that is still installed
+// cannot be released during a host call.
+struct net_sock_slot {
+    struct file *file;
+    struct socket *sock;
+};
+
+// Guest-side layout of a readiness ring. The kernel produces at `tail` and the guest consumes at `head`.
+// Events for a socket are coalesced while an earlier entry for it is still unconsumed, so the guest
+// must advance `head` past an entry before handling it, and handle it until EAGAIN (as with EPOLLET).
+struct __net_poll_event {
+    uint64_t token;
+    uint32_t events; // NET_POLL_*
+    uint32_t reserved;
+};
+
+struct __net_poll_ring {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t mask;
+    uint32_t overflow; // set by the kernel when events were dropped; the guest should re-check all sockets
+    struct __net_poll_event events[];
+};
+
+#define NET_POLL_IN 0x1
+#define NET_POLL_OUT 0x4
+#define NET_POLL_ERR 0x8
+#define NET_POLL_HUP 0x10
+#define NET_POLL_MAX_ENTRIES 65536
+
+struct net_poller {
+    spinlock_t lock;
+    wait_queue_head_t wq;
+    struct __net_poll_ring *ring; // in linear memory, which outlives the instance
+    uint32_t tail; // private copy
+    uint32_t mask; // private copy; the guest may rewrite the one in the ring
+    struct list_head regs;
+};
+
+// A socket registered with the readiness ring, stored in `sk_user_data` and holding a reference on `sk`.
+struct net_poll_reg {
+    struct list_head list;
+    struct net_poller *poller;
+    struct sock *sk;
+    uint64_t token;
+    uint32_t events;
+    uint32_t posted_events;
+    uint32_t posted_at;
+    void (*old_data_ready)(struct sock *sk);
+    void (*old_write_space)(struct sock *sk);
+    void (*old_state_change)(struct sock *sk);
+};
+
+struct net_instance {
+    struct net_sock_slot socks[NET_SOCK_TABLE_SIZE];
+    struct net_poller poller;
+};
+
 extern int sys_close(unsigned int fd);
 
 static int (*_sys_epoll_create)(int size);
 static int (*_sys_epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
 static int (*_sys_epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
 static int (*_sys_fcntl)(unsigned int fd, unsigned int cmd, unsigned long arg);
-static int (*_sys_accept4)(int fd, struct sockaddr *upeer_sockaddr, int *upeer_addrlen, int flags);
-static int (*_sys_sendto)(int fd, void *buff, size_t len, unsigned int flags, struct sockaddr *addr, int addr_len);
-static int (*_sys_recvfrom)(int fd, void *ubuf, size_t size, unsigned int flasgs, struct sockaddr *addr, int *addr_len);
 static int (*_sys_timerfd_create)(int clockid, int flags);
 static int (*_sys_timerfd_settime)(int ufd, int flags, const struct __itimerspec *utmr, struct __itimerspec *otmr);
 static int (*_sys_eventfd2)(unsigned int count, int flags);
 
+static struct net_instance *net_instance_of(struct vmctx *ctx) {
+    return kwasm_resolver_instance_data((struct execution_engine *) ctx, resolver);
+}
+
+static void net_sock_cache(struct vmctx *ctx, int fd, struct file *file, struct socket *sock) {
+    struct net_instance *inst = net_instance_of(ctx);
+
+    if(!inst || fd < 0 || fd >= NET_SOCK_TABLE_SIZE) return;
+    inst->socks[fd].file = file;
+    inst->socks[fd].sock = sock;
+}
+
+// Returns the socket behind `fd` without taking a reference (see `struct net_sock_slot`),
+// and applies the file's O_NONBLOCK to `flags` as the socket syscalls do.
+static struct socket *net_sock_lookup(struct vmctx *ctx, int fd, uint32_t *flags) {
+    int err;
+    struct file *file;
+    struct socket *sock;
+    struct net_instance *inst = net_instance_of(ctx);
+    struct net_sock_slot *slot = NULL;
+
+    if(inst && fd >= 0 && fd < NET_SOCK_TABLE_SIZE) slot = &inst->socks[fd];
+
+    rcu_read_lock();
+    file = fcheck(fd);
+    rcu_read_unlock();
+    if(!file) return ERR_PTR(-EBADF);
+
+    // The file may have been closed and its memory reused by a later open of the same fd.
+    if(slot && slot->file == file && file->private_data == slot->sock) {
+        sock = slot->sock;
+    } else {
+        sock = sock_from_file(file, &err);
+        if(!sock) return ERR_PTR(-ENOTSOCK);
+        if(slot) {
+            slot->file = file;
+            slot->sock = sock;
+        }
+    }
+
+    if(flags) {
+        *flags &= ~MSG_CMSG_COMPAT;
+        if(file->f_flags & O_NONBLOCK) *flags |= MSG_DONTWAIT;
+    }
+    return sock;
+}
+
+// Waits for `sock` to be ready for `events` without blocking the executor of an async guest, up to `timeout`.
+// Returns 0 once ready, -EAGAIN on timeout as the socket calls do, or -EINTR if the guest is killed.
+static int net_sock_wait(struct vmctx *ctx, struct socket *sock, unsigned int events, long timeout) {
+    long ret = kwasm_wait_file(ctx, sock->file, events, timeout);
+    if(ret < 0) return ret;
+    return ret ? 0 : -EAGAIN;
+}
+
+static void net_kvec_advance(struct kvec **vec, size_t *count, size_t n) {
+    while(n && *count) {
+        if(n < (*vec)->iov_len) {
+            (*vec)->iov_base += n;
+            (*vec)->iov_len -= n;
+            return;
+        }
+        n -= (*vec)->iov_len;
+        (*vec)++;
+        (*count)--;
+    }
+}
+
+// Sends like `kernel_sendmsg`, without blocking the executor of an async guest: the socket is written
+// with MSG_DONTWAIT and waited upon for POLLOUT in between, up to its SO_SNDTIMEO. `vec` is consumed.
+static int net_sendmsg(struct vmctx *ctx, struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t count, size_t len) {
+    int ret;
+    size_t done = 0;
+
+    if(!kwasm_is_async(ctx) || (msg->msg_flags & MSG_DONTWAIT)) {
+        return kernel_sendmsg(sock, msg, vec, count, len);
+    }
+
+    msg->msg_flags |= MSG_DONTWAIT;
+    while(1) {
+        ret = kernel_sendmsg(sock, msg, vec, count, len - done);
+        if(ret > 0) {
+            done += ret;
+            if(done >= len) break;
+            net_kvec_advance(&vec, &count, ret);
+            continue;
+        }
+        if(ret != -EAGAIN) break;
+        if((ret = net_sock_wait(ctx, sock, POLLOUT, sock_sndtimeo(sock->sk, 0))) < 0) break;
+    }
+    return done ? done : ret;
+}
+
+// Receives like `kernel_recvmsg`, without blocking the executor of an async guest: the socket is read
+// with MSG_DONTWAIT and waited upon for POLLIN in between, up to its SO_RCVTIMEO.
+static int net_recvmsg(struct vmctx *ctx, struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t count, size_t len, unsigned int flags) {
+    int ret;
+
+    if(!kwasm_is_async(ctx) || (flags & MSG_DONTWAIT)) {
+        return kernel_recvmsg(sock, msg, vec, count, len, flags);
+    }
+
+    while((ret = kernel_recvmsg(sock, msg, vec, count, len, flags | MSG_DONTWAIT)) == -EAGAIN) {
+        if((ret = net_sock_wait(ctx, sock, POLLIN | POLLRDHUP, sock_rcvtimeo(sock->sk, 0))) < 0) break;
+    }
+    return ret;
+}
+
 int __net_socket(
     struct vmctx *ctx,
     int family,
@@ -68,6 +267,7 @@ int __net_socket(
     }
 
     fd_install(fd, f);
+    net_sock_cache(ctx, fd, f, sock);
     return fd;
 }
 
@@ -137,6 +337,8 @@ int __net_listen(
     return err;
 }
 
+static void net_poll_fixup_child(struct sock *listener, struct sock *child);
+
 int __net_accept4(
     struct vmctx *ctx,
     int fd,
@@ -144,16 +346,25 @@ int __net_accept4(
     wasm_pointer_t sockaddr_len_vptr,
     uint32_t flags
 ) {
-    int ret;
+    int err, newfd, len, nonblock;
+    struct socket *sock, *newsock;
+    struct file *newfile;
+    struct sockaddr_storage addr;
     struct sockaddr *sa = NULL;
     int *sockaddr_len_p = NULL;
-    mm_segment_t old_fs;
+
+    if(flags & ~(SOCK_CLOEXEC | SOCK_NONBLOCK)) {
+        return -EINVAL;
+    }
 
     if(sockaddr) {
         sockaddr_len_p = (void *) vmctx_get_memory_slice(ctx, sockaddr_len_vptr, sizeof(int));
         if(!sockaddr_len_p) {
             return -EFAULT;
         }
+        if(*sockaddr_len_p < 0) {
+            return -EINVAL;
+        }
 
         sa = (void *) vmctx_get_memory_slice(ctx, sockaddr, *sockaddr_len_p);
         if(!sa) {
@@ -161,12 +372,58 @@ int __net_accept4(
         }
     }
 
-    old_fs = get_fs();
-	set_fs(KERNEL_DS);
-    ret = _sys_accept4(fd, sa, sockaddr_len_p, flags);
-    set_fs(old_fs);
+    sock = net_sock_lookup(ctx, fd, NULL);
+    if(IS_ERR(sock)) {
+        return PTR_ERR(sock);
+    }
 
-    return ret;
+    // Blocking behaviour follows the listening socket, as with accept4(2).
+    nonblock = sock->file->f_flags & O_NONBLOCK;
+    if(kwasm_is_async(ctx) && !nonblock) {
+        while((err = kernel_accept(sock, &newsock, O_NONBLOCK)) == -EAGAIN) {
+            if((err = net_sock_wait(ctx, sock, POLLIN, sock_rcvtimeo(sock->sk, 0))) < 0) break;
+        }
+    } else {
+        err = kernel_accept(sock, &newsock, nonblock);
+    }
+    if(err < 0) {
+        return err;
+    }
+    net_poll_fixup_child(sock->sk, newsock->sk);
+
+    if(sa) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+        len = newsock->ops->getname(newsock, (struct sockaddr *) &addr, 1);
+        err = len < 0 ? len : 0;
+#else
+        err = newsock->ops->getname(newsock, (struct sockaddr *) &addr, &len, 1);
+#endif
+        if(err < 0) {
+            sock_release(newsock);
+            return -ECONNABORTED;
+        }
+        memcpy(sa, &addr, min(*sockaddr_len_p, len));
+        *sockaddr_len_p = len;
+    }
+
+    newfd = get_unused_fd_flags(flags & SOCK_CLOEXEC ? O_CLOEXEC : 0);
+    if(newfd < 0) {
+        sock_release(newsock);
+        return newfd;
+    }
+
+    newfile = sock_alloc_file(newsock, flags & SOCK_NONBLOCK ? O_NONBLOCK : 0, NULL);
+    if(IS_ERR(newfile)) {
+        put_unused_fd(newfd);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+        sock_release(newsock); // released by sock_alloc_file() itself since 4.17
+#endif
+        return PTR_ERR(newfile);
+    }
+
+    fd_install(newfd, newfile);
+    net_sock_cache(ctx, newfd, newfile, newsock);
+    return newfd;
 }
 
 int __net_sendto(
@@ -178,23 +435,26 @@ int __net_sendto(
     wasm_pointer_t addr,
     int addr_len
 ) {
-    int ret;
-    mm_segment_t old_fs;
-    struct sockaddr *sa = NULL;
+    struct socket *sock;
+    struct msghdr msg = {};
+    struct kvec vec;
     uint8_t *buf_p = vmctx_get_memory_slice(ctx, buf, len);
     if(!buf_p) return -EFAULT;
 
     if(addr) {
-        sa = (void *) vmctx_get_memory_slice(ctx, addr, addr_len);
-        if(!sa) return -EFAULT;
+        if(addr_len < 0 || addr_len > sizeof(struct sockaddr_storage)) return -EINVAL;
+        msg.msg_name = vmctx_get_memory_slice(ctx, addr, addr_len);
+        if(!msg.msg_name) return -EFAULT;
+        msg.msg_namelen = addr_len;
     }
 
-    old_fs = get_fs();
-	set_fs(KERNEL_DS);
-    ret = _sys_sendto(fd, buf_p, len, flags, sa, addr_len);
-    set_fs(old_fs);
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
 
-    return ret;
+    vec.iov_base = buf_p;
+    vec.iov_len = len;
+    msg.msg_flags = flags;
+    return net_sendmsg(ctx, sock, &msg, &vec, 1, len);
 }
 
 int __net_recvfrom(
@@ -207,7 +467,10 @@ int __net_recvfrom(
     wasm_pointer_t addr_len_vptr
 ) {
     int ret;
-    mm_segment_t old_fs;
+    struct socket *sock;
+    struct msghdr msg = {};
+    struct kvec vec;
+    struct sockaddr_storage kaddr;
     struct sockaddr *sa = NULL;
     int *addr_len_p = NULL;
     uint8_t *buf_p = vmctx_get_memory_slice(ctx, buf, len);
@@ -217,16 +480,23 @@ int __net_recvfrom(
     if(addr) {
         addr_len_p = (void *) vmctx_get_memory_slice(ctx, addr_len_vptr, sizeof(int));
         if(!addr_len_p) return -EFAULT;
+        if(*addr_len_p < 0) return -EINVAL;
 
         sa = (void *) vmctx_get_memory_slice(ctx, addr, *addr_len_p);
         if(!sa) return -EFAULT;
+        msg.msg_name = &kaddr;
     }
 
-    old_fs = get_fs();
-	set_fs(KERNEL_DS);
-    ret = _sys_recvfrom(fd, buf_p, len, flags, sa, addr_len_p);
-    set_fs(old_fs);
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
 
+    vec.iov_base = buf_p;
+    vec.iov_len = len;
+    ret = net_recvmsg(ctx, sock, &msg, &vec, 1, len, flags);
+    if(ret >= 0 && sa) {
+        memcpy(sa, &kaddr, min_t(int, *addr_len_p, msg.msg_namelen));
+        *addr_len_p = msg.msg_namelen;
+    }
     return ret;
 }
 
@@ -272,6 +542,8 @@ int __net_epoll_wait(
     int timeout
 ) {
     int ret;
+    long wait;
+    struct file *f;
     struct epoll_event *events;
     mm_segment_t old_fs;
     events = (void *) vmctx_get_memory_slice(
@@ -281,12 +553,34 @@ int __net_epoll_wait(
     );
     if(!events) return -EFAULT;
 
-	old_fs = get_fs();
-	set_fs(KERNEL_DS);
-    ret = _sys_epoll_wait(epfd, events, maxevents, timeout);
-	set_fs(old_fs);
+    if(!kwasm_is_async(ctx) || timeout == 0) {
+        old_fs = get_fs();
+        set_fs(KERNEL_DS);
+        ret = _sys_epoll_wait(epfd, events, maxevents, timeout);
+        set_fs(old_fs);
+        return ret;
+    }
+
+    // Async guests poll the epoll fd, and wait for it to become readable in between.
+    f = fget(epfd);
+    if(!f) return -EBADF;
+
+    wait = timeout < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(timeout);
+    while(1) {
+        old_fs = get_fs();
+        set_fs(KERNEL_DS);
+        ret = _sys_epoll_wait(epfd, events, maxevents, 0);
+        set_fs(old_fs);
+        if(ret != 0) break;
 
-	return ret;
+        wait = kwasm_wait_file(ctx, f, POLLIN, wait);
+        if(wait <= 0) {
+            ret = wait;
+            break;
+        }
+    }
+    fput(f);
+    return ret;
 }
 
 int __net_fcntl(
@@ -307,73 +601,684 @@ int __net_fcntl(
     return _sys_fcntl(fd, cmd, arg);
 }
 
-int do_resolve(struct import_resolver_instance *self, const char *name, struct import_info *out) {
-    if(strcmp(name, "net##_socket") == 0) {
-        out->fn = __net_socket;
-        out->param_count = 3;
-        return 0;
-    } else if(strcmp(name, "net##_bind") == 0) {
-        out->fn = __net_bind;
-        out->param_count = 3;
-        return 0;
-    } else if(strcmp(name, "net##_listen") == 0) {
-        out->fn = __net_listen;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "net##_accept4") == 0) {
-        out->fn = __net_accept4;
-        out->param_count = 4;
-        return 0;
-    } else if(strcmp(name, "net##_sendto") == 0) {
-        out->fn = __net_sendto;
-        out->param_count = 6;
-        return 0;
-    } else if(strcmp(name, "net##_recvfrom") == 0) {
-        out->fn = __net_recvfrom;
-        out->param_count = 6;
-        return 0;
-    } else if(strcmp(name, "net##_eventfd_sem") == 0) {
-        out->fn = __net_eventfd_sem;
-        out->param_count = 1;
-        return 0;
-    } else if(strcmp(name, "net##_epoll_create") == 0) {
-        out->fn = __net_epoll_create;
-        out->param_count = 0;
-        return 0;
-    } else if(strcmp(name, "net##_epoll_ctl") == 0) {
-        out->fn = __net_epoll_ctl;
-        out->param_count = 4;
-        return 0;
-    } else if(strcmp(name, "net##_epoll_wait") == 0) {
-        out->fn = __net_epoll_wait;
-        out->param_count = 4;
-        return 0;
-    } else if(strcmp(name, "net##_fcntl") == 0) {
-        out->fn = __net_fcntl;
-        out->param_count = 3;
-        return 0;
+// Vectors of a single message, translated from guest memory.
+struct net_msg_vec {
+    struct kvec fast[UIO_FASTIOV];
+    struct kvec *vec;
+    uint32_t count;
+    size_t total;
+};
+
+static int net_msg_vec_init(struct vmctx *ctx, const struct __net_msghdr *hdr, struct net_msg_vec *mv) {
+    uint32_t i;
+    struct __net_iovec *iov;
+    uint8_t *buf;
+
+    if(hdr->iovlen > UIO_MAXIOV) return -EMSGSIZE;
+
+    mv->vec = mv->fast;
+    mv->count = hdr->iovlen;
+    mv->total = 0;
+    if(hdr->iovlen == 0) return 0;
+
+    iov = (void *) vmctx_get_memory_slice(ctx, hdr->iov, sizeof(struct __net_iovec) * hdr->iovlen);
+    if(!iov) return -EFAULT;
+
+    if(hdr->iovlen > UIO_FASTIOV) {
+        mv->vec = kmalloc_array(hdr->iovlen, sizeof(struct kvec), GFP_KERNEL);
+        if(!mv->vec) return -ENOMEM;
+    }
+
+    for(i = 0; i < hdr->iovlen; i++) {
+        buf = iov[i].buf_len ? vmctx_get_memory_slice(ctx, iov[i].buf, iov[i].buf_len) : NULL;
+        if(iov[i].buf_len && !buf) {
+            if(mv->vec != mv->fast) kfree(mv->vec);
+            return -EFAULT;
+        }
+        mv->vec[i].iov_base = buf;
+        mv->vec[i].iov_len = iov[i].buf_len;
+        mv->total += iov[i].buf_len;
+    }
+    return 0;
+}
+
+static void net_msg_vec_release(struct net_msg_vec *mv) {
+    if(mv->vec != mv->fast) kfree(mv->vec);
+}
+
+static int net_sendmsg_one(struct vmctx *ctx, struct socket *sock, struct __net_msghdr *hdr, unsigned int flags) {
+    int ret;
+    struct msghdr msg = { .msg_flags = flags };
+    struct net_msg_vec mv;
+
+    if(hdr->name) {
+        if(hdr->namelen > sizeof(struct sockaddr_storage)) return -EINVAL;
+        msg.msg_name = vmctx_get_memory_slice(ctx, hdr->name, hdr->namelen);
+        if(!msg.msg_name) return -EFAULT;
+        msg.msg_namelen = hdr->namelen;
+    }
+
+    if((ret = net_msg_vec_init(ctx, hdr, &mv)) < 0) return ret;
+    ret = net_sendmsg(ctx, sock, &msg, mv.vec, mv.count, mv.total);
+    net_msg_vec_release(&mv);
+    return ret;
+}
+
+static int net_recvmsg_one(struct vmctx *ctx, struct socket *sock, struct __net_msghdr *hdr, unsigned int flags) {
+    int ret;
+    struct sockaddr_storage addr;
+    struct msghdr msg = {};
+    struct net_msg_vec mv;
+    uint8_t *name = NULL;
+
+    if(hdr->name) {
+        name = vmctx_get_memory_slice(ctx, hdr->name, hdr->namelen);
+        if(!name) return -EFAULT;
+
+        // Protocols write the full address regardless of the buffer size, so receive it locally.
+        msg.msg_name = &addr;
+    }
+
+    if((ret = net_msg_vec_init(ctx, hdr, &mv)) < 0) return ret;
+    ret = net_recvmsg(ctx, sock, &msg, mv.vec, mv.count, mv.total, flags);
+    net_msg_vec_release(&mv);
+    if(ret < 0) return ret;
+
+    if(name) {
+        memcpy(name, &addr, min_t(uint32_t, hdr->namelen, msg.msg_namelen));
+        hdr->namelen = msg.msg_namelen;
+    }
+    hdr->flags = msg.msg_flags;
+    return ret;
+}
+
+int __net_sendmsg(
+    struct vmctx *ctx,
+    int fd,
+    wasm_pointer_t _msg,
+    uint32_t flags
+) {
+    struct socket *sock;
+    struct __net_msghdr *hdr;
+
+    hdr = (void *) vmctx_get_memory_slice(ctx, _msg, sizeof(struct __net_msghdr));
+    if(!hdr) return -EFAULT;
+
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+
+    return net_sendmsg_one(ctx, sock, hdr, flags);
+}
+
+int __net_recvmsg(
+    struct vmctx *ctx,
+    int fd,
+    wasm_pointer_t _msg,
+    uint32_t flags
+) {
+    struct socket *sock;
+    struct __net_msghdr *hdr;
+
+    hdr = (void *) vmctx_get_memory_slice(ctx, _msg, sizeof(struct __net_msghdr));
+    if(!hdr) return -EFAULT;
+
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+
+    return net_recvmsg_one(ctx, sock, hdr, flags);
+}
+
+// Sends up to `vlen` messages with one host call. Like sendmmsg(2), returns the number of messages sent,
+// or an error if the first one failed.
+int __net_sendmmsg(
+    struct vmctx *ctx,
+    int fd,
+    wasm_pointer_t _msgvec,
+    uint32_t vlen,
+    uint32_t flags
+) {
+    int ret = 0;
+    uint32_t i;
+    struct socket *sock;
+    struct __net_mmsghdr *msgvec;
+
+    vlen = min_t(uint32_t, vlen, UIO_MAXIOV);
+    if(vlen == 0) return 0;
+
+    msgvec = (void *) vmctx_get_memory_slice(ctx, _msgvec, sizeof(struct __net_mmsghdr) * vlen);
+    if(!msgvec) return -EFAULT;
+
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+
+    for(i = 0; i < vlen; i++) {
+        ret = net_sendmsg_one(ctx, sock, &msgvec[i].hdr, flags);
+        if(ret < 0) break;
+        msgvec[i].len = ret;
+    }
+
+    return i ? i : ret;
+}
+
+// Receives up to `vlen` messages with one host call. Like recvmmsg(2), MSG_WAITFORONE makes every receive
+// after the first one non-blocking. Returns the number of messages received, or an error if there was none.
+int __net_recvmmsg(
+    struct vmctx *ctx,
+    int fd,
+    wasm_pointer_t _msgvec,
+    uint32_t vlen,
+    uint32_t flags
+) {
+    int ret = 0;
+    uint32_t i;
+    struct socket *sock;
+    struct __net_mmsghdr *msgvec;
+
+    vlen = min_t(uint32_t, vlen, UIO_MAXIOV);
+    if(vlen == 0) return 0;
+
+    msgvec = (void *) vmctx_get_memory_slice(ctx, _msgvec, sizeof(struct __net_mmsghdr) * vlen);
+    if(!msgvec) return -EFAULT;
+
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+
+    for(i = 0; i < vlen; i++) {
+        ret = net_recvmsg_one(ctx, sock, &msgvec[i].hdr, flags & ~MSG_WAITFORONE);
+        if(ret < 0) break;
+        msgvec[i].len = ret;
+
+        if(flags & MSG_WAITFORONE) flags |= MSG_DONTWAIT;
+        if(msgvec[i].hdr.flags & MSG_OOB) {
+            i++;
+            break;
+        }
+    }
+
+    return i ? i : ret;
+}
+
+static void net_poll_post(struct net_poll_reg *reg, uint32_t events) {
+    unsigned long flags;
+    struct net_poller *poller = reg->poller;
+    struct __net_poll_ring *ring;
+    struct __net_poll_event *ev;
+    uint32_t head;
+
+    events &= reg->events | NET_POLL_ERR | NET_POLL_HUP;
+    if(!events) return;
+
+    spin_lock_irqsave(&poller->lock, flags);
+    ring = poller->ring;
+    head = READ_ONCE(ring->head);
+
+    // `head` is only trusted to compute fullness. Slots are indexed with our own copies of `tail` and `mask`.
+
+    // Still waiting to be consumed with the same events.
+    if((reg->posted_events & events) == events && (int32_t) (reg->posted_at - head) >= 0) {
+        spin_unlock_irqrestore(&poller->lock, flags);
+        return;
+    }
+
+    if(poller->tail - head > poller->mask) {
+        WRITE_ONCE(ring->overflow, 1);
     } else {
-        return -EINVAL;
+        ev = &ring->events[poller->tail & poller->mask];
+        ev->token = reg->token;
+        ev->events = events;
+        reg->posted_events = events;
+        reg->posted_at = poller->tail;
+        poller->tail++;
+        smp_store_release(&ring->tail, poller->tail);
+    }
+    spin_unlock_irqrestore(&poller->lock, flags);
+
+    wake_up_interruptible(&poller->wq);
+}
+
+static void net_poll_data_ready(struct sock *sk) {
+    struct net_poll_reg *reg;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    reg = sk->sk_user_data;
+    if(reg) {
+        reg->old_data_ready(sk);
+        net_poll_post(reg, NET_POLL_IN);
+    }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+// Connections cloned from a listening socket inherit its callbacks and `sk_user_data` until they are
+// accepted (see `net_poll_fixup_child`), so `sk_user_data` is only trusted in the listening state.
+static void net_poll_listen_data_ready(struct sock *sk) {
+    struct net_poll_reg *reg;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    if(sk->sk_state == TCP_LISTEN) {
+        reg = sk->sk_user_data;
+        if(reg) {
+            reg->old_data_ready(sk);
+            net_poll_post(reg, NET_POLL_IN);
+        }
     }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void net_poll_fixup_child(struct sock *listener, struct sock *child) {
+    struct net_poll_reg *reg;
+
+    if(child->sk_data_ready != net_poll_listen_data_ready) return;
+
+    // Only this thread registers sockets, so the listener's state is stable here.
+    reg = listener->sk_data_ready == net_poll_listen_data_ready ? listener->sk_user_data : NULL;
+
+    write_lock_bh(&child->sk_callback_lock);
+    child->sk_data_ready = reg ? reg->old_data_ready : listener->sk_data_ready;
+    child->sk_user_data = NULL;
+    write_unlock_bh(&child->sk_callback_lock);
+}
+
+static void net_poll_write_space(struct sock *sk) {
+    struct net_poll_reg *reg;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    reg = sk->sk_user_data;
+    if(reg) {
+        reg->old_write_space(sk);
+        if(sk->sk_type == SOCK_STREAM ? sk_stream_is_writeable(sk) : sock_writeable(sk)) {
+            net_poll_post(reg, NET_POLL_OUT);
+        }
+    }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void net_poll_state_change(struct sock *sk) {
+    struct net_poll_reg *reg;
+    uint32_t events = NET_POLL_IN | NET_POLL_OUT;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    reg = sk->sk_user_data;
+    if(reg) {
+        reg->old_state_change(sk);
+        if(sk->sk_err) events |= NET_POLL_ERR;
+        if(sk->sk_shutdown == SHUTDOWN_MASK || sk->sk_state == TCP_CLOSE) events |= NET_POLL_HUP;
+        net_poll_post(reg, events);
+    }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void net_poll_unregister(struct net_poll_reg *reg) {
+    struct sock *sk = reg->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_data_ready = reg->old_data_ready;
+    sk->sk_write_space = reg->old_write_space;
+    sk->sk_state_change = reg->old_state_change;
+    sk->sk_user_data = NULL;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    // No callback can be running with `reg` once the callback lock has been released.
+    list_del(&reg->list);
+    sock_put(sk);
+    kfree(reg);
+}
+
+// Sets up the readiness ring at `_ring` in linear memory, with `entries` (a power of two) event slots.
+int __net_poll_setup(
+    struct vmctx *ctx,
+    wasm_pointer_t _ring,
+    uint32_t entries
+) {
+    struct net_instance *inst = net_instance_of(ctx);
+    struct __net_poll_ring *ring;
+
+    if(!inst) return -EINVAL;
+    if(inst->poller.ring) return -EBUSY;
+    if(entries == 0 || entries > NET_POLL_MAX_ENTRIES || !is_power_of_2(entries)) return -EINVAL;
+
+    ring = (void *) vmctx_get_memory_slice(
+        ctx,
+        _ring,
+        sizeof(struct __net_poll_ring) + sizeof(struct __net_poll_event) * entries
+    );
+    if(!ring) return -EFAULT;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = entries - 1;
+    ring->overflow = 0;
+
+    spin_lock_irq(&inst->poller.lock);
+    inst->poller.tail = 0;
+    inst->poller.mask = entries - 1;
+    inst->poller.ring = ring;
+    spin_unlock_irq(&inst->poller.lock);
+    return 0;
 }
 
-int get_instance(struct execution_engine *ee, struct import_resolver *self, struct import_resolver_instance *out) {
-    out->resolve = do_resolve;
+// Registers `fd` with the readiness ring. Events are reported with `token`.
+// An initial event is posted so that the guest tries the socket once.
+// Sockets should be removed with `__net_poll_del` before being closed; otherwise they stay alive
+// until the engine is destroyed.
+int __net_poll_add(
+    struct vmctx *ctx,
+    int fd,
+    uint32_t events,
+    uint64_t token
+) {
+    struct net_instance *inst = net_instance_of(ctx);
+    struct socket *sock;
+    struct sock *sk;
+    struct net_poll_reg *reg;
+
+    if(!inst || !inst->poller.ring) return -EINVAL;
+
+    sock = net_sock_lookup(ctx, fd, NULL);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+    sk = sock->sk;
+
+    reg = kzalloc(sizeof(struct net_poll_reg), GFP_KERNEL);
+    if(!reg) return -ENOMEM;
+    reg->poller = &inst->poller;
+    reg->sk = sk;
+    reg->token = token;
+    reg->events = events & (NET_POLL_IN | NET_POLL_OUT);
+    reg->posted_at = inst->poller.tail - 1;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    if(sk->sk_user_data) {
+        write_unlock_bh(&sk->sk_callback_lock);
+        kfree(reg);
+        return -EBUSY;
+    }
+    sock_hold(sk);
+    reg->old_data_ready = sk->sk_data_ready;
+    reg->old_write_space = sk->sk_write_space;
+    reg->old_state_change = sk->sk_state_change;
+    sk->sk_user_data = reg;
+    if(sk->sk_state == TCP_LISTEN) {
+        sk->sk_data_ready = net_poll_listen_data_ready;
+    } else {
+        sk->sk_data_ready = net_poll_data_ready;
+        sk->sk_write_space = net_poll_write_space;
+        sk->sk_state_change = net_poll_state_change;
+    }
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    list_add(&reg->list, &inst->poller.regs);
+    net_poll_post(reg, reg->events);
+    return 0;
+}
+
+int __net_poll_del(
+    struct vmctx *ctx,
+    int fd
+) {
+    struct net_instance *inst = net_instance_of(ctx);
+    struct socket *sock;
+    struct net_poll_reg *reg;
+
+    if(!inst) return -EINVAL;
+
+    sock = net_sock_lookup(ctx, fd, NULL);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+
+    // Only this thread registers and unregisters, so `sk_user_data` is stable here.
+    reg = sock->sk->sk_user_data;
+    if(
+        !reg ||
+        (sock->sk->sk_data_ready != net_poll_data_ready && sock->sk->sk_data_ready != net_poll_listen_data_ready) ||
+        reg->poller != &inst->poller
+    ) {
+        return -ENOENT;
+    }
+    net_poll_unregister(reg);
+    return 0;
+}
+
+static int net_poll_ring_ready(void *data) {
+    struct __net_poll_ring *ring = data;
+    return smp_load_acquire(&ring->tail) != READ_ONCE(ring->head) || READ_ONCE(ring->overflow);
+}
+
+// Waits up to `timeout_ms` (negative for no limit) for the ring to be non-empty,
+// and returns the number of entries available.
+int __net_poll_wait(
+    struct vmctx *ctx,
+    int timeout_ms
+) {
+    struct net_instance *inst = net_instance_of(ctx);
+    struct __net_poll_ring *ring;
+    long timeout, ret;
+    uint32_t avail;
+
+    if(!inst || !inst->poller.ring) return -EINVAL;
+    ring = inst->poller.ring;
+
+    timeout = timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(timeout_ms);
+    ret = kwasm_wait_event(ctx, &inst->poller.wq, net_poll_ring_ready, ring, timeout);
+    if(ret < 0) return ret;
+    avail = READ_ONCE(inst->poller.tail) - READ_ONCE(ring->head);
+    return min(avail, inst->poller.mask + 1);
+}
+
+// Sends `len` bytes of linear memory at `buf` on a TCP socket without copying them: the pages backing
+// linear memory are attached to the socket's buffers directly. Writes the sequence number following
+// the last byte sent to `seq_out`; the guest must not modify the buffer until `__net_send_acked`
+// reports that sequence number as acknowledged.
+int __net_sendpage(
+    struct vmctx *ctx,
+    int fd,
+    wasm_pointer_t buf,
+    uint32_t len,
+    uint32_t flags,
+    wasm_pointer_t seq_out
+) {
+    struct execution_engine *ee = (struct execution_engine *) ctx;
+    struct socket *sock;
+    uint32_t *seq_out_p;
+    unsigned long offset, page_offset, chunk;
+    uint32_t done = 0;
+    int ret = 0, async;
+
+    if(!len) return 0;
+    if(!vmctx_get_memory_slice(ctx, buf, len)) return -EFAULT;
+    seq_out_p = (void *) vmctx_get_memory_slice(ctx, seq_out, sizeof(uint32_t));
+    if(!seq_out_p) return -EFAULT;
+
+    sock = net_sock_lookup(ctx, fd, &flags);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+    if(sock->sk->sk_protocol != IPPROTO_TCP) return -EOPNOTSUPP;
+
+    // Same as `net_sendmsg` for async guests.
+    async = kwasm_is_async(ctx) && !(flags & MSG_DONTWAIT);
+    if(async) flags |= MSG_DONTWAIT;
+
+    while(done < len) {
+        offset = (unsigned long) buf + done;
+        page_offset = offset & (PAGE_SIZE - 1);
+        chunk = min_t(unsigned long, len - done, PAGE_SIZE - page_offset);
+
+        ret = kernel_sendpage(
+            sock,
+            ee->memory_pages[offset >> PAGE_SHIFT],
+            page_offset,
+            chunk,
+            flags | (done + chunk < len ? MSG_SENDPAGE_NOTLAST : 0)
+        );
+        if(ret == -EAGAIN && async) {
+            if((ret = net_sock_wait(ctx, sock, POLLOUT, sock_sndtimeo(sock->sk, 0))) < 0) break;
+            continue;
+        }
+        if(ret <= 0) break;
+        done += ret;
+        if(ret < chunk && !async) break;
+    }
+
+    *seq_out_p = READ_ONCE(tcp_sk(sock->sk)->write_seq);
+    return done ? done : ret;
+}
+
+// Returns the first sequence number not yet acknowledged by the peer. Buffers passed to `__net_sendpage`
+// whose returned sequence number is at or before it (modulo 2^32) can be reused.
+int64_t __net_send_acked(
+    struct vmctx *ctx,
+    int fd
+) {
+    struct socket *sock;
+
+    sock = net_sock_lookup(ctx, fd, NULL);
+    if(IS_ERR(sock)) return PTR_ERR(sock);
+    if(sock->sk->sk_protocol != IPPROTO_TCP) return -EOPNOTSUPP;
+
+    return READ_ONCE(tcp_sk(sock->sk)->snd_una);
+}
+
+static int net_sock_wspace(struct sock *sk) {
+    if(sk->sk_type == SOCK_STREAM) return sk_stream_wspace(sk);
+    return sk->sk_sndbuf - sk_wmem_alloc_get(sk);
+}
+
+// Splices to a blocking socket without blocking the executor of an async guest. The socket only follows
+// its own O_NONBLOCK when spliced to, so each splice is limited to the send space it has, and POLLOUT is
+// waited upon in between, up to its SO_SNDTIMEO.
+static long net_splice_to_sock(struct vmctx *ctx, struct file *in, loff_t *pos, struct socket *sock, size_t count) {
+    loff_t out_pos = 0;
+    size_t done = 0, chunk;
+    long ret = 0;
+    int space;
+
+    while(done < count) {
+        space = net_sock_wspace(sock->sk);
+        if(space <= 0) {
+            if((ret = net_sock_wait(ctx, sock, POLLOUT, sock_sndtimeo(sock->sk, 0))) < 0) break;
+            continue;
+        }
+        chunk = min_t(size_t, count - done, space);
+        ret = do_splice_direct(in, pos, sock->file, &out_pos, chunk, 0);
+        if(ret <= 0) break;
+        done += ret;
+        if(ret < chunk) break; // end of file
+    }
+    return done ? done : ret;
+}
+
+// Sends up to `count` bytes from file `in_fd` to socket `out_fd` through the page cache, like sendfile(2).
+// If `offset_ptr` is not 0, reads from and updates the 64-bit offset there instead of the file position.
+int64_t __net_sendfile(
+    struct vmctx *ctx,
+    int out_fd,
+    int in_fd,
+    wasm_pointer_t offset_ptr,
+    uint32_t count
+) {
+    struct fd in, out;
+    struct socket *sock;
+    loff_t pos, out_pos = 0;
+    uint64_t *offset_p = NULL;
+    long ret;
+    int err;
+
+    if(offset_ptr) {
+        offset_p = (void *) vmctx_get_memory_slice(ctx, offset_ptr, sizeof(uint64_t));
+        if(!offset_p) return -EFAULT;
+    }
+
+    in = fdget(in_fd);
+    if(!in.file) return -EBADF;
+    out = fdget(out_fd);
+    if(!out.file) {
+        fdput(in);
+        return -EBADF;
+    }
+
+    if(!(in.file->f_mode & FMODE_READ)) {
+        ret = -EBADF;
+        goto out;
+    }
+    if(!(sock = sock_from_file(out.file, &err))) {
+        ret = -ENOTSOCK;
+        goto out;
+    }
+
+    pos = offset_p ? *offset_p : in.file->f_pos;
+    count = min_t(uint32_t, count, MAX_RW_COUNT);
+    if(kwasm_is_async(ctx) && !(out.file->f_flags & O_NONBLOCK)) {
+        ret = net_splice_to_sock(ctx, in.file, &pos, sock, count);
+    } else {
+        ret = do_splice_direct(in.file, &pos, out.file, &out_pos, count, 0);
+    }
+    if(ret > 0) {
+        if(offset_p) *offset_p = pos;
+        else in.file->f_pos = pos;
+    }
+
+    out:
+    fdput(out);
+    fdput(in);
+    return ret;
+}
+
+static const struct import_entry net_imports[] = {
+    { "net##_socket", __net_socket, 3 },
+    { "net##_bind", __net_bind, 3 },
+    { "net##_listen", __net_listen, 2 },
+    { "net##_accept4", __net_accept4, 4 },
+    { "net##_sendto", __net_sendto, 6 },
+    { "net##_recvfrom", __net_recvfrom, 6 },
+    { "net##_eventfd_sem", __net_eventfd_sem, 1 },
+    { "net##_epoll_create", __net_epoll_create, 0 },
+    { "net##_epoll_ctl", __net_epoll_ctl, 4 },
+    { "net##_epoll_wait", __net_epoll_wait, 4 },
+    { "net##_fcntl", __net_fcntl, 3 },
+    { "net##_sendmsg", __net_sendmsg, 3 },
+    { "net##_recvmsg", __net_recvmsg, 3 },
+    { "net##_sendmmsg", __net_sendmmsg, 4 },
+    { "net##_recvmmsg", __net_recvmmsg, 4 },
+    { "net##_poll_setup", __net_poll_setup, 2 },
+    { "net##_poll_add", __net_poll_add, 3 },
+    { "net##_poll_del", __net_poll_del, 1 },
+    { "net##_poll_wait", __net_poll_wait, 1 },
+    { "net##_sendpage", __net_sendpage, 5 },
+    { "net##_send_acked", __net_send_acked, 1 },
+    { "net##_sendfile", __net_sendfile, 4 },
+};
+
+static void release_instance(struct import_resolver_instance *self) {
+    struct net_instance *inst = self->private_data;
+    struct net_poll_reg *reg, *tmp;
+
+    list_for_each_entry_safe(reg, tmp, &inst->poller.regs, list) {
+        net_poll_unregister(reg);
+    }
+    kvfree(inst);
+}
+
+static int get_instance(struct execution_engine *ee, struct import_resolver *self, struct import_resolver_instance *out) {
+    struct net_instance *inst;
+
+    inst = kvzalloc(sizeof(struct net_instance), GFP_KERNEL);
+    if(!inst) return -ENOMEM;
+    spin_lock_init(&inst->poller.lock);
+    init_waitqueue_head(&inst->poller.wq);
+    INIT_LIST_HEAD(&inst->poller.regs);
+
+    out->private_data = inst;
+    out->release = release_instance;
     return 0;
 }
 
 int __init init_module(void) {
     struct import_resolver tmp = {
-        .get_instance = get_instance
+        .get_instance = get_instance,
+        .imports = net_imports,
+        .import_count = ARRAY_SIZE(net_imports),
     };
 
     _sys_epoll_create = (void *) kallsyms_lookup_name("sys_epoll_create");
     _sys_epoll_ctl = (void *) kallsyms_lookup_name("sys_epoll_ctl");
     _sys_epoll_wait = (void *) kallsyms_lookup_name("sys_epoll_wait");
     _sys_fcntl = (void *) kallsyms_lookup_name("sys_fcntl");
-    _sys_accept4 = (void *) kallsyms_lookup_name("sys_accept4");
-    _sys_sendto = (void *) kallsyms_lookup_name("sys_sendto");
-    _sys_recvfrom = (void *) kallsyms_lookup_name("sys_recvfrom");
     _sys_timerfd_create = (void *) kallsyms_lookup_name("sys_timerfd_create");
     _sys_timerfd_settime = (void *) kallsyms_lookup_name("sys_timerfd_settime");
     _sys_eventfd2 = (void *) kallsyms_lookup_name("sys_eventfd2");
@@ -383,9 +1288,6 @@ int __init init_module(void) {
         !_sys_epoll_ctl ||
         !_sys_epoll_wait ||
         !_sys_fcntl ||
-        !_sys_accept4 ||
-        !_sys_sendto ||
-        !_sys_recvfrom ||
         !_sys_timerfd_create ||
         !_sys_timerfd_settime ||
         !_sys_eventfd2
@@ -0,0 +1,292 @@
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include "vm.h"
+
+struct ee_pool {
+    spinlock_t lock;
+    struct list_head shells;
+    int count;
+    struct work_struct refill_work;
+};
+
+static DEFINE_PER_CPU(struct ee_pool, ee_pools);
+static int pool_active = 0;
+
+static int pool_size = 2;
+module_param(pool_size, int, 0644);
+MODULE_PARM_DESC(pool_size, "Number of execution engine shells to keep ready on each CPU");
+
+static int pool_low_watermark = 1;
+module_param(pool_low_watermark, int, 0644);
+MODULE_PARM_DESC(pool_low_watermark, "Refill a CPU's shell pool in background when it drops below this");
+
+static int pool_high_watermark = 4;
+module_param(pool_high_watermark, int, 0644);
+MODULE_PARM_DESC(pool_high_watermark, "Free released shells instead of recycling them above this count per CPU");
+
+static int zero_page_reserve = 0;
+module_param(zero_page_reserve, int, 0644);
+MODULE_PARM_DESC(zero_page_reserve, "Number of pre-zeroed pages kept in background for memory.grow (0 to disable)");
+
+// Pre-zeroed pages for memory.grow, so that the guest does not wait for page allocation and clearing.
+// Shared by all CPUs; refilled from a workqueue when it drops below half of `zero_page_reserve`.
+static struct {
+    spinlock_t lock;
+    struct list_head pages;
+    int count;
+    struct work_struct refill_work;
+} zero_pages;
+
+static void zero_pages_refill(struct work_struct *work) {
+    struct page *page;
+
+    while(READ_ONCE(pool_active) && READ_ONCE(zero_pages.count) < READ_ONCE(zero_page_reserve)) {
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+        if(!page) return;
+
+        spin_lock(&zero_pages.lock);
+        list_add(&page->lru, &zero_pages.pages);
+        zero_pages.count++;
+        spin_unlock(&zero_pages.lock);
+    }
+}
+
+struct page *ee_zero_page_get(void) {
+    struct page *page = NULL;
+    int refill;
+
+    if(!READ_ONCE(zero_page_reserve)) return NULL;
+
+    spin_lock(&zero_pages.lock);
+    if(!list_empty(&zero_pages.pages)) {
+        page = list_first_entry(&zero_pages.pages, struct page, lru);
+        list_del(&page->lru);
+        zero_pages.count--;
+    }
+    refill = zero_pages.count < READ_ONCE(zero_page_reserve) / 2;
+    spin_unlock(&zero_pages.lock);
+
+    if(refill && READ_ONCE(pool_active)) {
+        schedule_work(&zero_pages.refill_work);
+    }
+    return page;
+}
+
+static int stack_pool_size = 64;
+module_param(stack_pool_size, int, 0644);
+MODULE_PARM_DESC(stack_pool_size, "Number of free guest stacks kept for reuse for each stack size");
+
+// Free guest stacks, by size class (MIN_STACK_SIZE << class). Shared by all CPUs.
+static struct {
+    spinlock_t lock;
+    struct list_head stacks;
+    int count;
+} stack_pools[STACK_CLASS_COUNT];
+
+static int stack_class(unsigned long size) {
+    return ilog2(size / MIN_STACK_SIZE);
+}
+
+// `size` must be a power of two from MIN_STACK_SIZE to STACK_SIZE.
+struct ee_stack *ee_stack_get(unsigned long size) {
+    int class = stack_class(size);
+    struct ee_stack *stack = NULL;
+
+    spin_lock(&stack_pools[class].lock);
+    if(!list_empty(&stack_pools[class].stacks)) {
+        stack = list_first_entry(&stack_pools[class].stacks, struct ee_stack, list);
+        list_del(&stack->list);
+        stack_pools[class].count--;
+    }
+    spin_unlock(&stack_pools[class].lock);
+
+    if(!stack) {
+        stack = ee_stack_alloc(size);
+    }
+    return stack;
+}
+
+void ee_stack_put(struct ee_stack *stack) {
+    int class = stack_class(stack->size);
+
+    spin_lock(&stack_pools[class].lock);
+    if(READ_ONCE(pool_active) && stack_pools[class].count < READ_ONCE(stack_pool_size)) {
+        list_add(&stack->list, &stack_pools[class].stacks);
+        stack_pools[class].count++;
+        stack = NULL;
+    }
+    spin_unlock(&stack_pools[class].lock);
+
+    if(stack) {
+        ee_stack_free(stack);
+    }
+}
+
+static void ee_pool_refill(struct work_struct *work) {
+    struct ee_pool *pool = container_of(work, struct ee_pool, refill_work);
+    struct ee_shell *shell;
+    int target = min(READ_ONCE(pool_size), READ_ONCE(pool_high_watermark));
+
+    while(READ_ONCE(pool_active) && READ_ONCE(pool->count) < target) {
+        shell = ee_shell_alloc();
+        if(!shell) {
+            printk(KERN_INFO "Unable to refill execution engine pool\n");
+            return;
+        }
+
+        spin_lock(&pool->lock);
+        if(pool->count >= target) {
+            spin_unlock(&pool->lock);
+            ee_shell_free(shell);
+            return;
+        }
+        list_add(&shell->list, &pool->shells);
+        pool->count++;
+        spin_unlock(&pool->lock);
+    }
+}
+
+struct ee_shell *ee_shell_get(void) {
+    struct ee_pool *pool;
+    struct ee_shell *shell = NULL;
+    int cpu, refill;
+
+    cpu = get_cpu();
+    pool = per_cpu_ptr(&ee_pools, cpu);
+
+    spin_lock(&pool->lock);
+    if(!list_empty(&pool->shells)) {
+        shell = list_first_entry(&pool->shells, struct ee_shell, list);
+        list_del(&shell->list);
+        pool->count--;
+    }
+    refill = pool->count < READ_ONCE(pool_low_watermark);
+    spin_unlock(&pool->lock);
+
+    put_cpu();
+
+    if(refill && READ_ONCE(pool_active)) {
+        schedule_work_on(cpu, &pool->refill_work);
+    }
+
+    if(!shell) {
+        shell = ee_shell_alloc();
+    }
+    return shell;
+}
+
+void ee_shell_put(struct ee_shell *shell) {
+    struct ee_pool *pool;
+
+    pool = get_cpu_ptr(&ee_pools);
+    spin_lock(&pool->lock);
+    if(READ_ONCE(pool_active) && pool->count < READ_ONCE(pool_high_watermark)) {
+        list_add(&shell->list, &pool->shells);
+        pool->count++;
+        shell = NULL;
+    }
+    spin_unlock(&pool->lock);
+    put_cpu_ptr(&ee_pools);
+
+    if(shell) {
+        ee_shell_free(shell);
+    }
+}
+
+int pool_init(void) {
+    int cpu, i;
+    struct ee_pool *pool;
+
+    if(pool_low_watermark > pool_high_watermark || pool_size < 0) {
+        printk(KERN_ALERT "linux-ext-wasm: Invalid execution engine pool configuration\n");
+        return -EINVAL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(&ee_pools, cpu);
+        spin_lock_init(&pool->lock);
+        INIT_LIST_HEAD(&pool->shells);
+        pool->count = 0;
+        INIT_WORK(&pool->refill_work, ee_pool_refill);
+    }
+
+    spin_lock_init(&zero_pages.lock);
+    INIT_LIST_HEAD(&zero_pages.pages);
+    zero_pages.count = 0;
+    INIT_WORK(&zero_pages.refill_work, zero_pages_refill);
+
+    for(i = 0; i < STACK_CLASS_COUNT; i++) {
+        spin_lock_init(&stack_pools[i].lock);
+        INIT_LIST_HEAD(&stack_pools[i].stacks);
+        stack_pools[i].count = 0;
+    }
+
+    WRITE_ONCE(pool_active, 1);
+
+    schedule_work(&zero_pages.refill_work);
+
+    get_online_cpus();
+    for_each_online_cpu(cpu) {
+        schedule_work_on(cpu, &per_cpu_ptr(&ee_pools, cpu)->refill_work);
+    }
+    put_online_cpus();
+
+    return 0;
+}
+
+void pool_cleanup(void) {
+    int cpu, i;
+    struct ee_pool *pool;
+    struct ee_shell *shell;
+    struct ee_stack *stack;
+    struct page *page, *tmp;
+
+    WRITE_ONCE(pool_active, 0);
+
+    cancel_work_sync(&zero_pages.refill_work);
+    list_for_each_entry_safe(page, tmp, &zero_pages.pages, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+    zero_pages.count = 0;
+
+    // Stacks are not put back once `pool_active` is clear.
+    for(i = 0; i < STACK_CLASS_COUNT; i++) {
+        while(1) {
+            spin_lock(&stack_pools[i].lock);
+            if(list_empty(&stack_pools[i].stacks)) {
+                spin_unlock(&stack_pools[i].lock);
+                break;
+            }
+            stack = list_first_entry(&stack_pools[i].stacks, struct ee_stack, list);
+            list_del(&stack->list);
+            stack_pools[i].count--;
+            spin_unlock(&stack_pools[i].lock);
+
+            ee_stack_free(stack); // may sleep
+        }
+    }
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(&ee_pools, cpu);
+        cancel_work_sync(&pool->refill_work);
+
+        while(1) {
+            spin_lock(&pool->lock);
+            if(list_empty(&pool->shells)) {
+                spin_unlock(&pool->lock);
+                break;
+            }
+            shell = list_first_entry(&pool->shells, struct ee_shell, list);
+            list_del(&shell->list);
+            pool->count--;
+            spin_unlock(&pool->lock);
+
+            // `ee_shell_free` may sleep.
+            ee_shell_free(shell);
+        }
+    }
+}
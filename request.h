@@ -28,6 +28,17 @@ struct load_code_request {
     uint32_t dynamic_sigindice_count;
 };
 
+// Like `load_code_request`, with the code and initial memory read from files (e.g. the compiled module
+// on disk, or a memfd) straight into their final pages instead of going through a userspace buffer.
+// A fd of -1 uses the corresponding pointer of `load` instead.
+struct load_code_fd_request {
+    struct load_code_request load;
+    int code_fd;
+    int memory_fd;
+    uint64_t code_offset;
+    uint64_t memory_offset;
+};
+
 struct run_code_result {
     uint32_t success;
     uint64_t retval;
@@ -40,6 +51,23 @@ struct run_code_request {
     struct run_code_result __user *result;
 };
 
+#define WASM_BUDGET_WALL_TIME 1 // time since the call was submitted
+#define WASM_BUDGET_CPU_TIME 2 // time spent by the guest on a CPU, excluding preemption and parked host calls
+
+struct run_usage_result {
+    uint64_t wall_time_ns;
+    uint64_t cpu_time_ns;
+    uint32_t budget_exceeded; // the call was killed for running out of budget
+};
+
+// A run request whose call is killed once it has used up `budget_ns` of the given kind.
+struct budgeted_run_request {
+    struct run_code_request run;
+    uint32_t budget_kind; // WASM_BUDGET_*, or 0 for no budget
+    uint64_t budget_ns;
+    struct run_usage_result __user *usage; // may be NULL
+};
+
 struct read_memory_request {
     uint8_t __user *out;
     uint32_t offset;
@@ -51,3 +79,97 @@ struct write_memory_request {
     uint32_t offset;
     uint32_t len;
 };
+
+#define WASM_LOAD_OPTION_FPU_FREE 1 // value: 1 if the module uses no floating point or SIMD instruction
+#define WASM_LOAD_OPTION_STACK_SIZE 2 // value: guest stack size in bytes, rounded up to a power of two from 64 KB to 2 MB (0: default)
+#define WASM_LOAD_OPTION_BOUNDS_CHECKED 3 // value: 1 if the code checks every linear memory access against the memory bound
+
+struct load_option_request {
+    uint32_t key;
+    uint64_t value;
+};
+
+struct load_snapshot_request {
+    int snapshot_fd;
+};
+
+// Offsets to pass to mmap() on a wasmctl fd to map its run ring or its linear memory.
+#define WASM_MMAP_RING_OFFSET 0ul
+#define WASM_MMAP_MEMORY_OFFSET (1ul << 32)
+
+struct setup_ring_request {
+    uint32_t entries; // must be a power of two
+    uint32_t mmap_size; // out
+};
+
+// Layout of the shared run ring, at the start of the mapping.
+// `sq_tail` and `cq_head` are written by userspace; `sq_head` and `cq_tail` by the kernel.
+struct run_ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;
+    uint32_t sqe_offset;
+    uint32_t cqe_offset;
+    uint32_t reserved;
+};
+
+struct run_ring_sqe {
+    uint64_t user_data;
+    uint32_t entry_offset;
+    uint32_t param_count;
+    uint64_t params[8]; // MAX_PARAM_COUNT
+};
+
+struct run_ring_cqe {
+    uint64_t user_data;
+    uint64_t retval;
+    uint32_t success;
+    uint32_t reserved;
+};
+
+// Names a function in loaded code, for symbolizing guest frames in `perf` profiles.
+struct symbol_entry_request {
+    uint32_t offset; // from the start of the code
+    uint32_t size;
+    char name[64];
+};
+
+struct set_symbols_request {
+    struct symbol_entry_request __user *symbols;
+    uint32_t count;
+};
+
+// Verdicts of packet hooks. Entry functions are called as `(len, packet_len) -> i32` with the first
+// `len` bytes of the packet copied to the scratch range, and drop the packet by returning WASM_HOOK_DROP.
+// Hooks can only be attached to modules loaded with WASM_LOAD_OPTION_BOUNDS_CHECKED: a fault on the
+// linear memory guard pages could only be caught after the kernel oopsed and tainted itself.
+#define WASM_HOOK_DROP 0
+#define WASM_HOOK_ACCEPT 1
+
+struct attach_hook_request {
+    uint32_t entry_offset;
+    uint32_t pf; // NFPROTO_*
+    uint32_t hooknum; // NF_INET_*
+    int32_t priority;
+    uint32_t scratch_offset; // in linear memory
+    uint32_t scratch_len;
+    uint32_t trap_verdict; // if the call traps or runs out of time
+    uint32_t budget_us; // 0 for the hook_budget_us module parameter
+};
+
+struct stats_request {
+    uint64_t run_count;
+    uint64_t run_time_ns; // cumulative wall time spent in guest calls
+    uint64_t last_run_time_ns;
+    uint64_t cpu_time_ns; // run_time_ns minus time spent preempted
+    uint64_t preempted_time_ns;
+    uint64_t preempt_count;
+    uint64_t memory_grow_count;
+    uint64_t memory_grow_bytes;
+    uint64_t memory_pages; // currently mapped OS pages
+    uint64_t kill_count;
+    uint64_t __user *host_call_counts; // one per import, may be NULL
+    uint32_t host_call_count_len; // in: capacity of `host_call_counts`; out: number of imports
+};
@@ -0,0 +1,85 @@
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include "vm.h"
+
+struct run_ring *run_ring_create(uint32_t entries) {
+    struct run_ring *ring;
+    unsigned long sqe_offset, cqe_offset, size;
+
+    BUILD_BUG_ON(ARRAY_SIZE(((struct run_ring_sqe *) NULL)->params) != MAX_PARAM_COUNT);
+
+    if(entries == 0 || entries > MAX_RING_ENTRIES || !is_power_of_2(entries)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    sqe_offset = ALIGN(sizeof(struct run_ring_header), 64);
+    cqe_offset = ALIGN(sqe_offset + sizeof(struct run_ring_sqe) * entries, 64);
+    size = round_up_to_page_size(cqe_offset + sizeof(struct run_ring_cqe) * entries);
+
+    ring = kzalloc(sizeof(struct run_ring), GFP_KERNEL);
+    if(!ring) return ERR_PTR(-ENOMEM);
+
+    ring->base = vmalloc_user(size);
+    if(!ring->base) {
+        kfree(ring);
+        return ERR_PTR(-ENOMEM);
+    }
+    ring->size = size;
+    ring->header = ring->base;
+    ring->sqes = ring->base + sqe_offset;
+    ring->cqes = ring->base + cqe_offset;
+    ring->mask = entries - 1;
+
+    ring->header->entries = entries;
+    ring->header->sqe_offset = sqe_offset;
+    ring->header->cqe_offset = cqe_offset;
+
+    return ring;
+}
+
+void run_ring_destroy(struct run_ring *ring) {
+    vfree(ring->base);
+    kfree(ring);
+}
+
+// Runs the entries submitted so far for which there is completion space, in submission order.
+// Must be called from the runner thread of `ee`.
+uint32_t run_ring_drain(struct run_ring *ring, struct execution_engine *ee) {
+    struct run_ring_header *header = ring->header;
+    struct run_ring_sqe sqe;
+    struct run_ring_cqe *cqe;
+    uint32_t sq_tail, cq_head;
+    uint32_t completed = 0;
+
+    sq_tail = smp_load_acquire(&header->sq_tail);
+    if(sq_tail - ring->sq_head > ring->mask + 1) {
+        sq_tail = ring->sq_head + ring->mask + 1;
+    }
+    while(ring->sq_head != sq_tail) {
+        cq_head = smp_load_acquire(&header->cq_head);
+        if(ring->cq_tail - cq_head > ring->mask) {
+            break; // completion queue full
+        }
+
+        // Userspace may still be writing to the shared slot.
+        memcpy(&sqe, &ring->sqes[ring->sq_head & ring->mask], sizeof(struct run_ring_sqe));
+        ring->sq_head++;
+        smp_store_release(&header->sq_head, ring->sq_head);
+
+        cqe = &ring->cqes[ring->cq_tail & ring->mask];
+        cqe->user_data = sqe.user_data;
+        if(sqe.param_count > MAX_PARAM_COUNT) {
+            cqe->success = 0;
+            cqe->retval = 0;
+        } else {
+            cqe->retval = ee_call(ee, sqe.entry_offset, sqe.params, sqe.param_count);
+            cqe->success = 1;
+        }
+        ring->cq_tail++;
+        smp_store_release(&header->cq_tail, ring->cq_tail);
+
+        completed++;
+    }
+    return completed;
+}
@@ -0,0 +1,579 @@
+#include <linux/module.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/fdtable.h>
+#include <linux/sched/task.h>
+#include <linux/sched/signal.h>
+#include "vm.h"
+#include "kapi.h"
+#include "coroutine.h"
+
+static char *runner_cpus = NULL;
+module_param(runner_cpus, charp, 0444);
+MODULE_PARM_DESC(runner_cpus, "CPUs to run guest code on, as a cpulist (default: all)");
+
+static bool runner_steal = 1;
+module_param(runner_steal, bool, 0644);
+MODULE_PARM_DESC(runner_steal, "Move a session to an idle CPU between runs, and let idle executors take runnable async tasks from busy ones");
+
+static struct cpumask sched_mask;
+static struct cpumask sched_idle_mask; // CPUs whose executor is waiting for work
+
+// Sessions homed on each CPU, and runs currently in progress there.
+static DEFINE_PER_CPU(atomic_t, sched_homed);
+static DEFINE_PER_CPU(atomic_t, sched_active);
+
+// A guest coroutine run by the executor thread of its CPU. It gives the executor back whenever it waits
+// in an async host call, so that idle guests do not hold a thread each.
+//
+// A runnable task queued behind a running one may be taken by an idle executor, and then belongs to
+// that executor's CPU (see `sched_steal`). `cpu` only changes with the locks of both CPUs held.
+struct sched_task {
+    struct Coroutine co; // on the engine stack
+    struct execution_engine *ee;
+    int cpu; // protected by the lock of that CPU
+    struct list_head list; // in the run queue of `cpu`, if `queued`
+    int queued;
+    int cancelled;
+    int dead; // its kill completed; never run again
+    int timed_out;
+    struct files_struct *files; // the guest's file table, installed on the executor while it runs
+    wait_queue_entry_t wait;
+    struct hrtimer timer;
+    struct completion done;
+};
+
+struct sched_cpu {
+    int cpu;
+    spinlock_t lock;
+    struct list_head runnable;
+    struct task_struct *executor;
+    struct sched_task *running;
+    struct files_struct *executor_files; // the executor's own file table while it runs a task
+    struct mutex restart_mu;
+};
+
+static DEFINE_PER_CPU(struct sched_cpu, sched_cpus);
+
+static int sched_executor_start(int cpu);
+void sched_cleanup(void);
+
+int sched_init(void) {
+    int err, cpu;
+    struct sched_cpu *sc;
+
+    if(runner_cpus) {
+        if((err = cpulist_parse(runner_cpus, &sched_mask)) < 0) {
+            printk(KERN_ALERT "linux-ext-wasm: Invalid runner_cpus\n");
+            return err;
+        }
+        cpumask_and(&sched_mask, &sched_mask, cpu_possible_mask);
+    } else {
+        cpumask_copy(&sched_mask, cpu_possible_mask);
+    }
+    if(!cpumask_intersects(&sched_mask, cpu_online_mask)) {
+        printk(KERN_ALERT "linux-ext-wasm: No online CPU in runner_cpus\n");
+        return -EINVAL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(&sched_cpus, cpu);
+        sc->cpu = cpu;
+        spin_lock_init(&sc->lock);
+        INIT_LIST_HEAD(&sc->runnable);
+        mutex_init(&sc->restart_mu);
+        sc->executor = NULL;
+        sc->running = NULL;
+    }
+
+    get_online_cpus();
+    for_each_cpu_and(cpu, &sched_mask, cpu_online_mask) {
+        if((err = sched_executor_start(cpu)) < 0) {
+            put_online_cpus();
+            sched_cleanup();
+            return err;
+        }
+    }
+    put_online_cpus();
+    return 0;
+}
+
+void sched_cleanup(void) {
+    int cpu;
+    struct sched_cpu *sc;
+
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(&sched_cpus, cpu);
+        if(!sc->executor) continue;
+        kthread_stop(sc->executor);
+        put_task_struct(sc->executor);
+        sc->executor = NULL;
+    }
+}
+
+static int sched_least_loaded(atomic_t __percpu *counter, int exclude) {
+    int cpu, best = -1, best_count = INT_MAX, count;
+
+    for_each_cpu_and(cpu, &sched_mask, cpu_online_mask) {
+        if(cpu == exclude) continue;
+        count = atomic_read(per_cpu_ptr(counter, cpu));
+        if(count < best_count) {
+            best = cpu;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+// Picks the home CPU of a new session: the CPU with the fewest sessions in the mask.
+int sched_session_cpu_get(void) {
+    int cpu = sched_least_loaded(&sched_homed, -1);
+
+    if(cpu < 0) cpu = cpumask_first(cpu_online_mask);
+    atomic_inc(per_cpu_ptr(&sched_homed, cpu));
+    return cpu;
+}
+
+void sched_session_cpu_put(int cpu) {
+    atomic_dec(per_cpu_ptr(&sched_homed, cpu));
+}
+
+// Called before a run with the session's current home. If another run is in progress there and some CPU
+// of the mask is idle, the session is moved (its home count included) and the new home is returned.
+// The session's threads must be parked, so that moving them does not lose any cached state mid-run;
+// callers whose runner cannot move pass `may_move` as 0.
+int sched_run_begin(int home, int may_move) {
+    int cpu = home;
+
+    if(
+        may_move && READ_ONCE(runner_steal) &&
+        (atomic_read(per_cpu_ptr(&sched_active, home)) > 0 || !cpu_online(home))
+    ) {
+        cpu = sched_least_loaded(&sched_active, home);
+        if(cpu < 0 || atomic_read(per_cpu_ptr(&sched_active, cpu)) > 0) {
+            cpu = home;
+        } else {
+            atomic_inc(per_cpu_ptr(&sched_homed, cpu));
+            atomic_dec(per_cpu_ptr(&sched_homed, home));
+        }
+    }
+    atomic_inc(per_cpu_ptr(&sched_active, cpu));
+    return cpu;
+}
+
+void sched_run_end(int cpu) {
+    atomic_dec(per_cpu_ptr(&sched_active, cpu));
+}
+
+// Locks the CPU that `t` belongs to.
+static struct sched_cpu *sched_task_lock(struct sched_task *t, unsigned long *flags) {
+    struct sched_cpu *sc;
+    int cpu;
+
+    while(1) {
+        cpu = READ_ONCE(t->cpu);
+        sc = per_cpu_ptr(&sched_cpus, cpu);
+        spin_lock_irqsave(&sc->lock, *flags);
+        if(t->cpu == cpu) return sc;
+        spin_unlock_irqrestore(&sc->lock, *flags); // stolen meanwhile
+    }
+}
+
+static void sched_task_queue(struct sched_task *t) {
+    struct sched_cpu *sc, *idle;
+    unsigned long flags;
+    int busy = 0, cpu;
+
+    sc = sched_task_lock(t, &flags);
+    if(!t->queued && !t->co.terminated && !t->dead) {
+        t->queued = 1;
+        list_add_tail(&t->list, &sc->runnable);
+        if(sc->executor) wake_up_process(sc->executor);
+        busy = sc->running && sc->running != t;
+    }
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    // Let an idle executor take it rather than wait behind the running task.
+    if(busy && READ_ONCE(runner_steal)) {
+        smp_mb(); // pairs with the executor advertising itself idle
+        cpu = cpumask_any_and(&sched_idle_mask, cpu_online_mask);
+        if(cpu < nr_cpu_ids) {
+            idle = per_cpu_ptr(&sched_cpus, cpu);
+            spin_lock_irqsave(&idle->lock, flags);
+            if(idle->executor) wake_up_process(idle->executor);
+            spin_unlock_irqrestore(&idle->lock, flags);
+        }
+    }
+}
+
+static int sched_task_wake_fn(wait_queue_entry_t *wait, unsigned mode, int sync, void *key) {
+    sched_task_queue(container_of(wait, struct sched_task, wait));
+    return 1;
+}
+
+static enum hrtimer_restart sched_task_timer_fn(struct hrtimer *timer) {
+    struct sched_task *t = container_of(timer, struct sched_task, timer);
+
+    WRITE_ONCE(t->timed_out, 1);
+    sched_task_queue(t);
+    return HRTIMER_NORESTART;
+}
+
+// Runs `t` on the current executor until it waits or terminates.
+static void sched_task_resume(struct sched_cpu *sc, struct sched_task *t) {
+    struct files_struct *saved;
+
+    // The first time, the task unshares the executor's file table to make its own; see `executor_files_install`.
+    task_lock(current);
+    saved = current->files;
+    if(t->files) current->files = t->files;
+    else atomic_inc(&saved->count);
+    task_unlock(current);
+    sc->executor_files = saved;
+
+    executor_enter_guest_context(t->ee);
+    co_switch(&t->co.stack);
+    executor_leave_guest_context(t->ee);
+
+    task_lock(current);
+    t->files = current->files;
+    current->files = saved;
+    task_unlock(current);
+}
+
+// Removes `t` from the run queue of `sc`, whose lock is held.
+static void sched_task_unqueue(struct sched_cpu *sc, struct sched_task *t) {
+    if(t->queued) {
+        list_del_init(&t->list);
+        t->queued = 0;
+    }
+}
+
+// Takes the next task to run off the queue of `sc`, whose lock is held. Tasks that terminated or died
+// after being queued are dropped. Killed tasks that are still alive are run, so that they leave their
+// host call (releasing what it holds) and trap.
+static struct sched_task *sched_dequeue(struct sched_cpu *sc) {
+    struct sched_task *t;
+
+    while(!list_empty(&sc->runnable)) {
+        t = list_first_entry(&sc->runnable, struct sched_task, list);
+        sched_task_unqueue(sc, t);
+        if(t->co.terminated || t->dead) continue;
+        return t;
+    }
+    return NULL;
+}
+
+static void sched_lock_pair(struct sched_cpu *a, struct sched_cpu *b) {
+    if(a->cpu < b->cpu) {
+        spin_lock_irq(&a->lock);
+        spin_lock_nested(&b->lock, SINGLE_DEPTH_NESTING);
+    } else {
+        spin_lock_irq(&b->lock);
+        spin_lock_nested(&a->lock, SINGLE_DEPTH_NESTING);
+    }
+}
+
+static void sched_unlock_pair(struct sched_cpu *a, struct sched_cpu *b) {
+    if(a->cpu < b->cpu) {
+        spin_unlock(&b->lock);
+        spin_unlock_irq(&a->lock);
+    } else {
+        spin_unlock(&a->lock);
+        spin_unlock_irq(&b->lock);
+    }
+}
+
+// Takes a runnable task from an executor that is busy running another, for the idle executor of `sc`,
+// and marks it running there. Parked tasks hold no CPU state between resumes (the executor enters and
+// leaves their guest context each time), so they can move freely.
+static struct sched_task *sched_steal(struct sched_cpu *sc) {
+    struct sched_cpu *victim;
+    struct sched_task *t = NULL;
+    int cpu;
+
+    if(!READ_ONCE(runner_steal)) return NULL;
+
+    for_each_cpu_and(cpu, &sched_mask, cpu_online_mask) {
+        victim = per_cpu_ptr(&sched_cpus, cpu);
+        if(victim == sc || !READ_ONCE(victim->running) || list_empty_careful(&victim->runnable)) continue;
+
+        sched_lock_pair(sc, victim);
+        if(victim->running && !sc->running && (t = sched_dequeue(victim))) {
+            t->cpu = sc->cpu;
+            sc->running = t;
+        }
+        sched_unlock_pair(sc, victim);
+        if(t) return t;
+    }
+    return NULL;
+}
+
+static int sched_executor_main(void *data) {
+    struct sched_cpu *sc = data;
+    struct sched_task *t;
+
+    // Lets a guest stuck in a sleeping host call be killed; see `sched_task_kill`.
+    allow_signal(SIGKILL);
+
+    while(!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        spin_lock_irq(&sc->lock);
+        t = sched_dequeue(sc);
+        if(t) sc->running = t;
+        spin_unlock_irq(&sc->lock);
+        if(!t) {
+            // Advertised before looking, so that a task queued behind a busy executor meanwhile wakes us.
+            cpumask_set_cpu(sc->cpu, &sched_idle_mask);
+            smp_mb__after_atomic();
+            t = sched_steal(sc);
+            if(!t) {
+                schedule();
+                cpumask_clear_cpu(sc->cpu, &sched_idle_mask);
+                continue;
+            }
+            cpumask_clear_cpu(sc->cpu, &sched_idle_mask);
+        }
+        __set_current_state(TASK_RUNNING);
+
+        sched_task_resume(sc, t);
+
+        spin_lock_irq(&sc->lock);
+        sc->running = NULL;
+        if(t->co.terminated) {
+            sched_task_unqueue(sc, t); // woken after its last wait
+        }
+        spin_unlock_irq(&sc->lock);
+
+        // A kill of `t` that it survived (by returning, or leaving its host call when cancelled) may have
+        // left SIGKILL pending, which would make us spin and interrupt the host calls of the next task.
+        // It is only sent while `t` is running, so none can come after `running` was cleared above.
+        flush_signals(current);
+
+        if(t->co.terminated) {
+            complete_all(&t->done);
+        }
+        cond_resched();
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static int sched_executor_start(int cpu) {
+    struct sched_cpu *sc = per_cpu_ptr(&sched_cpus, cpu);
+    struct task_struct *ts;
+
+    ts = kthread_create(sched_executor_main, sc, "kwasm_exec/%d", cpu);
+    if(IS_ERR(ts)) {
+        printk(KERN_INFO "Unable to start executor for CPU %d\n", cpu);
+        return PTR_ERR(ts);
+    }
+    get_task_struct(ts);
+    kthread_bind(ts, cpu);
+
+    spin_lock_irq(&sc->lock);
+    sc->executor = ts;
+    spin_unlock_irq(&sc->lock);
+
+    wake_up_process(ts);
+    return 0;
+}
+
+// Creates a task running `entry` on the stack of `ee` on the executor of `cpu` (or of another CPU
+// if `cpu` has none), and queues it. Async host calls made by `ee` then park the task instead of
+// blocking its thread.
+struct sched_task *sched_task_create(struct execution_engine *ee, int cpu, CoEntry entry, void *data) {
+    struct sched_task *t;
+
+    if(!per_cpu_ptr(&sched_cpus, cpu)->executor) {
+        for_each_cpu(cpu, &sched_mask) {
+            if(per_cpu_ptr(&sched_cpus, cpu)->executor) break;
+        }
+        if(cpu >= nr_cpu_ids) return ERR_PTR(-ENODEV);
+    }
+
+    t = kzalloc(sizeof(struct sched_task), GFP_KERNEL);
+    if(!t) return ERR_PTR(-ENOMEM);
+
+    t->ee = ee;
+    t->cpu = cpu;
+    INIT_LIST_HEAD(&t->list);
+    init_waitqueue_func_entry(&t->wait, sched_task_wake_fn);
+    hrtimer_init(&t->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    t->timer.function = sched_task_timer_fn;
+    init_completion(&t->done);
+
+    t->co.stack = ee->stack_end;
+    t->co.entry = entry;
+    t->co.private_data = data;
+    start_coroutine(&t->co);
+
+    ee->async_task = t;
+    sched_task_queue(t);
+    return t;
+}
+
+// Waits for the entry of `t` to return.
+void sched_task_wait(struct sched_task *t) {
+    wait_for_completion(&t->done);
+}
+
+// Frees `t`, which must have terminated or been killed.
+void sched_task_destroy(struct sched_task *t) {
+    unsigned long flags;
+    struct sched_cpu *sc = sched_task_lock(t, &flags);
+
+    sched_task_unqueue(sc, t);
+    t->dead = 1;
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    t->ee->async_task = NULL;
+    if(t->files) vm_put_executor_files(t->files);
+    kfree(t);
+}
+
+// Kills `t`, whose engine has been interrupted (see `ee_interrupt`). Waits in async host calls are cancelled,
+// so that the task traps at its next call in guest code; the executor it traps on dies with it, and is
+// replaced. Other tasks of that executor are unaffected, since they are parked on their own stacks.
+// If the task is still running after `grace`, its code is made non-executable.
+void sched_task_kill(struct sched_task *t, long grace) {
+    struct sched_cpu *sc;
+    struct task_struct *ts;
+    unsigned long deadline = jiffies + grace;
+    int made_nx = 0, cpu;
+
+    WRITE_ONCE(t->cancelled, 1);
+    sched_task_queue(t);
+
+    while(!completion_done(&t->done)) {
+        if(!made_nx && time_after(jiffies, deadline)) {
+            ee_make_code_nx(t->ee); // trigger a page fault
+            made_nx = 1;
+        }
+
+        // The task may move to another executor until it is running; see `sched_steal`.
+        cpu = READ_ONCE(t->cpu);
+        sc = per_cpu_ptr(&sched_cpus, cpu);
+        mutex_lock(&sc->restart_mu);
+        spin_lock_irq(&sc->lock);
+        ts = sc->running == t ? sc->executor : NULL;
+        if(ts) get_task_struct(ts);
+        if(ts && !(READ_ONCE(ts->flags) & PF_EXITING)) {
+            // Under the lock, so that it cannot hit the next task of the executor (see `sched_executor_main`).
+            kill_pid(task_pid(ts), SIGKILL, 0); // interrupts sleeping host calls
+        }
+        spin_unlock_irq(&sc->lock);
+
+        if(ts && (READ_ONCE(ts->flags) & PF_EXITING)) {
+            // The guest trapped and took the executor down; its file table went away with it.
+            kthread_stop(ts);
+
+            spin_lock_irq(&sc->lock);
+            sc->running = NULL;
+            sc->executor = NULL;
+            sched_task_unqueue(sc, t); // queued by our own wakeup above
+            t->dead = 1;
+            spin_unlock_irq(&sc->lock);
+            put_task_struct(ts); // reference of `sc`
+
+            t->files = NULL;
+            vm_put_executor_files(sc->executor_files); // left behind by the executor
+            complete_all(&t->done);
+            sched_executor_start(cpu);
+        }
+        if(ts) put_task_struct(ts);
+        mutex_unlock(&sc->restart_mu);
+
+        if(!completion_done(&t->done)) {
+            schedule_timeout_uninterruptible(1);
+        }
+    }
+    if(made_nx) {
+        ee_make_code_x(t->ee);
+    }
+}
+
+// Async host call support; see kapi.h.
+
+int kwasm_is_async(struct vmctx *ctx) {
+    return ((struct execution_engine *) ctx)->async_task != NULL;
+}
+EXPORT_SYMBOL(kwasm_is_async);
+
+long kwasm_wait_event(struct vmctx *ctx, wait_queue_head_t *wq, int (*cond)(void *data), void *data, long timeout) {
+    struct sched_task *t = ((struct execution_engine *) ctx)->async_task;
+    unsigned long deadline = jiffies + timeout;
+    long ret;
+
+    if(!t) {
+        return wait_event_interruptible_timeout(*wq, cond(data), timeout);
+    }
+
+    if(cond(data)) return timeout ? timeout : 1;
+    if(!timeout) return 0;
+
+    t->timed_out = 0;
+    if(timeout != MAX_SCHEDULE_TIMEOUT) {
+        hrtimer_start(&t->timer, ms_to_ktime(jiffies_to_msecs(timeout)), HRTIMER_MODE_REL);
+    }
+    add_wait_queue(wq, &t->wait);
+    while(1) {
+        if(cond(data)) {
+            if(timeout == MAX_SCHEDULE_TIMEOUT) ret = timeout;
+            else ret = time_before(jiffies, deadline) ? deadline - jiffies : 1;
+            break;
+        }
+        if(READ_ONCE(t->cancelled)) {
+            ret = -EINTR;
+            break;
+        }
+        if(READ_ONCE(t->timed_out)) {
+            ret = 0;
+            break;
+        }
+        co_switch(&t->co.stack); // back to the executor
+    }
+    remove_wait_queue(wq, &t->wait);
+    hrtimer_cancel(&t->timer);
+    return ret;
+}
+EXPORT_SYMBOL(kwasm_wait_event);
+
+struct kwasm_poll_capture {
+    poll_table pt;
+    wait_queue_head_t *wq;
+};
+
+struct kwasm_poll_wait {
+    struct file *f;
+    unsigned int events;
+};
+
+static void kwasm_poll_capture_fn(struct file *f, wait_queue_head_t *wq, poll_table *pt) {
+    struct kwasm_poll_capture *capture = container_of(pt, struct kwasm_poll_capture, pt);
+    if(!capture->wq) capture->wq = wq;
+}
+
+static int kwasm_poll_ready(void *data) {
+    struct kwasm_poll_wait *w = data;
+    return (w->f->f_op->poll(w->f, NULL) & w->events) != 0;
+}
+
+long kwasm_wait_file(struct vmctx *ctx, struct file *f, unsigned int events, long timeout) {
+    struct kwasm_poll_capture capture = { .wq = NULL };
+    struct kwasm_poll_wait w = { .f = f, .events = events | POLLERR | POLLHUP };
+
+    if(!f->f_op->poll) return timeout ? timeout : 1;
+
+    init_poll_funcptr(&capture.pt, kwasm_poll_capture_fn);
+    if(f->f_op->poll(f, &capture.pt) & w.events) return timeout ? timeout : 1;
+    if(!capture.wq) return -EINVAL;
+
+    return kwasm_wait_event(ctx, capture.wq, kwasm_poll_ready, &w, timeout);
+}
+EXPORT_SYMBOL(kwasm_wait_file);
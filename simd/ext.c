@@ -0,0 +1,208 @@
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#include <linux/crc32.h>
+#include <linux/xxhash.h>
+#include <linux/siphash.h>
+#include <net/checksum.h>
+#include <asm/cpufeature.h>
+#include "../kapi.h"
+#include "../vm.h"
+
+// Data-parallel primitives on linear memory that singlepass code cannot produce efficiently.
+//
+// Each call bounds-checks its ranges once and then runs on the kernel mapping of linear memory.
+// None of them touch FPU/SIMD registers, so that they can be called from engines loaded with
+// `WASM_LOAD_OPTION_FPU_FREE` as well; the fast paths are integer instructions (SSE4.2 `crc32`)
+// or the kernel's own arch-specific routines (`csum_partial`).
+
+typedef uint32_t wasm_pointer_t;
+
+struct import_resolver *resolver;
+
+static bool has_sse42;
+
+#ifdef CONFIG_X86_64
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc, v;
+    uint32_t c32;
+
+    while(len >= 8) {
+        memcpy(&v, p, 8);
+        asm("crc32q %1, %0" : "+r" (c) : "rm" (v));
+        p += 8;
+        len -= 8;
+    }
+    c32 = c;
+    while(len--) {
+        asm("crc32b %1, %0" : "+r" (c32) : "rm" (*p));
+        p++;
+    }
+    return c32;
+}
+#endif
+
+// Returns the ones' complement of the ones' complement sum of the range folded to 16 bits, starting from
+// the 32-bit partial sum `sum` (0 for a new checksum), as stored in IP/TCP/UDP headers.
+int __simd_inet_csum(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, uint32_t sum) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+
+    if(!p) return -EFAULT;
+    return (__force uint16_t) csum_fold(csum_partial(p, len, (__force __wsum) sum));
+}
+
+// Updates `crc` in the same way as the kernel's crc32c(): no inversion is done on input or output.
+int64_t __simd_crc32c(struct vmctx *ctx, uint32_t crc, wasm_pointer_t buf, uint32_t len) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+
+    if(!p) return -EFAULT;
+#ifdef CONFIG_X86_64
+    if(has_sse42) return crc32c_sse42(crc, p, len);
+#endif
+    return __crc32c_le(crc, p, len);
+}
+
+int64_t __simd_xxh32(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, uint32_t seed) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+
+    if(!p) return -EFAULT;
+    return xxh32(p, len, seed);
+}
+
+// 64-bit results are stored at `out` instead of returned, so that they cannot be mistaken for errors.
+int __simd_xxh64(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, uint64_t seed, wasm_pointer_t out) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+    uint8_t *out_p = vmctx_get_memory_slice(ctx, out, sizeof(uint64_t));
+    uint64_t h;
+
+    if(!p || !out_p) return -EFAULT;
+    h = xxh64(p, len, seed);
+    memcpy(out_p, &h, sizeof(uint64_t));
+    return 0;
+}
+
+// `key` points to the 16-byte key.
+int __simd_siphash(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, wasm_pointer_t key, wasm_pointer_t out) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+    uint8_t *key_p = vmctx_get_memory_slice(ctx, key, sizeof(siphash_key_t));
+    uint8_t *out_p = vmctx_get_memory_slice(ctx, out, sizeof(uint64_t));
+    siphash_key_t k;
+    uint64_t h;
+
+    if(!p || !key_p || !out_p) return -EFAULT;
+    memcpy(&k, key_p, sizeof(siphash_key_t));
+    h = siphash(p, len, &k);
+    memcpy(out_p, &h, sizeof(uint64_t));
+    return 0;
+}
+
+// Returns the offset of the first `c` in the range, or -ENOENT.
+int __simd_memchr(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, uint32_t c) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+    uint8_t *found;
+
+    if(!p) return -EFAULT;
+    found = memchr(p, (uint8_t) c, len);
+    return found ? found - p : -ENOENT;
+}
+
+// Returns the offset of the first occurrence of the needle in the range, or -ENOENT.
+int __simd_memmem(struct vmctx *ctx, wasm_pointer_t buf, uint32_t len, wasm_pointer_t needle, uint32_t needle_len) {
+    uint8_t *p = vmctx_get_memory_slice(ctx, buf, len);
+    uint8_t *n = vmctx_get_memory_slice(ctx, needle, needle_len);
+    uint8_t *cur, *last;
+
+    if(!p || !n) return -EFAULT;
+    if(needle_len == 0) return 0;
+    if(needle_len > len) return -ENOENT;
+
+    last = p + (len - needle_len);
+    for(cur = p; cur <= last; cur++) {
+        cur = memchr(cur, n[0], last - cur + 1);
+        if(!cur) break;
+        if(!memcmp(cur + 1, n + 1, needle_len - 1)) return cur - p;
+    }
+    return -ENOENT;
+}
+
+// Writes `2 * len` lowercase hex digits to `dst`, which must not overlap the input, and returns their count.
+int __simd_hex_encode(struct vmctx *ctx, wasm_pointer_t src, uint32_t len, wasm_pointer_t dst) {
+    uint64_t out_len = (uint64_t) len * 2;
+    uint8_t *p, *out_p;
+
+    if(out_len > INT_MAX) return -EINVAL;
+    p = vmctx_get_memory_slice(ctx, src, len);
+    out_p = vmctx_get_memory_slice(ctx, dst, out_len);
+    if(!p || !out_p) return -EFAULT;
+
+    bin2hex(out_p, p, len);
+    return out_len;
+}
+
+static const char base64_table[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Writes the padded standard base64 encoding of the input to `dst`, which must not overlap it,
+// and returns its length (`4 * ceil(len / 3)`).
+int __simd_base64_encode(struct vmctx *ctx, wasm_pointer_t src, uint32_t len, wasm_pointer_t dst) {
+    uint64_t out_len = ((uint64_t) len + 2) / 3 * 4;
+    uint8_t *p, *out_p;
+    uint32_t i, v;
+
+    if(out_len > INT_MAX) return -EINVAL;
+    p = vmctx_get_memory_slice(ctx, src, len);
+    out_p = vmctx_get_memory_slice(ctx, dst, out_len);
+    if(!p || !out_p) return -EFAULT;
+
+    for(i = 0; i + 3 <= len; i += 3) {
+        v = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+        *out_p++ = base64_table[v >> 18];
+        *out_p++ = base64_table[(v >> 12) & 63];
+        *out_p++ = base64_table[(v >> 6) & 63];
+        *out_p++ = base64_table[v & 63];
+    }
+    if(i < len) {
+        v = p[i] << 16;
+        if(i + 1 < len) v |= p[i + 1] << 8;
+        *out_p++ = base64_table[v >> 18];
+        *out_p++ = base64_table[(v >> 12) & 63];
+        *out_p++ = i + 1 < len ? base64_table[(v >> 6) & 63] : '=';
+        *out_p++ = '=';
+    }
+    return out_len;
+}
+
+static const struct import_entry simd_imports[] = {
+    { "simd##inet_csum", __simd_inet_csum, 3 },
+    { "simd##crc32c", __simd_crc32c, 3 },
+    { "simd##xxh32", __simd_xxh32, 3 },
+    { "simd##xxh64", __simd_xxh64, 4 },
+    { "simd##siphash", __simd_siphash, 4 },
+    { "simd##memchr", __simd_memchr, 3 },
+    { "simd##memmem", __simd_memmem, 4 },
+    { "simd##hex_encode", __simd_hex_encode, 3 },
+    { "simd##base64_encode", __simd_base64_encode, 3 },
+};
+
+int __init init_module(void) {
+    struct import_resolver tmp = {
+        .imports = simd_imports,
+        .import_count = ARRAY_SIZE(simd_imports),
+    };
+
+#ifdef CONFIG_X86_64
+    has_sse42 = boot_cpu_has(X86_FEATURE_XMM4_2);
+#endif
+
+    resolver = kwasm_resolver_register(&tmp);
+    if(IS_ERR(resolver)) {
+        return PTR_ERR(resolver);
+    }
+    return 0;
+}
+
+void __exit cleanup_module(void) {
+    kwasm_resolver_deregister(resolver);
+}
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,138 @@
+#include <linux/module.h>
+#include <linux/anon_inodes.h>
+#include <linux/string.h>
+#include "vm.h"
+
+static int snapshot_release(struct inode *_inode, struct file *f) {
+    ee_snapshot_put(f->private_data);
+    return 0;
+}
+
+static struct file_operations snapshot_ops = {
+    .owner = THIS_MODULE,
+    .release = snapshot_release,
+};
+
+static void snapshot_free(struct ee_snapshot *snap) {
+    unsigned long i;
+
+    if(snap->memory_pages) {
+        for(i = 0; i < snap->memory_len / PAGE_SIZE; i++) {
+            if(snap->memory_pages[i]) __free_page(snap->memory_pages[i]);
+        }
+        kvfree(snap->memory_pages);
+    }
+    kvfree(snap->table);
+    kvfree(snap->dynamic_sigindices);
+    kvfree(snap->imported_funcs);
+    kvfree(snap->globals);
+    if(snap->code_image) code_image_put(snap->code_image);
+    kfree(snap);
+}
+
+static void snapshot_kref_release(struct kref *ref) {
+    snapshot_free(container_of(ref, struct ee_snapshot, ref));
+}
+
+struct ee_snapshot *ee_snapshot_create(struct execution_engine *ee) {
+    struct ee_snapshot *snap;
+    struct anyfunc *entry;
+    uint8_t *src;
+    unsigned long i;
+
+    snap = kzalloc(sizeof(struct ee_snapshot), GFP_KERNEL);
+    if(!snap) return ERR_PTR(-ENOMEM);
+    kref_init(&snap->ref);
+
+    code_image_ref(ee->code_image);
+    snap->code_image = ee->code_image;
+    snap->fpu_free = ee->fpu_free;
+    snap->bounds_checked = ee->bounds_checked;
+    snap->stack_size = ee->stack_size;
+
+    if(ee->ctx.memory_base && ee->ctx.memory_bound) {
+        snap->memory_pages = kvcalloc(ee->ctx.memory_bound / PAGE_SIZE, sizeof(struct page *), GFP_KERNEL);
+        if(!snap->memory_pages) goto fail;
+        snap->memory_len = ee->ctx.memory_bound;
+
+        for(i = 0; i < snap->memory_len / PAGE_SIZE; i++) {
+            src = ee->ctx.memory_base + i * PAGE_SIZE;
+            if(!memchr_inv(src, 0, PAGE_SIZE)) continue;
+
+            snap->memory_pages[i] = alloc_page(GFP_KERNEL);
+            if(!snap->memory_pages[i]) goto fail;
+            copy_page(page_address(snap->memory_pages[i]), src);
+        }
+    }
+
+    if(ee->global_count) {
+        snap->globals = kvmalloc_array(ee->global_count, sizeof(uint64_t), GFP_KERNEL);
+        if(!snap->globals) goto fail;
+        memcpy(snap->globals, ee->local_global_backing, sizeof(uint64_t) * ee->global_count);
+        snap->global_count = ee->global_count;
+    }
+
+    if(ee->imported_func_count) {
+        snap->imported_funcs = kvmalloc_array(ee->imported_func_count, sizeof(void *), GFP_KERNEL);
+        if(!snap->imported_funcs) goto fail;
+        for(i = 0; i < ee->imported_func_count; i++) {
+            snap->imported_funcs[i] = ee_imported_func_target(ee, i);
+        }
+        snap->imported_func_count = ee->imported_func_count;
+    }
+
+    if(ee->dynamic_sigindice_count) {
+        snap->dynamic_sigindices = kvmalloc_array(ee->dynamic_sigindice_count, sizeof(uint32_t), GFP_KERNEL);
+        if(!snap->dynamic_sigindices) goto fail;
+        memcpy(snap->dynamic_sigindices, ee->ctx.dynamic_sigindices, sizeof(uint32_t) * ee->dynamic_sigindice_count);
+        snap->dynamic_sigindice_count = ee->dynamic_sigindice_count;
+    }
+
+    if(ee->local_table_backing.base && ee->local_table_backing.count) {
+        snap->table = kvmalloc_array(ee->local_table_backing.count, sizeof(struct table_entry_request), GFP_KERNEL);
+        if(!snap->table) goto fail;
+        for(i = 0; i < ee->local_table_backing.count; i++) {
+            entry = &ee->local_table_backing.base[i];
+            if(entry->func) {
+                snap->table[i].offset = (unsigned long) entry->func - (unsigned long) ee->code;
+            } else {
+                snap->table[i].offset = (unsigned long) (-1L);
+            }
+            snap->table[i].sig_id = entry->sig_id;
+        }
+        snap->table_count = ee->local_table_backing.count;
+    }
+
+    return snap;
+
+    fail:
+    snapshot_free(snap);
+    return ERR_PTR(-ENOMEM);
+}
+
+void ee_snapshot_put(struct ee_snapshot *snap) {
+    kref_put(&snap->ref, snapshot_kref_release);
+}
+
+// Takes over the caller's reference to `snap` on success.
+int ee_snapshot_install_fd(struct ee_snapshot *snap) {
+    return anon_inode_getfd("wasm-snapshot", &snapshot_ops, snap, O_RDWR | O_CLOEXEC);
+}
+
+struct ee_snapshot *ee_snapshot_get_from_fd(int fd) {
+    struct file *f;
+    struct ee_snapshot *snap;
+
+    f = fget(fd);
+    if(!f) return ERR_PTR(-EBADF);
+
+    if(f->f_op != &snapshot_ops) {
+        fput(f);
+        return ERR_PTR(-EINVAL);
+    }
+
+    snap = f->private_data;
+    kref_get(&snap->ref);
+    fput(f);
+    return snap;
+}
@@ -0,0 +1,270 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/vmalloc.h>
+#include "vm.h"
+#include "trace.h"
+
+#define HOST_CALL_THUNK_SIZE 32
+
+static bool host_call_stats = 1;
+module_param(host_call_stats, bool, 0644);
+MODULE_PARM_DESC(host_call_stats, "Count host calls per import through per-engine thunks");
+
+static struct dentry *stats_root;
+static atomic_t next_engine_id = ATOMIC_INIT(0);
+
+int stats_init(void) {
+    stats_root = debugfs_create_dir("kernel-wasm", NULL);
+    code_cache_debugfs_init(stats_root);
+    return 0;
+}
+
+void stats_cleanup(void) {
+    debugfs_remove_recursive(stats_root);
+}
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_SMP)
+// Generated code calls imports with the vmctx and arguments in the usual registers; %rax is free
+// since imports are never variadic. The counter is a per-CPU pointer, incremented in the same way
+// as `this_cpu_inc`.
+static const uint8_t host_call_thunk_template[] = {
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // movabs $counter, %rax
+    0x65, 0x48, 0xff, 0x00, // incq %gs:(%rax)
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // movabs $target, %rax
+    0xff, 0xe0, // jmp *%rax
+};
+#define HOST_CALL_THUNK_COUNTER_OFFSET 2
+#define HOST_CALL_THUNK_TARGET_OFFSET 16
+
+// Points every import at a thunk that counts the call before jumping to the real function.
+static int ee_install_host_call_thunks(struct execution_engine *ee) {
+    uint32_t i;
+    uint8_t *thunk;
+    uint64_t counter, target;
+
+    BUILD_BUG_ON(sizeof(host_call_thunk_template) > HOST_CALL_THUNK_SIZE);
+
+    ee->host_call_targets = kmalloc_array(ee->imported_func_count, sizeof(void *), GFP_KERNEL);
+    if(!ee->host_call_targets) return -ENOMEM;
+
+    ee->host_call_thunks = __vmalloc(
+        round_up_to_page_size(ee->imported_func_count * HOST_CALL_THUNK_SIZE),
+        GFP_KERNEL,
+        PAGE_KERNEL_EXEC
+    );
+    if(!ee->host_call_thunks) {
+        kfree(ee->host_call_targets);
+        ee->host_call_targets = NULL;
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < ee->imported_func_count; i++) {
+        thunk = ee->host_call_thunks + i * HOST_CALL_THUNK_SIZE;
+        counter = (uint64_t) (ee->host_call_counts + i);
+        target = (uint64_t) ee->ctx.imported_funcs[i].func;
+
+        memcpy(thunk, host_call_thunk_template, sizeof(host_call_thunk_template));
+        memcpy(thunk + HOST_CALL_THUNK_COUNTER_OFFSET, &counter, sizeof(uint64_t));
+        memcpy(thunk + HOST_CALL_THUNK_TARGET_OFFSET, &target, sizeof(uint64_t));
+
+        ee->host_call_targets[i] = ee->ctx.imported_funcs[i].func;
+        ee->ctx.imported_funcs[i].func = thunk;
+    }
+    return 0;
+}
+#else
+static int ee_install_host_call_thunks(struct execution_engine *ee) {
+    return 0;
+}
+#endif
+
+static int ee_stats_show(struct seq_file *m, void *_unused) {
+    struct execution_engine *ee = m->private;
+    struct stats_request st;
+    uint32_t i;
+    int cpu;
+    uint64_t count;
+
+    ee_stats_read(ee, &st, NULL);
+
+    seq_printf(m, "run_count %llu\n", st.run_count);
+    seq_printf(m, "run_time_ns %llu\n", st.run_time_ns);
+    seq_printf(m, "last_run_time_ns %llu\n", st.last_run_time_ns);
+    seq_printf(m, "cpu_time_ns %llu\n", st.cpu_time_ns);
+    seq_printf(m, "preempted_time_ns %llu\n", st.preempted_time_ns);
+    seq_printf(m, "preempt_count %llu\n", st.preempt_count);
+    seq_printf(m, "memory_grow_count %llu\n", st.memory_grow_count);
+    seq_printf(m, "memory_grow_bytes %llu\n", st.memory_grow_bytes);
+    seq_printf(m, "memory_pages %llu\n", st.memory_pages);
+    seq_printf(m, "kill_count %llu\n", st.kill_count);
+
+    if(ee->host_call_counts) {
+        for(i = 0; i < ee->imported_func_count; i++) {
+            count = 0;
+            for_each_possible_cpu(cpu) {
+                count += *per_cpu_ptr(ee->host_call_counts + i, cpu);
+            }
+            seq_printf(m, "host_calls %u %ps %llu\n", i, ee->host_call_targets[i], count);
+        }
+    }
+    return 0;
+}
+
+static int ee_stats_open(struct inode *inode, struct file *f) {
+    return single_open(f, ee_stats_show, inode->i_private);
+}
+
+static const struct file_operations ee_stats_ops = {
+    .owner = THIS_MODULE,
+    .open = ee_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Must be called once the engine's imports are resolved.
+int ee_stats_init(struct execution_engine *ee) {
+    int err;
+    char name[16];
+
+    ee->stats = alloc_percpu(struct ee_stats_cpu);
+    if(!ee->stats) return -ENOMEM;
+
+    if(READ_ONCE(host_call_stats) && ee->imported_func_count) {
+        ee->host_call_counts = __alloc_percpu(sizeof(uint64_t) * ee->imported_func_count, sizeof(uint64_t));
+        if(!ee->host_call_counts) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        if((err = ee_install_host_call_thunks(ee)) < 0) {
+            goto fail;
+        }
+    }
+
+    if((err = ee_trace_init(ee)) < 0) {
+        goto fail;
+    }
+
+    ee->id = atomic_inc_return(&next_engine_id);
+    snprintf(name, sizeof(name), "%u", ee->id);
+    ee->debugfs_entry = debugfs_create_file(name, 0400, stats_root, ee, &ee_stats_ops);
+    return 0;
+
+    fail:
+    ee_stats_release(ee);
+    return err;
+}
+
+void ee_stats_release(struct execution_engine *ee) {
+    // Waits for readers of the debugfs file.
+    debugfs_remove(ee->debugfs_entry);
+    ee->debugfs_entry = NULL;
+
+    ee_trace_release(ee);
+    kfree(ee->host_call_targets);
+    ee->host_call_targets = NULL;
+    vfree(ee->host_call_thunks);
+    ee->host_call_thunks = NULL;
+    free_percpu(ee->host_call_counts);
+    ee->host_call_counts = NULL;
+    free_percpu(ee->stats);
+    ee->stats = NULL;
+}
+
+void ee_stats_run_begin(struct execution_engine *ee) {
+    WRITE_ONCE(ee->run_preempted_ns, 0);
+    WRITE_ONCE(ee->run_start_ns, local_clock());
+}
+
+void ee_stats_run_end(struct execution_engine *ee) {
+    uint64_t elapsed = local_clock() - ee->run_start_ns;
+
+    WRITE_ONCE(ee->run_start_ns, 0);
+    WRITE_ONCE(ee->last_run_time_ns, elapsed);
+    this_cpu_inc(ee->stats->run_count);
+    this_cpu_add(ee->stats->run_time_ns, elapsed);
+}
+
+// Called from the controlling thread when a run is interrupted and its runner killed.
+void ee_stats_record_kill(struct execution_engine *ee) {
+    uint64_t start = READ_ONCE(ee->run_start_ns);
+    uint64_t elapsed = 0;
+
+    this_cpu_inc(ee->stats->kill_count);
+    if(start) {
+        elapsed = local_clock() - start;
+        this_cpu_add(ee->stats->run_time_ns, elapsed);
+        WRITE_ONCE(ee->last_run_time_ns, elapsed);
+        WRITE_ONCE(ee->run_start_ns, 0);
+    }
+    trace_kwasm_kill(ee, elapsed);
+}
+
+// Preempt notifier hooks. Time off CPU is only accounted while a call is running; a runner
+// parked between calls is not preempted.
+void ee_stats_sched_out(struct execution_engine *ee) {
+    if(!READ_ONCE(ee->run_start_ns)) return;
+    WRITE_ONCE(ee->sched_out_ns, local_clock());
+    this_cpu_inc(ee->stats->preempt_count);
+}
+
+void ee_stats_sched_in(struct execution_engine *ee) {
+    uint64_t off;
+
+    if(!ee->sched_out_ns) return;
+    off = local_clock() - ee->sched_out_ns;
+    this_cpu_add(ee->stats->preempted_time_ns, off);
+    WRITE_ONCE(ee->run_preempted_ns, ee->run_preempted_ns + off);
+    WRITE_ONCE(ee->sched_out_ns, 0);
+}
+
+// Time used by the current call so far, or by the last one if none is running.
+void ee_stats_run_usage(struct execution_engine *ee, uint64_t *wall_time_ns, uint64_t *cpu_time_ns) {
+    uint64_t now = local_clock();
+    uint64_t start = READ_ONCE(ee->run_start_ns);
+    uint64_t sched_out = READ_ONCE(ee->sched_out_ns);
+    uint64_t wall = start ? now - start : READ_ONCE(ee->last_run_time_ns);
+    uint64_t off = READ_ONCE(ee->run_preempted_ns);
+
+    if(start && sched_out && now > sched_out) {
+        off += now - sched_out; // scheduled out right now
+    }
+
+    *wall_time_ns = wall;
+    *cpu_time_ns = wall > off ? wall - off : 0;
+}
+
+// Sums the per-CPU counters of `ee`. If `host_call_counts` is not NULL, it receives one count per import.
+void ee_stats_read(struct execution_engine *ee, struct stats_request *out, uint64_t *host_call_counts) {
+    int cpu;
+    uint32_t i;
+    struct ee_stats_cpu *st;
+
+    memset(out, 0, sizeof(struct stats_request));
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(ee->stats, cpu);
+        out->run_count += st->run_count;
+        out->run_time_ns += st->run_time_ns;
+        out->preempted_time_ns += st->preempted_time_ns;
+        out->preempt_count += st->preempt_count;
+        out->memory_grow_count += st->memory_grow_count;
+        out->memory_grow_bytes += st->memory_grow_bytes;
+        out->kill_count += st->kill_count;
+    }
+    out->last_run_time_ns = READ_ONCE(ee->last_run_time_ns);
+    out->cpu_time_ns = out->run_time_ns > out->preempted_time_ns ? out->run_time_ns - out->preempted_time_ns : 0;
+    out->memory_pages = READ_ONCE(ee->memory_page_count);
+    out->host_call_count_len = ee->imported_func_count;
+
+    if(host_call_counts) {
+        for(i = 0; i < ee->imported_func_count; i++) {
+            host_call_counts[i] = 0;
+            if(!ee->host_call_counts) continue;
+            for_each_possible_cpu(cpu) {
+                host_call_counts[i] += *per_cpu_ptr(ee->host_call_counts + i, cpu);
+            }
+        }
+    }
+}
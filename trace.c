@@ -0,0 +1,134 @@
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include "vm.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+#define TRACE_THUNK_SIZE 32
+
+static bool host_call_trace = 0;
+module_param(host_call_trace, bool, 0644);
+MODULE_PARM_DESC(host_call_trace, "Route host calls of engines loaded from now on through the kwasm_host_call_* tracepoints");
+
+void kwasm_trace_host_call_entry(struct ee_trace_record *rec);
+void kwasm_trace_host_call_exit(struct ee_trace_record *rec, uint64_t ret);
+
+#ifdef CONFIG_X86_64
+// Entered from a per-import thunk with the record in %rax, in place of the import, with the import's
+// arguments in place. The return address is popped into the record and the import called from here,
+// so that stack arguments stay where it expects them and any arity can be traced. An engine has at
+// most one host call in progress, so the record is free to hold the caller's state; %rbx is saved
+// there to keep the record across the call.
+asm(
+    ".text\n"
+    ".globl kwasm_trace_thunk\n"
+    "kwasm_trace_thunk:\n"
+    "pop %r11\n"
+    "mov %r11, 8(%rax)\n"
+    "mov %rbx, 16(%rax)\n"
+    "mov %rax, %rbx\n"
+    "push %rdi\n"
+    "push %rsi\n"
+    "push %rdx\n"
+    "push %rcx\n"
+    "push %r8\n"
+    "push %r9\n"
+    "mov %rbx, %rdi\n"
+    "call kwasm_trace_host_call_entry\n"
+    "pop %r9\n"
+    "pop %r8\n"
+    "pop %rcx\n"
+    "pop %rdx\n"
+    "pop %rsi\n"
+    "pop %rdi\n"
+    "call *(%rbx)\n"
+    "push %rax\n"
+    "push %rax\n" // keeps the stack aligned
+    "mov %rbx, %rdi\n"
+    "mov %rax, %rsi\n"
+    "call kwasm_trace_host_call_exit\n"
+    "pop %rax\n"
+    "pop %rax\n"
+    "mov %rbx, %r11\n"
+    "mov 16(%r11), %rbx\n"
+    "jmp *8(%r11)\n"
+);
+
+void kwasm_trace_thunk(void);
+
+static const uint8_t trace_thunk_template[] = {
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, // movabs $record, %rax
+    0x49, 0xbb, 0, 0, 0, 0, 0, 0, 0, 0, // movabs $kwasm_trace_thunk, %r11
+    0x41, 0xff, 0xe3, // jmp *%r11
+};
+#define TRACE_THUNK_RECORD_OFFSET 2
+#define TRACE_THUNK_TARGET_OFFSET 12
+
+void kwasm_trace_host_call_entry(struct ee_trace_record *rec) {
+    trace_kwasm_host_call_entry(rec->ee, rec->index, ee_imported_func_target(rec->ee, rec->index));
+}
+
+void kwasm_trace_host_call_exit(struct ee_trace_record *rec, uint64_t ret) {
+    trace_kwasm_host_call_exit(rec->ee, rec->index, ret);
+}
+
+// Must be called once the engine's imports are resolved, after host call counting thunks are installed.
+// Tracing thunks go in front of them, and the real imports stay in `host_call_targets`.
+int ee_trace_init(struct execution_engine *ee) {
+    uint32_t i;
+    uint8_t *thunk;
+    uint64_t record, target = (uint64_t) kwasm_trace_thunk;
+
+    BUILD_BUG_ON(sizeof(trace_thunk_template) > TRACE_THUNK_SIZE);
+    BUILD_BUG_ON(offsetof(struct ee_trace_record, target) != 0);
+    BUILD_BUG_ON(offsetof(struct ee_trace_record, saved_ret) != 8);
+    BUILD_BUG_ON(offsetof(struct ee_trace_record, saved_rbx) != 16);
+
+    if(!READ_ONCE(host_call_trace) || !ee->imported_func_count) return 0;
+
+    if(!ee->host_call_targets) {
+        ee->host_call_targets = kmalloc_array(ee->imported_func_count, sizeof(void *), GFP_KERNEL);
+        if(!ee->host_call_targets) return -ENOMEM;
+        for(i = 0; i < ee->imported_func_count; i++) {
+            ee->host_call_targets[i] = ee->ctx.imported_funcs[i].func;
+        }
+    }
+
+    ee->trace_records = kcalloc(ee->imported_func_count, sizeof(struct ee_trace_record), GFP_KERNEL);
+    if(!ee->trace_records) return -ENOMEM;
+
+    ee->trace_thunks = __vmalloc(
+        round_up_to_page_size(ee->imported_func_count * TRACE_THUNK_SIZE),
+        GFP_KERNEL,
+        PAGE_KERNEL_EXEC
+    );
+    if(!ee->trace_thunks) return -ENOMEM;
+
+    for(i = 0; i < ee->imported_func_count; i++) {
+        ee->trace_records[i].target = ee->ctx.imported_funcs[i].func;
+        ee->trace_records[i].ee = ee;
+        ee->trace_records[i].index = i;
+
+        thunk = ee->trace_thunks + i * TRACE_THUNK_SIZE;
+        record = (uint64_t) &ee->trace_records[i];
+        memcpy(thunk, trace_thunk_template, sizeof(trace_thunk_template));
+        memcpy(thunk + TRACE_THUNK_RECORD_OFFSET, &record, sizeof(uint64_t));
+        memcpy(thunk + TRACE_THUNK_TARGET_OFFSET, &target, sizeof(uint64_t));
+
+        ee->ctx.imported_funcs[i].func = thunk;
+    }
+    return 0;
+}
+#else
+int ee_trace_init(struct execution_engine *ee) {
+    return 0;
+}
+#endif
+
+void ee_trace_release(struct execution_engine *ee) {
+    vfree(ee->trace_thunks);
+    ee->trace_thunks = NULL;
+    kfree(ee->trace_records);
+    ee->trace_records = NULL;
+}
@@ -0,0 +1,138 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kwasm
+
+#if !defined(_KWASM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KWASM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Engines are identified by the number of their debugfs stats file.
+
+TRACE_EVENT(kwasm_load,
+    TP_PROTO(struct execution_engine *ee, int from_snapshot),
+    TP_ARGS(ee, from_snapshot),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(void *, code)
+        __field(uint32_t, code_len)
+        __field(size_t, memory_len)
+        __field(uint32_t, import_count)
+        __field(int, from_snapshot)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->code = ee->code;
+        __entry->code_len = ee->code_len;
+        __entry->memory_len = ee->ctx.memory_bound;
+        __entry->import_count = ee->imported_func_count;
+        __entry->from_snapshot = from_snapshot;
+    ),
+    TP_printk("ee=%u code=%px code_len=%u memory_len=%zu imports=%u from_snapshot=%d",
+        __entry->id, __entry->code, __entry->code_len, __entry->memory_len,
+        __entry->import_count, __entry->from_snapshot)
+);
+
+TRACE_EVENT(kwasm_run_start,
+    TP_PROTO(struct execution_engine *ee, uint32_t entry_offset, uint32_t param_count),
+    TP_ARGS(ee, entry_offset, param_count),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint32_t, entry_offset)
+        __field(uint32_t, param_count)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->entry_offset = entry_offset;
+        __entry->param_count = param_count;
+    ),
+    TP_printk("ee=%u entry=%#x params=%u", __entry->id, __entry->entry_offset, __entry->param_count)
+);
+
+TRACE_EVENT(kwasm_run_end,
+    TP_PROTO(struct execution_engine *ee, uint32_t entry_offset, uint64_t retval, uint64_t duration_ns),
+    TP_ARGS(ee, entry_offset, retval, duration_ns),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint32_t, entry_offset)
+        __field(uint64_t, retval)
+        __field(uint64_t, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->entry_offset = entry_offset;
+        __entry->retval = retval;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("ee=%u entry=%#x retval=%llu duration_ns=%llu",
+        __entry->id, __entry->entry_offset, __entry->retval, __entry->duration_ns)
+);
+
+TRACE_EVENT(kwasm_memory_grow,
+    TP_PROTO(struct execution_engine *ee, uint32_t delta_pages, int32_t result),
+    TP_ARGS(ee, delta_pages, result),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint32_t, delta_pages)
+        __field(int32_t, result)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->delta_pages = delta_pages;
+        __entry->result = result;
+    ),
+    TP_printk("ee=%u delta_pages=%u result=%d", __entry->id, __entry->delta_pages, __entry->result)
+);
+
+TRACE_EVENT(kwasm_host_call_entry,
+    TP_PROTO(struct execution_engine *ee, uint32_t index, void *func),
+    TP_ARGS(ee, index, func),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint32_t, index)
+        __field(void *, func)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->index = index;
+        __entry->func = func;
+    ),
+    TP_printk("ee=%u import=%u func=%ps", __entry->id, __entry->index, __entry->func)
+);
+
+TRACE_EVENT(kwasm_host_call_exit,
+    TP_PROTO(struct execution_engine *ee, uint32_t index, uint64_t ret),
+    TP_ARGS(ee, index, ret),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint32_t, index)
+        __field(uint64_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->index = index;
+        __entry->ret = ret;
+    ),
+    TP_printk("ee=%u import=%u ret=%#llx", __entry->id, __entry->index, __entry->ret)
+);
+
+TRACE_EVENT(kwasm_kill,
+    TP_PROTO(struct execution_engine *ee, uint64_t run_time_ns),
+    TP_ARGS(ee, run_time_ns),
+    TP_STRUCT__entry(
+        __field(uint32_t, id)
+        __field(uint64_t, run_time_ns)
+    ),
+    TP_fast_assign(
+        __entry->id = ee->id;
+        __entry->run_time_ns = run_time_ns;
+    ),
+    TP_printk("ee=%u run_time_ns=%llu", __entry->id, __entry->run_time_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
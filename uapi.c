@@ -12,17 +12,44 @@
 #include <linux/cred.h>
 #include <linux/security.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/anon_inodes.h>
 #include <asm/fpu/api.h>
-#include <asm/fpu/internal.h>
 
 #include "vm.h"
+#if EE_FPU_SWITCH
+#include <asm/fpu/internal.h>
+#endif
 #include "request.h"
-#include "coroutine.h"
 
 #define WASM_LOAD_CODE 0x1001
 #define WASM_RUN_CODE 0x1002
 #define WASM_READ_MEMORY 0x1003
 #define WASM_WRITE_MEMORY 0x1004
+#define WASM_SNAPSHOT 0x1005
+#define WASM_LOAD_SNAPSHOT 0x1006
+#define WASM_START_RUNNER 0x1007
+#define WASM_SETUP_RING 0x1008
+#define WASM_RING_ENTER 0x1009
+#define WASM_GET_STATS 0x100a
+#define WASM_CREATE_INSTANCE 0x100b
+#define WASM_SET_LOAD_OPTION 0x100c
+#define WASM_START_ASYNC_RUNNER 0x100d
+#define WASM_RUN_CODE_BUDGETED 0x100e
+#define WASM_SET_SYMBOLS 0x100f
+#define WASM_ATTACH_HOOK 0x1010
+#define WASM_DETACH_HOOK 0x1011
+#define WASM_LOAD_CODE_FD 0x1012
+
+#define RUNNER_REQ_CALL 1
+#define RUNNER_REQ_DRAIN_RING 2
+
+static int kill_grace_ms = 10;
+module_param(kill_grace_ms, int, 0644);
+MODULE_PARM_DESC(kill_grace_ms, "Time an interrupted guest has to trap before its code is made non-executable");
 
 const char *CLASS_NAME = "wasm";
 const char *DEVICE_NAME = "wasmctl";
@@ -39,13 +66,15 @@ static int wd_release(struct inode *, struct file *);
 static ssize_t wd_read(struct file *, char *, size_t, loff_t *);
 static ssize_t wd_write(struct file *, const char *, size_t, loff_t *);
 static ssize_t wd_ioctl(struct file *, unsigned int cmd, unsigned long arg);
+static int wd_mmap(struct file *, struct vm_area_struct *);
 
 static struct file_operations wasm_ops = {
     .open = wd_open,
     .read = wd_read,
     .write = wd_write,
     .release = wd_release,
-    .unlocked_ioctl = wd_ioctl
+    .unlocked_ioctl = wd_ioctl,
+    .mmap = wd_mmap
 };
 
 int uapi_init(void) {
@@ -107,16 +136,95 @@ static int wd_open(struct inode *_inode, struct file *f) {
 static int wd_release(struct inode *_inode, struct file *f) {
     struct privileged_session *sess = f->private_data;
 
+    if(sess->hook) {
+        hook_detach(sess->hook);
+    }
+
+    if(sess->runner) {
+        persistent_runner_destroy(sess->runner);
+    }
+
+    if(sess->ring) {
+        run_ring_destroy(sess->ring);
+    }
+
     if(sess->ready) {
         printk(KERN_INFO "Released execution engine %px\n", &sess->ee);
         destroy_execution_engine(&sess->ee);
     }
 
+    if(sess->instance_template) {
+        ee_snapshot_put(sess->instance_template);
+    }
+
+    if(sess->home_cpu >= 0) {
+        sched_session_cpu_put(sess->home_cpu);
+    }
+
     kfree(sess);
 
     return 0;
 }
 
+// Linear memory is backed by individually allocated pages, so a mapping of it
+// is populated one page at a time on fault. Faults beyond the current memory size
+// raise SIGBUS, and become valid once the guest grows its memory.
+static vm_fault_t memory_vma_fault(struct vm_fault *vmf) {
+    struct privileged_session *sess = vmf->vma->vm_private_data;
+    struct execution_engine *ee = &sess->ee;
+    unsigned long index = vmf->pgoff - (WASM_MMAP_MEMORY_OFFSET >> PAGE_SHIFT);
+    struct page *page;
+
+    if(index >= READ_ONCE(ee->ctx.memory_bound) / PAGE_SIZE) {
+        return VM_FAULT_SIGBUS;
+    }
+    smp_rmb();
+
+    page = READ_ONCE(ee->memory_pages[index]);
+    if(!page) {
+        return VM_FAULT_SIGBUS;
+    }
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct memory_vm_ops = {
+    .fault = memory_vma_fault,
+};
+
+static int wd_mmap(struct file *f, struct vm_area_struct *vma) {
+    struct privileged_session *sess = f->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    if(vma->vm_pgoff == (WASM_MMAP_RING_OFFSET >> PAGE_SHIFT)) {
+        if(!sess->ring) {
+            return -EINVAL;
+        }
+        return remap_vmalloc_range(vma, sess->ring->base, 0);
+    }
+
+    if(vma->vm_pgoff >= (WASM_MMAP_MEMORY_OFFSET >> PAGE_SHIFT)) {
+        if(!sess->ready || !sess->ee.ctx.memory_base) {
+            return -EINVAL;
+        }
+        if(!(vma->vm_flags & VM_SHARED)) {
+            return -EINVAL;
+        }
+        if(
+            vma->vm_pgoff - (WASM_MMAP_MEMORY_OFFSET >> PAGE_SHIFT) > STATIC_MEMORY_AVAILABLE / PAGE_SIZE ||
+            len > STATIC_MEMORY_AVAILABLE - ((vma->vm_pgoff - (WASM_MMAP_MEMORY_OFFSET >> PAGE_SHIFT)) << PAGE_SHIFT)
+        ) {
+            return -EINVAL;
+        }
+        vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+        vma->vm_ops = &memory_vm_ops;
+        vma->vm_private_data = sess;
+        return 0;
+    }
+    return -EINVAL;
+}
+
 static ssize_t wd_read(struct file *_file, char *_data, size_t _len, loff_t *_offset) {
     return 0;
 }
@@ -125,22 +233,11 @@ static ssize_t wd_write(struct file *_file, const char *data, size_t len, loff_t
     return -EINVAL;
 }
 
-static ssize_t handle_wasm_load_code(struct file *f, void *arg) {
+static int load_code(struct privileged_session *sess, const struct load_code_request *req, const struct ee_load_files *files) {
     int err;
-    struct load_code_request req;
-    struct privileged_session *sess = f->private_data;
 
-    if(sess->ready) {
-        err = -EINVAL;
-        goto fail;
-    }
-
-    if(copy_from_user(&req, arg, sizeof(struct load_code_request))) {
-        err = -EFAULT;
-        goto fail;
-    }
-    if((err = init_execution_engine(&req, &sess->ee)) < 0) {
-        goto fail;
+    if((err = init_execution_engine(req, &sess->options, files, &sess->ee)) < 0) {
+        return err;
     }
     printk(KERN_INFO
         "Initialized execution engine %px, "
@@ -157,31 +254,315 @@ static ssize_t handle_wasm_load_code(struct file *f, void *arg) {
 
     sess->ready = 1;
     return 0;
+}
+
+static ssize_t handle_wasm_load_code(struct file *f, void *arg) {
+    struct load_code_request req;
+    struct privileged_session *sess = f->private_data;
+
+    if(sess->ready) {
+        return -EINVAL;
+    }
 
-    fail:
+    if(copy_from_user(&req, arg, sizeof(struct load_code_request))) {
+        return -EFAULT;
+    }
+    return load_code(sess, &req, NULL);
+}
+
+static ssize_t handle_wasm_load_code_fd(struct file *f, void *arg) {
+    int err;
+    struct load_code_fd_request req;
+    struct ee_load_files files;
+    struct privileged_session *sess = f->private_data;
+
+    if(sess->ready) {
+        return -EINVAL;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct load_code_fd_request))) {
+        return -EFAULT;
+    }
+    if(req.code_offset > LLONG_MAX || req.memory_offset > LLONG_MAX) {
+        return -EINVAL;
+    }
+
+    memset(&files, 0, sizeof(struct ee_load_files));
+    if(req.code_fd >= 0) {
+        files.code = fget(req.code_fd);
+        if(!files.code) {
+            err = -EBADF;
+            goto out;
+        }
+        files.code_offset = req.code_offset;
+    }
+    if(req.memory_fd >= 0) {
+        files.memory = fget(req.memory_fd);
+        if(!files.memory) {
+            err = -EBADF;
+            goto out;
+        }
+        files.memory_offset = req.memory_offset;
+    }
+
+    err = load_code(sess, &req.load, &files);
+
+    out:
+    if(files.code) fput(files.code);
+    if(files.memory) fput(files.memory);
     return err;
 }
 
+static ssize_t handle_wasm_set_load_option(struct file *f, void *arg) {
+    struct load_option_request req;
+    struct privileged_session *sess = f->private_data;
+
+    if(sess->ready) {
+        return -EINVAL;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct load_option_request))) {
+        return -EFAULT;
+    }
+
+    switch(req.key) {
+        case WASM_LOAD_OPTION_FPU_FREE:
+            sess->options.fpu_free = !!req.value;
+            return 0;
+        case WASM_LOAD_OPTION_BOUNDS_CHECKED:
+            sess->options.bounds_checked = !!req.value;
+            return 0;
+        case WASM_LOAD_OPTION_STACK_SIZE:
+            if(req.value > STACK_SIZE) {
+                return -EINVAL;
+            }
+            // 0 restores the default.
+            sess->options.stack_size = req.value ? roundup_pow_of_two(max_t(uint64_t, req.value, MIN_STACK_SIZE)) : 0;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static ssize_t handle_wasm_set_symbols(struct file *f, void *arg) {
+    struct set_symbols_request req;
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->ready) {
+        return -EINVAL;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct set_symbols_request))) {
+        return -EFAULT;
+    }
+
+    return code_image_set_symbols(sess->ee.code_image, req.symbols, req.count);
+}
+
+static ssize_t handle_wasm_attach_hook(struct file *f, void *arg) {
+    struct attach_hook_request req;
+    struct wasm_hook *hook;
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->ready || sess->hook) {
+        return -EINVAL;
+    }
+    if(!capable(CAP_NET_ADMIN)) {
+        return -EPERM;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct attach_hook_request))) {
+        return -EFAULT;
+    }
+
+    hook = hook_attach(&sess->ee, &req);
+    if(IS_ERR(hook)) {
+        return PTR_ERR(hook);
+    }
+    sess->hook = hook;
+    return 0;
+}
+
+static ssize_t handle_wasm_detach_hook(struct file *f, void *arg) {
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->hook) {
+        return -EINVAL;
+    }
+    hook_detach(sess->hook);
+    sess->hook = NULL;
+    return 0;
+}
+
+static ssize_t handle_wasm_snapshot(struct file *f, void *arg) {
+    int fd;
+    struct ee_snapshot *snap;
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->ready) {
+        return -EINVAL;
+    }
+
+    snap = ee_snapshot_create(&sess->ee);
+    if(IS_ERR(snap)) {
+        return PTR_ERR(snap);
+    }
+
+    fd = ee_snapshot_install_fd(snap);
+    if(fd < 0) {
+        ee_snapshot_put(snap);
+    }
+    return fd;
+}
+
+static ssize_t handle_wasm_load_snapshot(struct file *f, void *arg) {
+    int err;
+    struct load_snapshot_request req;
+    struct ee_snapshot *snap;
+    struct privileged_session *sess = f->private_data;
+
+    if(sess->ready) {
+        return -EINVAL;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct load_snapshot_request))) {
+        return -EFAULT;
+    }
+
+    snap = ee_snapshot_get_from_fd(req.snapshot_fd);
+    if(IS_ERR(snap)) {
+        return PTR_ERR(snap);
+    }
+
+    err = init_execution_engine_from_snapshot(snap, &sess->ee);
+    ee_snapshot_put(snap);
+    if(err < 0) {
+        return err;
+    }
+    printk(KERN_INFO "Initialized execution engine %px from snapshot\n", &sess->ee);
+
+    sess->ready = 1;
+    return 0;
+}
+
+// Creates an instance of the session's module and returns a new wasmctl fd for it, supporting the same
+// requests as the session. Instances share the code image and dynamic sigindices of the session and get
+// their own linear memory, globals, table and stack, initialized from the state of the session when it
+// first created an instance.
+static ssize_t handle_wasm_create_instance(struct file *f, void *arg) {
+    int err, fd;
+    struct ee_snapshot *snap;
+    struct privileged_session *sess = f->private_data;
+    struct privileged_session *inst;
+
+    if(!sess->ready) {
+        return -EINVAL;
+    }
+
+    if(!sess->instance_template) {
+        snap = ee_snapshot_create(&sess->ee);
+        if(IS_ERR(snap)) {
+            return PTR_ERR(snap);
+        }
+        sess->instance_template = snap;
+    }
+
+    inst = kmalloc(sizeof(struct privileged_session), GFP_KERNEL);
+    if(!inst) {
+        return -ENOMEM;
+    }
+    init_privileged_session(inst);
+
+    if((err = init_execution_engine_from_snapshot(sess->instance_template, &inst->ee)) < 0) {
+        kfree(inst);
+        return err;
+    }
+    inst->ready = 1;
+
+    fd = anon_inode_getfd("wasm-instance", &wasm_ops, inst, O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        destroy_execution_engine(&inst->ee);
+        kfree(inst);
+    }
+    return fd;
+}
+
+struct executor_files {
+    struct file *stdin, *stdout, *stderr;
+};
+
 struct code_runner_task {
     struct semaphore exec_start, finalizer_start, finalizer_end;
     struct execution_engine *ee;
     struct run_code_request *req;
+    uint64_t params[MAX_PARAM_COUNT];
     uint64_t ret;
+    int completed; // the call returned
     int finalize_ret;
     struct task_struct *runner_ts;
     int finalizer_should_not_run;
 
-    struct file *stdin, *stdout, *stderr;
+    struct executor_files files;
 };
 
+// A runner thread that lives as long as its session and stays parked on the engine's coroutine stack
+// between calls, so that the file table setup is only done once.
+// Async runners have no thread of their own, and are run as a task by the executor of their CPU instead.
+struct persistent_runner {
+    struct semaphore ready, done, finalizer_start, finalizer_end;
+    wait_queue_head_t request_wq;
+    struct execution_engine *ee;
+    struct task_struct *runner_ts;
+    int async;
+    struct sched_task *task; // if async
+    int stopping;
+    int setup_failed;
+    int finalizer_should_not_run;
+    int finalize_ret;
+
+    int pending;
+    int completed; // the last request was completed
+    uint32_t entry_offset;
+    uint64_t params[MAX_PARAM_COUNT];
+    uint32_t param_count;
+    uint64_t ret;
+    struct run_ring *ring;
+    uint32_t ring_completed;
+
+    struct executor_files files;
+};
+
+// Runners of engines using the FPU stay in a kernel FPU section while in guest context, which is closed
+// while they are scheduled out so that the CPU can be used by others. The guest FPU state only needs
+// to be kept while a call is running.
 static void code_runner_sched_in(struct preempt_notifier *notifier, int cpu) {
     struct execution_engine *ee = container_of(notifier, struct execution_engine, preempt_notifier);
-    ee->preempt_in_count++;
+
+#if EE_FPU_SWITCH
+    if(!ee->fpu_free) {
+        __kernel_fpu_begin();
+        if(ee->guest_fpu_saved) {
+            copy_kernel_to_fpregs(&ee->guest_fpu->state);
+            ee->guest_fpu_saved = 0;
+        }
+    }
+#endif
+    ee_stats_sched_in(ee);
 }
 
 static void code_runner_sched_out(struct preempt_notifier *notifier, struct task_struct *next) {
     struct execution_engine *ee = container_of(notifier, struct execution_engine, preempt_notifier);
-    ee->preempt_out_count++;
+
+#if EE_FPU_SWITCH
+    if(!ee->fpu_free) {
+        if(READ_ONCE(ee->run_start_ns)) {
+            copy_fpregs_to_fpstate(ee->guest_fpu);
+            ee->guest_fpu_saved = 1;
+        }
+        __kernel_fpu_end();
+    }
+#endif
+    ee_stats_sched_out(ee);
 }
 
 static struct preempt_ops code_runner_preempt_ops = {
@@ -189,78 +570,145 @@ static struct preempt_ops code_runner_preempt_ops = {
     .sched_out = code_runner_sched_out,
 };
 
-void code_runner_inner(struct Coroutine *co) {
-    int fd;
+static int executor_files_get(struct executor_files *files) {
+    files->stdin = fget_raw(0);
+    if(!files->stdin) {
+        return -EBADF;
+    }
 
-    struct code_runner_task *task = co->private_data;
-    up(&task->exec_start);
+    files->stdout = fget_raw(1);
+    if(!files->stdout) {
+        fput(files->stdin);
+        return -EBADF;
+    }
+
+    files->stderr = fget_raw(2);
+    if(!files->stderr) {
+        fput(files->stdout);
+        fput(files->stdin);
+        return -EBADF;
+    }
+    return 0;
+}
+
+static void executor_files_put(struct executor_files *files) {
+    fput(files->stderr);
+    fput(files->stdout);
+    fput(files->stdin);
+}
+
+// Gives the current thread a private file table with the standard streams of the controlling process.
+// Always consumes the references held by `files`.
+static int executor_files_install(struct executor_files *files) {
+    int fd;
 
     if(vm_unshare_executor_files() < 0) {
         printk(KERN_INFO "Unable to unshare files\n");
-        fput(task->stderr);
-        fput(task->stdout);
-        fput(task->stdin);
-        return;
+        executor_files_put(files);
+        return -ENOMEM;
     }
 
     fd = get_unused_fd_flags(O_RDWR);
     if(fd < 0) {
         printk(KERN_INFO "Unable to get fd for stdin\n");
-        fput(task->stderr);
-        fput(task->stdout);
-        fput(task->stdin);
-        return;
+        executor_files_put(files);
+        return fd;
     }
-    fd_install(fd, task->stdin);
+    fd_install(fd, files->stdin);
     printk(KERN_INFO "stdin = %d\n", fd);
 
     fd = get_unused_fd_flags(O_RDWR);
     if(fd < 0) {
         printk(KERN_INFO "Unable to get fd for stdout\n");
-        fput(task->stderr);
-        fput(task->stdout);
-        return;
+        fput(files->stderr);
+        fput(files->stdout);
+        return fd;
     }
-    fd_install(fd, task->stdout);
+    fd_install(fd, files->stdout);
     printk(KERN_INFO "stdout = %d\n", fd);
 
     fd = get_unused_fd_flags(O_RDWR);
     if(fd < 0) {
         printk(KERN_INFO "Unable to get fd for stderr\n");
-        fput(task->stderr);
-        return;
+        fput(files->stderr);
+        return fd;
     }
-    fd_install(fd, task->stderr);
+    fd_install(fd, files->stderr);
     printk(KERN_INFO "stderr = %d\n", fd);
 
-    kernel_fpu_begin();
+    return 0;
+}
+
+// Without EE_FPU_SWITCH, the FPU section is taken with `kernel_fpu_begin()`, which disables preemption,
+// and preemption is enabled again below anyway so that long calls do not hold the CPU.
+void executor_enter_guest_context(struct execution_engine *ee) {
+#if EE_FPU_SWITCH
+    preempt_disable();
+    if(!ee->fpu_free) {
+        __kernel_fpu_begin();
+    }
+#else
+    if(ee->fpu_free) preempt_disable();
+    else kernel_fpu_begin();
+#endif
 
-    preempt_notifier_init(&task->ee->preempt_notifier, &code_runner_preempt_ops);
-    preempt_notifier_register(&task->ee->preempt_notifier);
+    preempt_notifier_init(&ee->preempt_notifier, &code_runner_preempt_ops);
+    preempt_notifier_register(&ee->preempt_notifier);
 
+    // Async tasks leave the guest context while parked in a host call, which is accounted as time off CPU.
+    ee_stats_sched_in(ee);
     preempt_enable();
+}
 
-    if(task->req->param_count != 0) {
-        printk(KERN_INFO "invalid param count\n");
-    } else {
-        allow_signal(SIGKILL);
-        task->ret = ee_call0(task->ee, task->req->entry_offset);
+void executor_leave_guest_context(struct execution_engine *ee) {
+    preempt_disable();
+    ee_stats_sched_out(ee);
+    preempt_notifier_unregister(&ee->preempt_notifier);
+#if EE_FPU_SWITCH
+    if(!ee->fpu_free) {
+        __kernel_fpu_end();
     }
+    preempt_enable();
+#else
+    if(ee->fpu_free) preempt_enable();
+    else kernel_fpu_end();
+#endif
 }
 
-static int code_runner(void *data) {
-    struct code_runner_task *task = data;
+static void run_on_engine_stack(struct execution_engine *ee, CoEntry entry, void *data) {
     struct Coroutine co = {
-        .stack = task->ee->stack_end,
-        .entry = code_runner_inner,
+        .stack = ee->stack_end,
+        .entry = entry,
         .terminated = 0,
-        .private_data = task,
+        .private_data = data,
     };
-    //printk(KERN_INFO "stack: %px-%px\n", task->ee->stack_begin, task->ee->stack_end);
+    //printk(KERN_INFO "stack: %px-%px\n", ee->stack_begin, ee->stack_end);
     start_coroutine(&co);
     while(!co.terminated) {
         co_switch(&co.stack);
     }
+}
+
+void code_runner_inner(struct Coroutine *co) {
+    struct code_runner_task *task = co->private_data;
+    up(&task->exec_start);
+
+    if(executor_files_install(&task->files) < 0) {
+        return;
+    }
+
+    executor_enter_guest_context(task->ee);
+
+    allow_signal(SIGKILL);
+    task->ret = ee_call(task->ee, task->req->entry_offset, task->params, task->req->param_count);
+    smp_store_release(&task->completed, 1);
+
+    executor_leave_guest_context(task->ee);
+}
+
+static int code_runner(void *data) {
+    struct code_runner_task *task = data;
+    run_on_engine_stack(task->ee, code_runner_inner, task);
     return 0;
 }
 
@@ -276,6 +724,382 @@ static int task_finalizer(void *data) {
     return 0;
 }
 
+static int persistent_runner_woken(void *data) {
+    struct persistent_runner *runner = data;
+    return smp_load_acquire(&runner->pending) || READ_ONCE(runner->stopping) ||
+        (!runner->async && kthread_should_stop());
+}
+
+void persistent_runner_inner(struct Coroutine *co) {
+    int kind;
+    struct persistent_runner *runner = co->private_data;
+
+    if(executor_files_install(&runner->files) < 0) {
+        runner->setup_failed = 1;
+        up(&runner->ready);
+        return;
+    }
+
+    // Only the file table is set up once. The guest context is entered for each request, so that a parked
+    // runner does not hold a kernel FPU section; the executor enters it for async runners each time it
+    // resumes them.
+    if(!runner->async) {
+        allow_signal(SIGKILL);
+    }
+    up(&runner->ready);
+
+    while(1) {
+        if(kwasm_wait_event(
+            &runner->ee->ctx,
+            &runner->request_wq,
+            persistent_runner_woken,
+            runner,
+            MAX_SCHEDULE_TIMEOUT
+        ) < 0) {
+            break;
+        }
+        if(READ_ONCE(runner->stopping) || (!runner->async && kthread_should_stop())) {
+            break;
+        }
+        kind = smp_load_acquire(&runner->pending);
+        if(!kind) {
+            continue;
+        }
+        runner->pending = 0;
+        if(!runner->async) executor_enter_guest_context(runner->ee);
+        if(kind == RUNNER_REQ_DRAIN_RING) {
+            runner->ring_completed = run_ring_drain(runner->ring, runner->ee);
+        } else {
+            runner->ret = ee_call(runner->ee, runner->entry_offset, runner->params, runner->param_count);
+        }
+        if(!runner->async) executor_leave_guest_context(runner->ee);
+        smp_store_release(&runner->completed, 1);
+        up(&runner->done);
+    }
+}
+
+static int persistent_runner_main(void *data) {
+    struct persistent_runner *runner = data;
+    run_on_engine_stack(runner->ee, persistent_runner_inner, runner);
+    return 0;
+}
+
+static int persistent_runner_finalizer(void *data) {
+    struct persistent_runner *runner = data;
+    down(&runner->finalizer_start);
+    if(!runner->finalizer_should_not_run) {
+        runner->finalize_ret = kthread_stop(runner->runner_ts);
+    }
+    up(&runner->finalizer_end);
+    return 0;
+}
+
+static long kill_grace_jiffies(void) {
+    return msecs_to_jiffies(max(READ_ONCE(kill_grace_ms), 0));
+}
+
+static void persistent_runner_free(struct persistent_runner *runner) {
+    if(runner->task) {
+        sched_task_destroy(runner->task);
+    } else {
+        put_task_struct(runner->runner_ts);
+    }
+    preempt_notifier_dec();
+    kfree(runner);
+}
+
+// Stops the runner thread (which is expected to be terminating or parked) and frees the runner.
+static void persistent_runner_destroy(struct persistent_runner *runner) {
+    if(runner->task) {
+        WRITE_ONCE(runner->stopping, 1);
+        wake_up(&runner->request_wq);
+        sched_task_wait(runner->task);
+    } else {
+        up(&runner->finalizer_start);
+        while(down_interruptible(&runner->finalizer_end) < 0) {
+            kill_pid(task_pid(runner->runner_ts), SIGKILL, 0);
+        }
+    }
+    persistent_runner_free(runner);
+}
+
+// Kills a runner in the middle of a call and frees it. The engine is interrupted first, and its code
+// only made non-executable if the guest does not trap within the grace period.
+static void persistent_runner_kill(struct persistent_runner *runner) {
+    ee_interrupt(runner->ee);
+    if(runner->task) {
+        sched_task_kill(runner->task, kill_grace_jiffies());
+    } else {
+        kill_pid(task_pid(runner->runner_ts), SIGKILL, 0); // interrupts sleeping host calls
+        up(&runner->finalizer_start);
+        if(down_timeout(&runner->finalizer_end, kill_grace_jiffies()) < 0) {
+            ee_make_code_nx(runner->ee); // trigger a page fault
+            kill_pid(task_pid(runner->runner_ts), SIGKILL, 0);
+            down(&runner->finalizer_end);
+            ee_make_code_x(runner->ee);
+        }
+    }
+    ee_interrupt_clear(runner->ee);
+    persistent_runner_free(runner);
+}
+
+// Code runners of a session are bound to its home CPU, so that the preempt notifier and the FPU state
+// of the guest are not moved around between runs.
+static int session_home_cpu(struct privileged_session *sess) {
+    if(sess->home_cpu < 0) {
+        sess->home_cpu = sched_session_cpu_get();
+    }
+    return sess->home_cpu;
+}
+
+static ssize_t handle_wasm_start_runner(struct file *f, void *arg) {
+    int err;
+    struct persistent_runner *runner;
+    struct privileged_session *sess = f->private_data;
+    struct task_struct *runner_ts, *finalizer_ts;
+
+    if(!sess->ready || sess->runner) {
+        return -EINVAL;
+    }
+
+    runner = kzalloc(sizeof(struct persistent_runner), GFP_KERNEL);
+    if(!runner) {
+        return -ENOMEM;
+    }
+    runner->ee = &sess->ee;
+
+    if((err = executor_files_get(&runner->files)) < 0) {
+        kfree(runner);
+        return err;
+    }
+
+    init_waitqueue_head(&runner->request_wq);
+    sema_init(&runner->ready, 0);
+    sema_init(&runner->done, 0);
+    sema_init(&runner->finalizer_start, 0);
+    sema_init(&runner->finalizer_end, 0);
+
+    finalizer_ts = kthread_run(persistent_runner_finalizer, runner, "runner_finalizer");
+    if(!finalizer_ts || IS_ERR(finalizer_ts)) {
+        executor_files_put(&runner->files);
+        kfree(runner);
+        printk(KERN_INFO "Unable to start runner finalizer\n");
+        return -EINVAL;
+    }
+
+    runner_ts = kthread_create(persistent_runner_main, runner, "code_runner");
+    if(!runner_ts || IS_ERR(runner_ts)) {
+        runner->finalizer_should_not_run = 1;
+        up(&runner->finalizer_start);
+        down(&runner->finalizer_end);
+        executor_files_put(&runner->files);
+        kfree(runner);
+        printk(KERN_INFO "Unable to start code runner\n");
+        return -EINVAL;
+    }
+    get_task_struct(runner_ts);
+    runner->runner_ts = runner_ts;
+    kthread_bind(runner_ts, session_home_cpu(sess));
+
+    preempt_notifier_inc();
+    wake_up_process(runner_ts);
+
+    down(&runner->ready);
+    if(runner->setup_failed) {
+        persistent_runner_destroy(runner);
+        return -EINVAL;
+    }
+
+    sess->runner = runner;
+    return 0;
+}
+
+// Starts a runner that shares the executor thread of the session's home CPU with other async runners,
+// instead of having a thread of its own. Guests waiting in async host calls then only hold their stack.
+static ssize_t handle_wasm_start_async_runner(struct file *f, void *arg) {
+    int err;
+    struct persistent_runner *runner;
+    struct sched_task *t;
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->ready || sess->runner) {
+        return -EINVAL;
+    }
+
+    runner = kzalloc(sizeof(struct persistent_runner), GFP_KERNEL);
+    if(!runner) {
+        return -ENOMEM;
+    }
+    runner->ee = &sess->ee;
+
+    if((err = executor_files_get(&runner->files)) < 0) {
+        kfree(runner);
+        return err;
+    }
+
+    init_waitqueue_head(&runner->request_wq);
+    sema_init(&runner->ready, 0);
+    sema_init(&runner->done, 0);
+
+    preempt_notifier_inc();
+
+    runner->async = 1;
+    t = sched_task_create(&sess->ee, session_home_cpu(sess), persistent_runner_inner, runner);
+    if(IS_ERR(t)) {
+        preempt_notifier_dec();
+        executor_files_put(&runner->files);
+        kfree(runner);
+        return PTR_ERR(t);
+    }
+    runner->task = t;
+
+    down(&runner->ready);
+    if(runner->setup_failed) {
+        persistent_runner_destroy(runner);
+        return -EINVAL;
+    }
+
+    sess->runner = runner;
+    return 0;
+}
+
+// Waits on `sem` for a call of `ee` to complete. `sem` is raised once the call completes, after
+// `*completed` is set, and once more by the budget timer of `ee` if it fires. Completion is decided
+// by `*completed` alone, so that a budget running out just as the call returns does not kill it.
+// The budget is stopped in any case. Returns 0 once the call completed and all raises of `sem` have
+// been taken, or -EINTR if the call has to be killed, because of a signal or an exhausted budget;
+// then `*pending` is the number of raises still to be taken.
+static int run_wait(struct semaphore *sem, struct execution_engine *ee, const int *completed, int *pending) {
+    int taken = down_interruptible(sem) == 0;
+    int done = smp_load_acquire(completed);
+
+    *pending = 1 + ee_budget_stop(ee) - taken;
+    if(!done) return -EINTR;
+
+    while(*pending > 0) {
+        down(sem);
+        (*pending)--;
+    }
+    return 0;
+}
+
+static int async_cpu_budget_ms = 1000;
+module_param(async_cpu_budget_ms, int, 0644);
+MODULE_PARM_DESC(async_cpu_budget_ms, "CPU time budget of calls on async runners that have none of their own, so that they do not hold their executor indefinitely (0 to disable)");
+
+// Hands the request prepared in the runner over and waits for its completion.
+// Returns -EINTR if the wait was interrupted and the runner had to be killed.
+static int persistent_runner_submit(
+    struct privileged_session *sess,
+    int kind,
+    const struct budgeted_run_request *budget
+) {
+    int cpu, err, pending;
+    struct persistent_runner *runner = sess->runner;
+    struct budgeted_run_request async_budget;
+
+    if(runner->task && (!budget || !budget->budget_kind) && READ_ONCE(async_cpu_budget_ms) > 0) {
+        memset(&async_budget, 0, sizeof(struct budgeted_run_request));
+        async_budget.budget_kind = WASM_BUDGET_CPU_TIME;
+        async_budget.budget_ns = (uint64_t) READ_ONCE(async_cpu_budget_ms) * NSEC_PER_MSEC;
+        budget = &async_budget;
+    }
+
+    // The runner is parked here, so it can be moved if another CPU is idle.
+    // Async runners are not moved here: idle executors take them over at their waits (see `sched_steal`).
+    cpu = sched_run_begin(sess->home_cpu, !runner->task);
+    if(cpu != sess->home_cpu) {
+        set_cpus_allowed_ptr(runner->runner_ts, cpumask_of(cpu));
+        sess->home_cpu = cpu;
+    }
+
+    if(budget && budget->budget_kind) {
+        ee_budget_start(runner->ee, budget->budget_kind, budget->budget_ns, &runner->done);
+    }
+    runner->completed = 0;
+    smp_store_release(&runner->pending, kind);
+    wake_up(&runner->request_wq);
+
+    err = run_wait(&runner->done, runner->ee, &runner->completed, &pending);
+    sched_run_end(cpu);
+    if(err == 0) {
+        return 0;
+    }
+
+    // Interrupted by signal or out of budget. The runner is killed in the same way as a one-shot one,
+    // and later calls fall back to one-shot runs until a new runner is started.
+    persistent_runner_kill(runner);
+    ee_stats_record_kill(&sess->ee);
+    sess->runner = NULL;
+    return -EINTR;
+}
+
+static int persistent_runner_call(
+    struct privileged_session *sess,
+    const struct budgeted_run_request *req,
+    const uint64_t *params,
+    struct run_code_result *result
+) {
+    struct persistent_runner *runner = sess->runner;
+
+    runner->entry_offset = req->run.entry_offset;
+    memcpy(runner->params, params, sizeof(uint64_t) * req->run.param_count);
+    runner->param_count = req->run.param_count;
+
+    if(persistent_runner_submit(sess, RUNNER_REQ_CALL, req) == 0) {
+        result->success = 1;
+        result->retval = runner->ret;
+    } else {
+        result->success = 0;
+        result->retval = 0;
+    }
+    return 0;
+}
+
+static ssize_t handle_wasm_setup_ring(struct file *f, void *arg) {
+    struct setup_ring_request req;
+    struct run_ring *ring;
+    struct privileged_session *sess = f->private_data;
+
+    if(sess->ring) {
+        return -EBUSY;
+    }
+
+    if(copy_from_user(&req, arg, sizeof(struct setup_ring_request))) {
+        return -EFAULT;
+    }
+
+    ring = run_ring_create(req.entries);
+    if(IS_ERR(ring)) {
+        return PTR_ERR(ring);
+    }
+
+    req.mmap_size = ring->size;
+    if(copy_to_user(arg, &req, sizeof(struct setup_ring_request))) {
+        run_ring_destroy(ring);
+        return -EFAULT;
+    }
+
+    sess->ring = ring;
+    return 0;
+}
+
+// Runs pending ring entries on the persistent runner and returns the number of completions posted.
+static ssize_t handle_wasm_ring_enter(struct file *f, void *arg) {
+    int err;
+    struct privileged_session *sess = f->private_data;
+
+    if(!sess->ready || !sess->runner || !sess->ring) {
+        return -EINVAL;
+    }
+
+    sess->runner->ring = sess->ring;
+    if((err = persistent_runner_submit(sess, RUNNER_REQ_DRAIN_RING, NULL)) < 0) {
+        return err;
+    }
+    return sess->runner->ring_completed;
+}
+
 static ssize_t handle_wasm_read_memory(struct file *f, void *arg) {
     struct privileged_session *sess = f->private_data;
     struct read_memory_request req;
@@ -320,44 +1144,51 @@ static ssize_t handle_wasm_write_memory(struct file *f, void *arg) {
     return 0;
 }
 
-static ssize_t handle_wasm_run_code(struct file *f, void *arg) {
-    int ret;
-    int made_nx = 0;
-    struct run_code_request req;
+static ssize_t run_code(struct privileged_session *sess, struct budgeted_run_request *breq) {
+    int ret, cpu;
+    int interrupted = 0, made_nx = 0, pending;
+    struct run_code_request *req = &breq->run;
     struct code_runner_task task;
-    struct privileged_session *sess = f->private_data;
     struct task_struct *runner_ts, *finalizer_ts;
     struct run_code_result result;
+    struct run_usage_result usage;
+    uint64_t params[MAX_PARAM_COUNT];
 
-    if(copy_from_user(&req, arg, sizeof(struct run_code_request))) {
-        return -EFAULT;
+    if(!sess->ready) {
+        return -EINVAL;
     }
 
-    if(!sess->ready) {
+    if(req->param_count > MAX_PARAM_COUNT) {
+        printk(KERN_INFO "invalid param count\n");
         return -EINVAL;
     }
+    if(req->param_count && copy_from_user(params, req->params, sizeof(uint64_t) * req->param_count)) {
+        return -EFAULT;
+    }
+    if(breq->budget_kind) {
+        if(breq->budget_kind != WASM_BUDGET_WALL_TIME && breq->budget_kind != WASM_BUDGET_CPU_TIME) {
+            return -EINVAL;
+        }
+        if(!breq->budget_ns) {
+            return -EINVAL;
+        }
+    }
+
+    if(sess->runner) {
+        if((ret = persistent_runner_call(sess, breq, params, &result)) < 0) {
+            return ret;
+        }
+        goto out;
+    }
 
     memset(&task, 0, sizeof(struct code_runner_task));
 
     task.ee = &sess->ee;
-    task.req = &req;
-
-    task.stdin = fget_raw(0);
-    if(IS_ERR(task.stdin)) {
-        return PTR_ERR(task.stdin);
-    }
+    task.req = req;
+    memcpy(task.params, params, sizeof(uint64_t) * req->param_count);
 
-    task.stdout = fget_raw(1);
-    if(IS_ERR(task.stdout)) {
-        fput(task.stdin);
-        return PTR_ERR(task.stdout);
-    }
-
-    task.stderr = fget_raw(2);
-    if(IS_ERR(task.stderr)) {
-        fput(task.stdout);
-        fput(task.stdin);
-        return PTR_ERR(task.stderr);
+    if((ret = executor_files_get(&task.files)) < 0) {
+        return ret;
     }
     sema_init(&task.exec_start, 0);
     sema_init(&task.finalizer_start, 0);
@@ -365,9 +1196,7 @@ static ssize_t handle_wasm_run_code(struct file *f, void *arg) {
 
     finalizer_ts = kthread_run(task_finalizer, &task, "task_finalizer");
     if(!finalizer_ts || IS_ERR(finalizer_ts)) {
-        fput(task.stderr);
-        fput(task.stdout);
-        fput(task.stdin);
+        executor_files_put(&task.files);
         printk(KERN_INFO "Unable to start task finalizer\n");
         return -EINVAL;
     }
@@ -376,27 +1205,45 @@ static ssize_t handle_wasm_run_code(struct file *f, void *arg) {
     if(!runner_ts || IS_ERR(runner_ts)) {
         task.finalizer_should_not_run = 1;
         up(&task.finalizer_start);
-        fput(task.stderr);
-        fput(task.stdout);
-        fput(task.stdin);
+        executor_files_put(&task.files);
         printk(KERN_INFO "Unable to start code runner\n");
         return -EINVAL;
     }
     get_task_struct(runner_ts);
     task.runner_ts = runner_ts;
 
+    cpu = sched_run_begin(session_home_cpu(sess), 1);
+    sess->home_cpu = cpu;
+    kthread_bind(runner_ts, cpu);
+
     preempt_notifier_inc();
+    if(breq->budget_kind) {
+        ee_budget_start(&sess->ee, breq->budget_kind, breq->budget_ns, &task.finalizer_end);
+    }
     wake_up_process(runner_ts);
 
     down(&task.exec_start); // wait for execution start
     up(&task.finalizer_start);
 
-    while(down_interruptible(&task.finalizer_end) < 0) {
-        // interrupted by signal
-        ee_make_code_nx(&sess->ee); // trigger a page fault
-        made_nx = 1;
+    if(run_wait(&task.finalizer_end, &sess->ee, &task.completed, &pending) < 0) {
+        // Interrupted by signal or out of budget. The guest traps at its next call; if it does not in time,
+        // its code is made non-executable as well. `task` is only left once the finalizer is done with it.
+        ee_interrupt(&sess->ee);
+        interrupted = 1;
         kill_pid(task_pid(runner_ts), SIGKILL, 0);
+        while(pending > 0) {
+            if(down_timeout(&task.finalizer_end, kill_grace_jiffies()) == 0) {
+                pending--;
+                continue;
+            }
+            if(!made_nx) {
+                ee_make_code_nx(&sess->ee); // trigger a page fault
+                made_nx = 1;
+            }
+            kill_pid(task_pid(runner_ts), SIGKILL, 0);
+        }
     }
+    sched_run_end(cpu);
     ret = task.finalize_ret;
     if(ret != 0) {
         printk(KERN_INFO "bad result from runner thread: %d\n", ret);
@@ -412,28 +1259,106 @@ static ssize_t handle_wasm_run_code(struct file *f, void *arg) {
     if(made_nx) {
         ee_make_code_x(&sess->ee);
     }
+    if(interrupted) {
+        ee_interrupt_clear(&sess->ee);
+        ee_stats_record_kill(&sess->ee);
+    }
 
     preempt_notifier_dec();
-    printk(KERN_INFO "preempt_in = %llu, preempt_out = %llu\n", sess->ee.preempt_in_count, sess->ee.preempt_out_count);
 
+    out:
     if(copy_to_user(
-        req.result,
+        req->result,
         &result,
         sizeof(struct run_code_result))
     ) {
         return -EFAULT;
     }
+    if(breq->usage) {
+        ee_stats_run_usage(&sess->ee, &usage.wall_time_ns, &usage.cpu_time_ns);
+        usage.budget_exceeded = breq->budget_kind && !result.success && sess->ee.budget_exceeded;
+        if(copy_to_user(breq->usage, &usage, sizeof(struct run_usage_result))) {
+            return -EFAULT;
+        }
+    }
     return 0;
 }
 
+static ssize_t handle_wasm_run_code(struct file *f, void *arg) {
+    struct budgeted_run_request req;
+
+    memset(&req, 0, sizeof(struct budgeted_run_request));
+    if(copy_from_user(&req.run, arg, sizeof(struct run_code_request))) {
+        return -EFAULT;
+    }
+    return run_code(f->private_data, &req);
+}
+
+static ssize_t handle_wasm_run_code_budgeted(struct file *f, void *arg) {
+    struct budgeted_run_request req;
+
+    if(copy_from_user(&req, arg, sizeof(struct budgeted_run_request))) {
+        return -EFAULT;
+    }
+    return run_code(f->private_data, &req);
+}
+
+static ssize_t handle_wasm_get_stats(struct file *f, void *arg) {
+    struct privileged_session *sess = f->private_data;
+    struct stats_request req;
+    uint64_t *host_call_counts = NULL;
+    uint64_t __user *user_counts;
+    uint32_t len;
+    int err = 0;
+
+    if(copy_from_user(&req, arg, sizeof(struct stats_request))) {
+        return -EFAULT;
+    }
+    if(!sess->ready) {
+        return -EINVAL;
+    }
+
+    user_counts = req.host_call_counts;
+    len = min(req.host_call_count_len, sess->ee.imported_func_count);
+    if(user_counts && len) {
+        host_call_counts = kmalloc_array(sess->ee.imported_func_count, sizeof(uint64_t), GFP_KERNEL);
+        if(!host_call_counts) return -ENOMEM;
+    }
+
+    ee_stats_read(&sess->ee, &req, host_call_counts);
+    req.host_call_counts = user_counts;
+
+    if(host_call_counts && copy_to_user(user_counts, host_call_counts, sizeof(uint64_t) * len)) {
+        err = -EFAULT;
+    } else if(copy_to_user(arg, &req, sizeof(struct stats_request))) {
+        err = -EFAULT;
+    }
+    kfree(host_call_counts);
+    return err;
+}
+
 #define DISPATCH_CMD(cmd, f) case cmd: return (f)(file, (void *) arg);
 
 static ssize_t wd_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
     switch(cmd) {
         DISPATCH_CMD(WASM_LOAD_CODE, handle_wasm_load_code)
+        DISPATCH_CMD(WASM_LOAD_CODE_FD, handle_wasm_load_code_fd)
         DISPATCH_CMD(WASM_RUN_CODE, handle_wasm_run_code)
+        DISPATCH_CMD(WASM_RUN_CODE_BUDGETED, handle_wasm_run_code_budgeted)
         DISPATCH_CMD(WASM_READ_MEMORY, handle_wasm_read_memory)
         DISPATCH_CMD(WASM_WRITE_MEMORY, handle_wasm_write_memory)
+        DISPATCH_CMD(WASM_SNAPSHOT, handle_wasm_snapshot)
+        DISPATCH_CMD(WASM_LOAD_SNAPSHOT, handle_wasm_load_snapshot)
+        DISPATCH_CMD(WASM_START_RUNNER, handle_wasm_start_runner)
+        DISPATCH_CMD(WASM_SETUP_RING, handle_wasm_setup_ring)
+        DISPATCH_CMD(WASM_RING_ENTER, handle_wasm_ring_enter)
+        DISPATCH_CMD(WASM_GET_STATS, handle_wasm_get_stats)
+        DISPATCH_CMD(WASM_CREATE_INSTANCE, handle_wasm_create_instance)
+        DISPATCH_CMD(WASM_SET_LOAD_OPTION, handle_wasm_set_load_option)
+        DISPATCH_CMD(WASM_START_ASYNC_RUNNER, handle_wasm_start_async_runner)
+        DISPATCH_CMD(WASM_SET_SYMBOLS, handle_wasm_set_symbols)
+        DISPATCH_CMD(WASM_ATTACH_HOOK, handle_wasm_attach_hook)
+        DISPATCH_CMD(WASM_DETACH_HOOK, handle_wasm_detach_hook)
         default:
             return -EINVAL;
     }
@@ -1,13 +1,21 @@
 #include "vm.h"
 #include <linux/delay.h>
+#include <linux/pagemap.h>
+#include <linux/sched/signal.h>
+#if EE_FPU_SWITCH
+#include <asm/fpu/internal.h>
+#endif
+#include "trace.h"
 
-static int (*_set_memory_ro)(unsigned long addr, int numpages);
-static int (*_set_memory_rw)(unsigned long addr, int numpages);
 static int (*_map_kernel_range_noflush)(unsigned long addr, unsigned long size,
 			    pgprot_t prot, struct page **pages);
 static void (*_put_files_struct)(struct files_struct *files);
 static int (*_unshare_files)(struct files_struct **displaced);
 
+static int memory_page_order = 0;
+module_param(memory_page_order, int, 0644);
+MODULE_PARM_DESC(memory_page_order, "Back linear memory with physically contiguous chunks of 2^order pages where possible (9 for 2MB)");
+
 int vm_unshare_executor_files(void) {
     struct files_struct *displaced = NULL;
     int ret;
@@ -20,13 +28,15 @@ int vm_unshare_executor_files(void) {
     return 0;
 }
 
+void vm_put_executor_files(struct files_struct *files) {
+    _put_files_struct(files);
+}
+
 int vm_init(void) {
-    _set_memory_ro = (void *) kallsyms_lookup_name("set_memory_ro");
-    _set_memory_rw = (void *) kallsyms_lookup_name("set_memory_rw");
     _map_kernel_range_noflush = (void *) kallsyms_lookup_name("map_kernel_range_noflush");
     _unshare_files = (void *) kallsyms_lookup_name("unshare_files");
     _put_files_struct = (void *) kallsyms_lookup_name("put_files_struct");
-    if(!_set_memory_ro || !_set_memory_rw || !_map_kernel_range_noflush || !_unshare_files || !_put_files_struct) {
+    if(!_map_kernel_range_noflush || !_unshare_files || !_put_files_struct) {
         printk(KERN_ALERT "unable to get address for internal symbol(s)\n");
         return -EINVAL;
     }
@@ -48,15 +58,219 @@ static int resolve_import(const char *name, uint32_t param_count, struct executi
     }
 }
 
-static int32_t wasm_memory_grow(struct vmctx *ctx, size_t memory_index, uint32_t pages) {
+// Makes sure that the first `count` entries of the page array are backed.
+//
+// Pages are allocated in chunks of 2^memory_page_order pages when possible, falling back to single pages
+// when memory is fragmented, and backing is rounded up to whole chunks so that subsequent grows
+// do not need to allocate. Chunks are split into independent pages, so that every entry of the page array
+// is freed (and can be mapped to userspace) in the same way.
+//
+// Pages below `count` are zeroed only if `zero` is set, or if they stand for a zero page of the snapshot
+// pages `src` (a NULL entry), since the caller overwrites the others anyway. Chunks mixing both kinds are
+// not allocated, so that zeroing still comes from the pre-zeroed pool page by page. Pages reserved
+// beyond `count` are always zeroed as they will be handed out by memory.grow.
+static int ee_reserve_memory_pages(struct execution_engine *ee, int count, int zero, struct page **src) {
+    int order = clamp(READ_ONCE(memory_page_order), 0, MAX_ORDER - 1);
+    int chunk = 1 << order;
+    int target, i, j;
+    int need_zero, zeroes;
+    struct page *page;
+
+    if(count <= ee->memory_page_reserved) return 0;
+    target = min_t(int, round_up(count, chunk), STATIC_MEMORY_AVAILABLE / PAGE_SIZE);
+
+    while(ee->memory_page_reserved < target) {
+        i = ee->memory_page_reserved;
+        if(order && (i & (chunk - 1)) == 0 && i + chunk <= target) {
+            for(j = 0, zeroes = 0; src && j < chunk && i + j < count; j++) {
+                if(!src[i + j]) zeroes++;
+            }
+            need_zero = zero || i + chunk > count || zeroes == chunk;
+            page = zeroes && !need_zero ? NULL :
+                alloc_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY | (need_zero ? __GFP_ZERO : 0), order);
+            if(page) {
+                split_page(page, order);
+                for(j = 0; j < chunk; j++) {
+                    ee->memory_pages[i + j] = nth_page(page, j);
+                }
+                ee->memory_page_reserved += chunk;
+                continue;
+            }
+        }
+
+        need_zero = zero || i >= count || (src && !src[i]);
+        page = need_zero ? ee_zero_page_get() : NULL;
+        if(!page) {
+            page = alloc_page(GFP_KERNEL | (need_zero ? __GFP_ZERO : 0));
+        }
+        if(!page) {
+            // Only fail if the request itself cannot be satisfied; rounding up is best-effort.
+            return i >= count ? 0 : -ENOMEM;
+        }
+        ee->memory_pages[i] = page;
+        ee->memory_page_reserved++;
+    }
+    return 0;
+}
+
+// Maps reserved pages up to `count` into the linear memory area.
+static int ee_map_memory_pages(struct execution_engine *ee, int count) {
+    unsigned long begin = (unsigned long) ee->static_memory_vm->addr + (unsigned long) ee->memory_page_count * PAGE_SIZE;
+    unsigned long len = (unsigned long) (count - ee->memory_page_count) * PAGE_SIZE;
+
+    if(count <= ee->memory_page_count) return 0;
+
+    if(_map_kernel_range_noflush(
+        begin,
+        len,
+        PAGE_KERNEL,
+        &ee->memory_pages[ee->memory_page_count]
+    ) != len / PAGE_SIZE) {
+        printk(KERN_INFO "FIXME: something might not be handled properly here (map_kernel_range_noflush failure)\n");
+        unmap_kernel_range(begin, len);
+        return -ENOMEM;
+    }
+    flush_cache_vmap(begin, begin + len);
+
+    ee->memory_page_count = count;
+    return 0;
+}
+
+static void ee_file_map_release(struct ee_file_map *map) {
+    unsigned long i;
+
+    for(i = 0; i < map->page_count; i++) {
+        put_page(map->pages[i]);
+    }
+    kvfree(map->pages);
+    kfree(map);
+}
+
+// Reads exactly `len` bytes of `f` at `pos` into `dst`, failing with -EIO if the file ends before.
+int kwasm_read_file(struct file *f, void *dst, size_t len, loff_t pos) {
+    ssize_t n;
+
+    while(len) {
+        n = kernel_read(f, dst, len, &pos);
+        if(n < 0) return n;
+        if(n == 0) return -EIO;
+        dst += n;
+        len -= n;
+        if(fatal_signal_pending(current)) return -EINTR;
+    }
+    return 0;
+}
+
+// Maps `len` bytes of `f` starting at the page-aligned `file_offset` read-only into the engine's static memory
+// area, at an offset from memory_base returned in `offset_out`. The pages are those of the page cache,
+// so the guest sees later writes to the file and no copy of it is made.
+//
+// The mapping lies beyond the linear memory bound: host functions, which go through `vmctx_get_memory_slice`,
+// cannot access it, and guest stores into it fault.
+int kwasm_map_file(struct execution_engine *ee, struct file *f, uint64_t file_offset, uint32_t len, uint32_t *offset_out) {
+    struct ee_file_map *map, *pos;
+    struct list_head *insert_after;
+    unsigned long begin, size, i;
+    loff_t file_size;
+    struct page *page;
+    int err;
+
+    if(!len || (file_offset & (PAGE_SIZE - 1))) return -EINVAL;
+    if(!(f->f_mode & FMODE_READ) || !f->f_mapping || !f->f_mapping->a_ops->readpage) return -EACCES;
+
+    file_size = i_size_read(file_inode(f));
+    if(file_offset >= file_size || len > file_size - file_offset) return -EINVAL;
+    if(ee->file_map_count >= MAX_FILE_MAP_COUNT) return -ENOMEM;
+
+    size = round_up_to_page_size(len);
+
+    // First fit between existing mappings.
+    begin = FILE_MAP_BEGIN;
+    insert_after = &ee->file_maps;
+    list_for_each_entry(pos, &ee->file_maps, list) {
+        if(pos->offset - begin >= size) break;
+        begin = pos->offset + pos->page_count * PAGE_SIZE;
+        insert_after = &pos->list;
+    }
+    if(begin + size > FILE_MAP_END) return -ENOMEM;
+
+    map = kzalloc(sizeof(struct ee_file_map), GFP_KERNEL);
+    if(!map) return -ENOMEM;
+    map->pages = kvmalloc_array(size / PAGE_SIZE, sizeof(struct page *), GFP_KERNEL);
+    if(!map->pages) {
+        kfree(map);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < size / PAGE_SIZE; i++) {
+        page = read_mapping_page(f->f_mapping, (file_offset >> PAGE_SHIFT) + i, f);
+        if(IS_ERR(page)) {
+            err = PTR_ERR(page);
+            goto fail;
+        }
+        map->pages[i] = page;
+        map->page_count++;
+    }
+
+    if(_map_kernel_range_noflush(
+        (unsigned long) ee->static_memory_vm->addr + begin,
+        size,
+        PAGE_KERNEL_RO,
+        map->pages
+    ) != size / PAGE_SIZE) {
+        unmap_kernel_range((unsigned long) ee->static_memory_vm->addr + begin, size);
+        err = -ENOMEM;
+        goto fail;
+    }
+    flush_cache_vmap((unsigned long) ee->static_memory_vm->addr + begin, (unsigned long) ee->static_memory_vm->addr + begin + size);
+
+    map->offset = begin;
+    list_add(&map->list, insert_after);
+    ee->file_map_count++;
+
+    *offset_out = begin;
+    return 0;
+
+    fail:
+    ee_file_map_release(map);
+    return err;
+}
+EXPORT_SYMBOL(kwasm_map_file);
+
+int kwasm_unmap_file(struct execution_engine *ee, uint32_t offset) {
+    struct ee_file_map *map;
+
+    list_for_each_entry(map, &ee->file_maps, list) {
+        if(map->offset != offset) continue;
+
+        unmap_kernel_range((unsigned long) ee->static_memory_vm->addr + map->offset, map->page_count * PAGE_SIZE);
+        list_del(&map->list);
+        ee->file_map_count--;
+        ee_file_map_release(map);
+        return 0;
+    }
+    return -EINVAL;
+}
+EXPORT_SYMBOL(kwasm_unmap_file);
+
+static void ee_release_file_maps(struct execution_engine *ee) {
+    struct ee_file_map *map;
+
+    while(!list_empty(&ee->file_maps)) {
+        map = list_first_entry(&ee->file_maps, struct ee_file_map, list);
+        kwasm_unmap_file(ee, map->offset);
+    }
+}
+
+static int32_t do_memory_grow(struct vmctx *ctx, uint32_t pages) {
     unsigned long old_size, delta;
     int new_os_page_count;
-    int i, j;
     struct execution_engine *ee = (void *) ctx;
 
     if(ctx->memory_base) {
         old_size = ctx->memory_bound;
         if(pages == 0) return old_size / 65536;
+        if(ee->no_sleep) return -1;
 
         delta = (unsigned long) pages * 65536;
         if(old_size + delta > STATIC_MEMORY_AVAILABLE) {
@@ -65,52 +279,309 @@ static int32_t wasm_memory_grow(struct vmctx *ctx, size_t memory_index, uint32_t
         }
 
         new_os_page_count = ((unsigned long) (old_size + delta) / PAGE_SIZE);
-        for(i = ee->memory_page_count; i < new_os_page_count; i++) {
-            ee->memory_pages[i] = alloc_page(GFP_KERNEL);
-            if(!ee->memory_pages[i]) {
-                for(j = ee->memory_page_count; j < i; j++) {
-                    __free_page(ee->memory_pages[j]);
-                    ee->memory_pages[j] = NULL;
-                }
-                printk(KERN_INFO "Rejected memory grow request (#2)\n");
-                return -1;
-            }
+        if(ee_reserve_memory_pages(ee, new_os_page_count, 1, NULL) < 0) {
+            printk(KERN_INFO "Rejected memory grow request (#2)\n");
+            return -1;
         }
-
-        if(_map_kernel_range_noflush(
-            (unsigned long) ee->static_memory_vm->addr + old_size,
-            delta,
-            PAGE_KERNEL,
-            &ee->memory_pages[ee->memory_page_count]
-        ) != delta / PAGE_SIZE) {
-            printk(KERN_INFO "FIXME: something might not be handled properly here (map_kernel_range_noflush failure)\n");
+        if(ee_map_memory_pages(ee, new_os_page_count) < 0) {
             return -1;
         }
-        flush_cache_vmap(
-            (unsigned long) ee->static_memory_vm->addr + old_size,
-            (unsigned long) ee->static_memory_vm->addr + old_size + delta
-        );
 
-        ee->memory_page_count = new_os_page_count;
+        // Pages must be visible to the mmap() fault handler before the new bound is.
+        smp_wmb();
+        WRITE_ONCE(ctx->memory_bound, ctx->memory_bound + delta);
 
-        ctx->memory_bound += delta;
+        this_cpu_inc(ee->stats->memory_grow_count);
+        this_cpu_add(ee->stats->memory_grow_bytes, delta);
         return old_size / 65536;
     } else {
         return -1;
     }
 }
 
+static int32_t wasm_memory_grow(struct vmctx *ctx, size_t memory_index, uint32_t pages) {
+    int32_t ret = do_memory_grow(ctx, pages);
+
+    trace_kwasm_memory_grow((struct execution_engine *) ctx, pages, ret);
+    return ret;
+}
+
 static int32_t wasm_memory_size(struct vmctx *ctx, size_t memory_index) {
     if(ctx->memory_base) return ctx->memory_bound / 65536;
     else return 0;
 }
 
-int init_execution_engine(const struct load_code_request *request, struct execution_engine *ee) {
+static inline int wasm_memory_range_ok(struct vmctx *ctx, uint32_t offset, uint32_t len) {
+    // 64-bit arithmetic, so that `offset + len` cannot wrap.
+    return ctx->memory_base && (uint64_t) offset + (uint64_t) len <= READ_ONCE(ctx->memory_bound);
+}
+
+// memmove() and memset() use `rep movsb`/`rep stosb` on CPUs with ERMS, which is faster than
+// anything generated code could do byte by byte and needs no FPU state.
+static int32_t wasm_memory_copy(struct vmctx *ctx, size_t memory_index, uint32_t dst, uint32_t src, uint32_t len) {
+    if(!wasm_memory_range_ok(ctx, dst, len) || !wasm_memory_range_ok(ctx, src, len)) {
+        return -1;
+    }
+    memmove(ctx->memory_base + dst, ctx->memory_base + src, len);
+    return 0;
+}
+
+static int32_t wasm_memory_fill(struct vmctx *ctx, size_t memory_index, uint32_t dst, uint32_t value, uint32_t len) {
+    if(!wasm_memory_range_ok(ctx, dst, len)) {
+        return -1;
+    }
+    memset(ctx->memory_base + dst, (uint8_t) value, len);
+    return 0;
+}
+
+struct ee_shell *ee_shell_alloc(void) {
+    struct ee_shell *shell;
+
+    shell = kzalloc(sizeof(struct ee_shell), GFP_KERNEL);
+    if(!shell) return NULL;
+
+    shell->static_memory_vm = __get_vm_area(STATIC_MEMORY_SIZE, VM_MAP, VMALLOC_START, VMALLOC_END);
+    if(!shell->static_memory_vm) goto fail;
+
+    shell->memory_pages = vzalloc(sizeof(struct page *) * (STATIC_MEMORY_AVAILABLE / PAGE_SIZE));
+    if(!shell->memory_pages) goto fail;
+
+    shell->local_global_ptr_backing = vmalloc(sizeof(uint64_t *) * MAX_GLOBAL_COUNT);
+    if(!shell->local_global_ptr_backing) goto fail;
+
+    shell->local_global_backing = vmalloc(sizeof(uint64_t) * MAX_GLOBAL_COUNT);
+    if(!shell->local_global_backing) goto fail;
+
+    shell->table_backing = vmalloc(sizeof(struct anyfunc) * MAX_TABLE_COUNT);
+    if(!shell->table_backing) goto fail;
+
+    return shell;
+
+    fail:
+    vfree(shell->table_backing);
+    vfree(shell->local_global_backing);
+    vfree(shell->local_global_ptr_backing);
+    vfree(shell->memory_pages);
+    if(shell->static_memory_vm) free_vm_area(shell->static_memory_vm);
+    kfree(shell);
+    return NULL;
+}
+
+void ee_shell_free(struct ee_shell *shell) {
+    vfree(shell->table_backing);
+    vfree(shell->local_global_backing);
+    vfree(shell->local_global_ptr_backing);
+    vfree(shell->memory_pages);
+    free_vm_area(shell->static_memory_vm);
+    kfree(shell);
+}
+
+// Stacks only map their own pages in a larger area, leaving its start unmapped as the guard. This avoids
+// changing page attributes (and flushing TLBs) as a read-only guard would.
+// FIXME: Accessing the stack guard triggers a double fault; generated code checks `stack_lower_bound` first.
+struct ee_stack *ee_stack_alloc(unsigned long size) {
+    struct ee_stack *stack;
+    unsigned long i, count = size / PAGE_SIZE;
+
+    stack = kzalloc(sizeof(struct ee_stack), GFP_KERNEL);
+    if(!stack) return NULL;
+    stack->size = size;
+
+    stack->pages = kcalloc(count, sizeof(struct page *), GFP_KERNEL);
+    if(!stack->pages) goto fail;
+    for(i = 0; i < count; i++) {
+        stack->pages[i] = alloc_page(GFP_KERNEL);
+        if(!stack->pages[i]) goto fail;
+    }
+
+    stack->vm = __get_vm_area(STACK_GUARD_SIZE + size, VM_MAP, VMALLOC_START, VMALLOC_END);
+    if(!stack->vm) goto fail;
+    stack->base = (uint8_t *) stack->vm->addr + STACK_GUARD_SIZE;
+
+    if(_map_kernel_range_noflush((unsigned long) stack->base, size, PAGE_KERNEL, stack->pages) < 0) {
+        goto fail;
+    }
+    flush_cache_vmap((unsigned long) stack->base, (unsigned long) stack->base + size);
+    return stack;
+
+    fail:
+    ee_stack_free(stack);
+    return NULL;
+}
+
+void ee_stack_free(struct ee_stack *stack) {
+    unsigned long i;
+
+    if(stack->vm) free_vm_area(stack->vm); // also unmaps
+    if(stack->pages) {
+        for(i = 0; i < stack->size / PAGE_SIZE; i++) {
+            if(stack->pages[i]) __free_page(stack->pages[i]);
+        }
+        kfree(stack->pages);
+    }
+    kfree(stack);
+}
+
+// Unmaps and frees linear memory pages, leaving the address space and the page array
+// of the shell clean for reuse.
+static void ee_release_memory(struct execution_engine *ee) {
+    int i;
+
+    if(ee->memory_page_count) {
+        unmap_kernel_range(
+            (unsigned long) ee->static_memory_vm->addr,
+            (unsigned long) ee->memory_page_count * PAGE_SIZE
+        );
+    }
+    for(i = 0; i < ee->memory_page_reserved; i++) {
+        __free_page(ee->memory_pages[i]);
+        ee->memory_pages[i] = NULL;
+    }
+    ee->memory_page_count = 0;
+    ee->memory_page_reserved = 0;
+}
+
+// Backs and maps the first `len` bytes of linear memory.
+//
+// If `src` is not NULL, each page is initialized from the corresponding snapshot page,
+// with NULL entries standing for zero pages, which are reserved zeroed. Otherwise page contents
+// are left for the caller to fill.
+static int ee_init_memory(struct execution_engine *ee, unsigned long len, struct page **src) {
+    int err;
+    int i;
+    int count = len / PAGE_SIZE;
+
+    if((err = ee_reserve_memory_pages(ee, count, 0, src)) < 0) {
+        return err;
+    }
+    if(src) {
+        for(i = 0; i < count; i++) {
+            if(src[i]) copy_page(page_address(ee->memory_pages[i]), page_address(src[i]));
+        }
+    }
+    if((err = ee_map_memory_pages(ee, count)) < 0) {
+        return err;
+    }
+    ee->ctx.memory_base = ee->static_memory_vm->addr;
+    ee->ctx.memory_bound = len;
+    return 0;
+}
+
+static void ee_init_globals(struct execution_engine *ee, uint32_t count) {
+    int i;
+
+    ee->local_global_ptr_backing = ee->shell->local_global_ptr_backing;
+    ee->local_global_backing = ee->shell->local_global_backing;
+    for(i = 0; i < count; i++) {
+        ee->local_global_ptr_backing[i] = &ee->local_global_backing[i];
+    }
+    ee->global_count = count;
+    ee->ctx.globals = ee->local_global_ptr_backing;
+}
+
+static void ee_init_table(struct execution_engine *ee, uint32_t count) {
+    ee->local_table_ptr_backing = &ee->local_table_backing;
+    ee->local_table_backing.base = ee->shell->table_backing;
+    ee->local_table_backing.count = count;
+    ee->ctx.tables = &ee->local_table_ptr_backing;
+}
+
+static void ee_set_table_entry(struct execution_engine *ee, uint32_t i, const struct table_entry_request *entry) {
+    if(entry->offset == (unsigned long) (-1L)) {
+        ee->local_table_backing.base[i].func = NULL;
+    } else {
+        ee->local_table_backing.base[i].func =
+            (void *) ((unsigned long) ee->code + entry->offset);
+    }
+    ee->local_table_backing.base[i].ctx = &ee->ctx;
+    ee->local_table_backing.base[i].sig_id = entry->sig_id;
+}
+
+// Takes over the reference to `img`, even on failure.
+static int ee_init_code(struct execution_engine *ee, struct code_image *img) {
+    ee->code_image = img;
+    ee->code = code_image_map(img);
+    if(!ee->code) return -ENOMEM;
+    ee->code_len = img->code_len;
+    return 0;
+}
+
+static int ee_init_shell(struct execution_engine *ee) {
+    ee->shell = ee_shell_get();
+    if(!ee->shell) {
+        return -ENOMEM;
+    }
+    ee->static_memory_vm = ee->shell->static_memory_vm;
+    ee->memory_pages = ee->shell->memory_pages;
+
+    ee->stack = ee_stack_get(ee->stack_size ? ee->stack_size : STACK_SIZE);
+    if(!ee->stack) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void ee_init_runtime(struct execution_engine *ee) {
+    ee->ctx.intrinsics = &ee->intrinsics_backing;
+    ee->intrinsics_backing.memory_grow = wasm_memory_grow;
+    ee->intrinsics_backing.memory_size = wasm_memory_size;
+    ee->intrinsics_backing.memory_copy = wasm_memory_copy;
+    ee->intrinsics_backing.memory_fill = wasm_memory_fill;
+
+    // The stack guard is below `base`; see `ee_stack_alloc`.
+    ee->stack_begin = ee->stack->base;
+    ee->stack_end = (void *) (((unsigned long) ee->stack->base + ee->stack->size) & (~0xful)); // 16-byte alignment
+    ee->ctx_indirect = &ee->ctx;
+    ee->ctx.stack_lower_bound = ee->stack_begin + STACK_HOST_RESERVE;
+}
+
+// Engines that use the FPU get a buffer for their state, saved when their runner is scheduled out in a call.
+static int ee_init_fpu(struct execution_engine *ee) {
+#if EE_FPU_SWITCH
+    if(ee->fpu_free) return 0;
+
+    ee->guest_fpu = vzalloc(sizeof(struct fpu));
+    if(!ee->guest_fpu) return -ENOMEM;
+    fpstate_init(&ee->guest_fpu->state);
+#endif
+    return 0;
+}
+
+static void ee_release(struct execution_engine *ee) {
+    // Resolver instances may reference linear memory asynchronously (e.g. readiness rings),
+    // so they must be gone before it is.
+    release_module_resolver(&ee->resolver);
+    ee->resolver.resolver_count = 0;
+    ee->resolver.resolvers = NULL;
+
+    ee_stats_release(ee);
+    if(ee->shell) {
+        ee_release_file_maps(ee);
+        ee_release_memory(ee);
+        ee_shell_put(ee->shell);
+    }
+    if(ee->stack) ee_stack_put(ee->stack);
+    if(ee->snapshot) ee_snapshot_put(ee->snapshot);
+    else vfree(ee->ctx.dynamic_sigindices);
+    vfree(ee->ctx.imported_funcs);
+    vfree(ee->guest_fpu);
+    if(ee->code) code_image_unmap(ee->code_image, ee->code);
+    if(ee->code_image) code_image_put(ee->code_image);
+}
+
+// `files` may be NULL, to read everything from the pointers of `request`.
+int init_execution_engine(
+    const struct load_code_request *request,
+    const struct ee_load_options *options,
+    const struct ee_load_files *files,
+    struct execution_engine *ee
+) {
     int err;
     int i;
-    struct import_request import_req;
-    struct table_entry_request table_entry_req;
-    int pages_allocated_without_mapping = 0;
+    struct import_request *import_reqs = NULL;
+    struct table_entry_request *table_reqs = NULL;
+    struct code_image *img;
+    uint64_t import_hash = 0;
 
     if(
         request->code_len == 0 ||
@@ -125,111 +596,86 @@ int init_execution_engine(const struct load_code_request *request, struct execut
     }
 
     memset(ee, 0, sizeof(struct execution_engine));
+    INIT_LIST_HEAD(&ee->file_maps);
+    ee->fpu_free = options->fpu_free;
+    ee->bounds_checked = options->bounds_checked;
+    ee->stack_size = options->stack_size;
 
     err = get_module_resolver(ee, &ee->resolver);
     if(err) {
         return err;
     }
 
-    // Initialize code storage.
-    ee->code = __vmalloc(round_up_to_page_size(request->code_len), GFP_KERNEL, PAGE_KERNEL_EXEC);
-    if(ee->code == NULL) {
-        err = -ENOMEM;
-        goto fail;
+    if(request->imported_funcs && request->imported_func_count) {
+        ee->ctx.imported_funcs = vmalloc(sizeof(struct imported_func) * request->imported_func_count);
+        if(ee->ctx.imported_funcs == NULL) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        ee->imported_func_count = request->imported_func_count;
+
+        import_reqs = kvmalloc_array(request->imported_func_count, sizeof(struct import_request), GFP_KERNEL);
+        if(!import_reqs) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        if(copy_from_user(import_reqs, request->imported_funcs, sizeof(struct import_request) * request->imported_func_count)) {
+            err = -EFAULT;
+            goto fail;
+        }
+        for(i = 0; i < request->imported_func_count; i++) {
+            import_reqs[i].name[sizeof(import_reqs[i].name) - 1] = 0;
+            import_hash = code_import_hash_update(import_hash, &import_reqs[i]);
+            if((err = resolve_import(import_reqs[i].name, import_reqs[i].param_count, ee, &ee->ctx.imported_funcs[i])) < 0) {
+                printk(KERN_INFO "Failed to resolve import %s\n", import_reqs[i].name);
+                err = -EINVAL;
+                goto fail;
+            }
+        }
+        kvfree(import_reqs);
+        import_reqs = NULL;
     }
-    if((((unsigned long) ee->code) & 4095) != 0) {
-        printk(KERN_INFO "Executable memory not aligned to page boundary\n");
-        err = -EINVAL;
+
+    // Initialize code storage. Engines loading identical code share a single executable image.
+    if(files && files->code) {
+        img = code_image_get_from_file(files->code, files->code_offset, request->code_len, import_hash);
+    } else {
+        img = code_image_get(request->code, request->code_len, import_hash);
+    }
+    if(IS_ERR(img)) {
+        err = PTR_ERR(img);
         goto fail;
     }
-    if(copy_from_user(ee->code, request->code, request->code_len)) {
-        err = -EFAULT;
+    if((err = ee_init_code(ee, img)) < 0) {
         goto fail;
     }
 
-    ee->code_len = request->code_len;
+    if((err = ee_init_shell(ee)) < 0) {
+        goto fail;
+    }
 
-    if(request->memory && request->memory_len) {
-        ee->static_memory_vm = __get_vm_area(STATIC_MEMORY_SIZE, VM_MAP, VMALLOC_START, VMALLOC_END);
-        if(!ee->static_memory_vm) {
-            err = -ENOMEM;
+    if(files && files->memory && request->memory_len) {
+        if((err = ee_init_memory(ee, request->memory_len, NULL)) < 0) {
             goto fail;
         }
-
-        ee->memory_page_count = (request->memory_len / PAGE_SIZE);
-        ee->memory_pages = vzalloc(sizeof(struct page *) * (STATIC_MEMORY_AVAILABLE / PAGE_SIZE));
-        if(!ee->memory_pages) {
-            err = -ENOMEM;
+        if((err = kwasm_read_file(files->memory, ee->ctx.memory_base, request->memory_len, files->memory_offset)) < 0) {
             goto fail;
         }
-        for(i = 0; i < ee->memory_page_count; i++) {
-            ee->memory_pages[i] = alloc_page(GFP_KERNEL);
-            if(!ee->memory_pages[i]) {
-                ee->memory_page_count = i;
-                pages_allocated_without_mapping = 1;
-                err = -ENOMEM;
-                goto fail;
-            }
-        }
-        if(_map_kernel_range_noflush(
-            (unsigned long) ee->static_memory_vm->addr,
-            request->memory_len,
-            PAGE_KERNEL,
-            ee->memory_pages
-        ) != ee->memory_page_count) {
-            printk(KERN_INFO "FIXME: something might not be handled properly here (map_kernel_range_noflush failure)\n");
-            err = -ENOMEM;
+    } else if(request->memory && request->memory_len) {
+        if((err = ee_init_memory(ee, request->memory_len, NULL)) < 0) {
             goto fail;
         }
-        flush_cache_vmap(
-            (unsigned long) ee->static_memory_vm->addr,
-            (unsigned long) ee->static_memory_vm->addr + request->memory_len
-        );
-        ee->ctx.memory_base = ee->static_memory_vm->addr;
         if(copy_from_user(ee->ctx.memory_base, request->memory, request->memory_len)) {
             err = -EFAULT;
             goto fail;
         }
-        ee->ctx.memory_bound = request->memory_len;
     }
     if(request->globals && request->global_count) {
-        ee->local_global_ptr_backing = vmalloc(sizeof(uint64_t *) * request->global_count);
-        if(ee->local_global_ptr_backing == NULL) {
-            err = -ENOMEM;
-            goto fail;
-        }
-        ee->local_global_backing = vmalloc(sizeof(uint64_t) * request->global_count);
-        if(ee->local_global_backing == NULL) {
-            err = -ENOMEM;
-            goto fail;
-        }
+        ee_init_globals(ee, request->global_count);
         if(copy_from_user(ee->local_global_backing, request->globals, sizeof(uint64_t) * request->global_count)) {
             err = -EFAULT;
             goto fail;
         }
-        for(i = 0; i < request->global_count; i++) {
-            ee->local_global_ptr_backing[i] = &ee->local_global_backing[i];
-        }
-        ee->ctx.globals = ee->local_global_ptr_backing;
-    }
-    if(request->imported_funcs && request->imported_func_count) {
-        ee->ctx.imported_funcs = vmalloc(sizeof(struct imported_func) * request->imported_func_count);
-        if(ee->ctx.imported_funcs == NULL) {
-            err = -ENOMEM;
-            goto fail;
-        }
-        for(i = 0; i < request->imported_func_count; i++) {
-            if(copy_from_user(&import_req, &request->imported_funcs[i], sizeof(struct import_request))) {
-                err = -EFAULT;
-                goto fail;
-            }
-            import_req.name[sizeof(import_req.name) - 1] = 0;
-            if((err = resolve_import(import_req.name, import_req.param_count, ee, &ee->ctx.imported_funcs[i])) < 0) {
-                printk(KERN_INFO "Failed to resolve import %s\n", import_req.name);
-                err = -EINVAL;
-                goto fail;
-            }
-        }
     }
     if(request->dynamic_sigindices && request->dynamic_sigindice_count) {
         ee->ctx.dynamic_sigindices = vmalloc(sizeof(uint32_t) * request->dynamic_sigindice_count);
@@ -237,6 +683,7 @@ int init_execution_engine(const struct load_code_request *request, struct execut
             err = -ENOMEM;
             goto fail;
         }
+        ee->dynamic_sigindice_count = request->dynamic_sigindice_count;
         if(copy_from_user(
             ee->ctx.dynamic_sigindices,
             request->dynamic_sigindices,
@@ -247,105 +694,119 @@ int init_execution_engine(const struct load_code_request *request, struct execut
         }
     }
     if(request->table && request->table_count) {
-        ee->local_table_ptr_backing = &ee->local_table_backing;
-
-        ee->local_table_backing.base = vmalloc(sizeof(struct anyfunc) * request->table_count);
-        if(ee->local_table_backing.base == NULL) {
+        table_reqs = kvmalloc_array(request->table_count, sizeof(struct table_entry_request), GFP_KERNEL);
+        if(!table_reqs) {
             err = -ENOMEM;
             goto fail;
         }
-
-        ee->local_table_backing.count = request->table_count;
-
+        if(copy_from_user(table_reqs, request->table, sizeof(struct table_entry_request) * request->table_count)) {
+            err = -EFAULT;
+            goto fail;
+        }
+        ee_init_table(ee, request->table_count);
         for(i = 0; i < request->table_count; i++) {
-            if(copy_from_user(&table_entry_req, &request->table[i], sizeof(struct table_entry_request))) {
-                err = -EFAULT;
-                goto fail;
-            }
-            if(table_entry_req.offset == (unsigned long) (-1L)) {
-                ee->local_table_backing.base[i].func = NULL;
-            } else {
-                ee->local_table_backing.base[i].func =
-                    (void *) ((unsigned long) ee->code + table_entry_req.offset);
-            }
-            ee->local_table_backing.base[i].ctx = &ee->ctx;
-            ee->local_table_backing.base[i].sig_id = table_entry_req.sig_id;
+            ee_set_table_entry(ee, i, &table_reqs[i]);
         }
-        ee->ctx.tables = &ee->local_table_ptr_backing;
+        kvfree(table_reqs);
+        table_reqs = NULL;
     }
 
-    ee->ctx.intrinsics = &ee->intrinsics_backing;
-    ee->intrinsics_backing.memory_grow = wasm_memory_grow;
-    ee->intrinsics_backing.memory_size = wasm_memory_size;
-
-    ee->stack_backing = vmalloc(STACK_SIZE);
-    if(!ee->stack_backing) {
-        err = -ENOMEM;
+    if((err = ee_stats_init(ee)) < 0) {
+        goto fail;
+    }
+    if((err = ee_init_fpu(ee)) < 0) {
         goto fail;
     }
-    ee->stack_begin = (void *) round_up_to_page_size((unsigned long) ee->stack_backing);
-    ee->stack_end = (void *) (((unsigned long) ee->stack_backing + STACK_SIZE) & (~0xful)); // 16-byte alignment
-    ee->ctx_indirect = &ee->ctx;
 
-    // FIXME: Accessing the stack guard triggers a triple fault.
-    _set_memory_ro((unsigned long) ee->stack_begin, STACK_GUARD_SIZE / 4096);
-    ee->ctx.stack_lower_bound = (uint8_t *) ((unsigned long) ee->stack_begin + STACK_GUARD_SIZE + 8192);
- 
+    ee_init_runtime(ee);
+    trace_kwasm_load(ee, 0);
     return 0;
 
     fail:
+    kvfree(import_reqs);
+    kvfree(table_reqs);
+    ee_release(ee);
+    return err;
+}
 
-    if(ee->memory_pages) {
-        if(!pages_allocated_without_mapping) {
-            unmap_kernel_range(
-                (unsigned long) ee->static_memory_vm->addr,
-                ee->memory_page_count * PAGE_SIZE
-            );
+int init_execution_engine_from_snapshot(struct ee_snapshot *snap, struct execution_engine *ee) {
+    int err;
+    int i;
+
+    memset(ee, 0, sizeof(struct execution_engine));
+    INIT_LIST_HEAD(&ee->file_maps);
+    ee->fpu_free = snap->fpu_free;
+    ee->bounds_checked = snap->bounds_checked;
+    ee->stack_size = snap->stack_size;
+
+    err = get_module_resolver(ee, &ee->resolver);
+    if(err) {
+        return err;
+    }
+
+    kref_get(&snap->ref);
+    ee->snapshot = snap;
+
+    code_image_ref(snap->code_image);
+    if((err = ee_init_code(ee, snap->code_image)) < 0) {
+        goto fail;
+    }
+
+    if((err = ee_init_shell(ee)) < 0) {
+        goto fail;
+    }
+
+    if(snap->memory_len) {
+        if((err = ee_init_memory(ee, snap->memory_len, snap->memory_pages)) < 0) {
+            goto fail;
         }
-        for(i = 0; i < ee->memory_page_count; i++) {
-            __free_page(ee->memory_pages[i]);
+    }
+    if(snap->global_count) {
+        ee_init_globals(ee, snap->global_count);
+        memcpy(ee->local_global_backing, snap->globals, sizeof(uint64_t) * snap->global_count);
+    }
+    if(snap->imported_func_count) {
+        ee->ctx.imported_funcs = vmalloc(sizeof(struct imported_func) * snap->imported_func_count);
+        if(ee->ctx.imported_funcs == NULL) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        ee->imported_func_count = snap->imported_func_count;
+        for(i = 0; i < snap->imported_func_count; i++) {
+            ee->ctx.imported_funcs[i].func = snap->imported_funcs[i];
+            ee->ctx.imported_funcs[i].ctx_indirect = &ee->ctx_indirect;
+        }
+    }
+    if(snap->dynamic_sigindice_count) {
+        // Never written by generated code, so shared with the snapshot instead of copied.
+        ee->ctx.dynamic_sigindices = snap->dynamic_sigindices;
+        ee->dynamic_sigindice_count = snap->dynamic_sigindice_count;
+    }
+    if(snap->table_count) {
+        ee_init_table(ee, snap->table_count);
+        for(i = 0; i < snap->table_count; i++) {
+            ee_set_table_entry(ee, i, &snap->table[i]);
         }
-        vfree(ee->memory_pages);
     }
-    if(ee->static_memory_vm) free_vm_area(ee->static_memory_vm);
-    vfree(ee->stack_backing);
-    vfree(ee->local_table_backing.base);
-    vfree(ee->ctx.dynamic_sigindices);
-    vfree(ee->ctx.imported_funcs);
-    vfree(ee->local_global_backing);
-    vfree(ee->local_global_ptr_backing);
-    vfree(ee->code);
 
-    release_module_resolver(&ee->resolver);
+    if((err = ee_stats_init(ee)) < 0) {
+        goto fail;
+    }
+    if((err = ee_init_fpu(ee)) < 0) {
+        goto fail;
+    }
 
+    ee_init_runtime(ee);
+    trace_kwasm_load(ee, 1);
+    return 0;
+
+    fail:
+    ee_release(ee);
     return err;
 }
 
 void destroy_execution_engine(struct execution_engine *ee) {
-    int i;
-
-    _set_memory_rw((unsigned long) ee->stack_begin, STACK_GUARD_SIZE / 4096);
-
-    if(ee->memory_pages) {
-        unmap_kernel_range(
-            (unsigned long) ee->static_memory_vm->addr,
-            ee->memory_page_count * PAGE_SIZE
-        );
-        for(i = 0; i < ee->memory_page_count; i++) {
-            __free_page(ee->memory_pages[i]);
-        }
-        vfree(ee->memory_pages);
-    }
-    if(ee->static_memory_vm) free_vm_area(ee->static_memory_vm);
-    vfree(ee->stack_backing);
-    vfree(ee->local_table_backing.base);
-    vfree(ee->ctx.dynamic_sigindices);
-    vfree(ee->ctx.imported_funcs);
-    vfree(ee->local_global_backing);
-    vfree(ee->local_global_ptr_backing);
-    vfree(ee->code);
-
-    release_module_resolver(&ee->resolver);
+    ee_release(ee);
 }
 
 uint64_t ee_call0(struct execution_engine *ee, uint32_t offset) {
@@ -353,3 +814,57 @@ uint64_t ee_call0(struct execution_engine *ee, uint32_t offset) {
     func f = (func) (ee->code + offset);
     return f(&ee->ctx);
 }
+
+// Generated code takes every parameter, including f32/f64 ones, as a raw 64-bit value
+// in the integer argument registers (and then on the stack) after the vmctx,
+// so one prototype per arity covers all parameter types.
+#define EE_PARAMS_1 uint64_t
+#define EE_PARAMS_2 EE_PARAMS_1, uint64_t
+#define EE_PARAMS_3 EE_PARAMS_2, uint64_t
+#define EE_PARAMS_4 EE_PARAMS_3, uint64_t
+#define EE_PARAMS_5 EE_PARAMS_4, uint64_t
+#define EE_PARAMS_6 EE_PARAMS_5, uint64_t
+#define EE_PARAMS_7 EE_PARAMS_6, uint64_t
+#define EE_PARAMS_8 EE_PARAMS_7, uint64_t
+
+#define EE_ARGS_1(p) p[0]
+#define EE_ARGS_2(p) EE_ARGS_1(p), p[1]
+#define EE_ARGS_3(p) EE_ARGS_2(p), p[2]
+#define EE_ARGS_4(p) EE_ARGS_3(p), p[3]
+#define EE_ARGS_5(p) EE_ARGS_4(p), p[4]
+#define EE_ARGS_6(p) EE_ARGS_5(p), p[5]
+#define EE_ARGS_7(p) EE_ARGS_6(p), p[6]
+#define EE_ARGS_8(p) EE_ARGS_7(p), p[7]
+
+#define EE_CALL_CASE(n) \
+    case n: { \
+        typedef uint64_t(*func)(struct vmctx *, EE_PARAMS_##n); \
+        return ((func) (ee->code + offset))(&ee->ctx, EE_ARGS_##n(params)); \
+    }
+
+static uint64_t ee_call_n(struct execution_engine *ee, uint32_t offset, const uint64_t *params, uint32_t param_count) {
+    switch(param_count) {
+        case 0: return ee_call0(ee, offset);
+        EE_CALL_CASE(1)
+        EE_CALL_CASE(2)
+        EE_CALL_CASE(3)
+        EE_CALL_CASE(4)
+        EE_CALL_CASE(5)
+        EE_CALL_CASE(6)
+        EE_CALL_CASE(7)
+        EE_CALL_CASE(8)
+        default:
+            BUG();
+    }
+}
+
+uint64_t ee_call(struct execution_engine *ee, uint32_t offset, const uint64_t *params, uint32_t param_count) {
+    uint64_t ret;
+
+    trace_kwasm_run_start(ee, offset, param_count);
+    ee_stats_run_begin(ee);
+    ret = ee_call_n(ee, offset, params, param_count);
+    ee_stats_run_end(ee);
+    trace_kwasm_run_end(ee, offset, ret, ee->last_run_time_ns);
+    return ret;
+}
@@ -8,8 +8,15 @@
 #include <linux/file.h>
 #include <linux/slab.h>
 #include <linux/preempt.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/semaphore.h>
+#include <linux/version.h>
 #include <asm/cacheflush.h>
 #include "kapi.h"
+#include "coroutine.h"
 
 #define MAX_CODE_SIZE (1048576 * 8)
 #define MAX_MEMORY_SIZE (1048576 * 16)
@@ -17,10 +24,29 @@
 #define MAX_IMPORT_COUNT 128
 #define MAX_DYNAMIC_SIGINDICE_COUNT 8192
 #define MAX_TABLE_COUNT 1024
-#define STACK_SIZE (2 * 1048576)
+#define MAX_PARAM_COUNT 8
+#define MAX_RING_ENTRIES 4096
+#define STACK_SIZE (2 * 1048576) // default and largest
+#define MIN_STACK_SIZE 65536
+#define STACK_CLASS_COUNT 6 // power-of-two sizes from MIN_STACK_SIZE to STACK_SIZE
+
+// Guest FPU state is switched by the preempt notifier of runners with `__kernel_fpu_{begin,end}`, which
+// are only exported before 5.0 (and 5.2 reworked FPU switching around TIF_NEED_FPU_LOAD). On later
+// kernels runners use `kernel_fpu_begin()` with preemption re-enabled, and the guest FPU state is not
+// kept across preemption; see `executor_enter_guest_context`.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#define EE_FPU_SWITCH 1
+#else
+#define EE_FPU_SWITCH 0
+#endif
 #define STACK_GUARD_SIZE 8192
+#define STACK_HOST_RESERVE 8192 // left below `stack_lower_bound` for host calls
 #define STATIC_MEMORY_SIZE (6144ul * 1048576ul)
 #define STATIC_MEMORY_AVAILABLE (1024ul * 1048576ul)
+// Files are mapped read-only above the largest possible linear memory, within the 32-bit guest address space.
+#define FILE_MAP_BEGIN STATIC_MEMORY_AVAILABLE
+#define FILE_MAP_END (4096ul * 1048576ul)
+#define MAX_FILE_MAP_COUNT 256
 
 struct local_memory;
 struct local_table;
@@ -42,9 +68,13 @@ struct vmctx {
     size_t memory_bound;
 };
 
+// Entries past `memory_size` are bulk memory operations. They return 0, or -1 without touching
+// memory if a range is out of bounds, in which case generated code traps.
 struct vm_intrinsics {
     void *memory_grow;
     void *memory_size;
+    void *memory_copy; // int32_t (ctx, memory_index, dst, src, len)
+    void *memory_fill; // int32_t (ctx, memory_index, dst, value, len)
 };
 
 struct local_memory {
@@ -71,6 +101,76 @@ struct imported_func {
     struct vmctx **ctx_indirect;
 };
 
+// Code shared by all engines that loaded the same module, refcounted by its users. Each engine runs it
+// from a private mapping of its pages (see `code_image_map`), so that making one engine's code
+// non-executable to kill it leaves the others running.
+struct code_image {
+    struct kref ref;
+    struct hlist_node node;
+    uint64_t hash;
+    uint64_t import_hash;
+    uint8_t *code;
+    uint32_t code_len;
+
+    // Function names set with WASM_SET_SYMBOLS, protected by the code cache mutex.
+    struct code_symbol *symbols;
+    uint32_t symbol_count;
+
+    struct list_head maps; // private mappings of engines, protected by the code cache mutex
+};
+
+struct code_map {
+    struct list_head node;
+    uint8_t *code;
+};
+
+struct code_symbol {
+    uint32_t offset;
+    uint32_t size;
+    char name[64];
+};
+
+// Backing resources of an execution engine that do not depend on the module being loaded.
+// Shells are expensive to set up (6GB address space reservation, page array, guarded stack)
+// so they are recycled through a per-CPU pool instead of being freed with the engine.
+struct ee_shell {
+    struct list_head list;
+    struct vm_struct *static_memory_vm;
+    struct page **memory_pages;
+    uint64_t *local_global_backing;
+    uint64_t **local_global_ptr_backing;
+    struct anyfunc *table_backing;
+};
+
+// A guest stack, with an unmapped guard area below it. Pooled by size.
+struct ee_stack {
+    struct list_head list;
+    struct vm_struct *vm;
+    struct page **pages;
+    unsigned long size;
+    uint8_t *base; // lowest usable address
+};
+
+// Per-CPU runtime counters of an execution engine. Summed over all CPUs when read.
+struct ee_stats_cpu {
+    uint64_t run_count;
+    uint64_t run_time_ns;
+    uint64_t preempted_time_ns;
+    uint64_t preempt_count;
+    uint64_t memory_grow_count;
+    uint64_t memory_grow_bytes;
+    uint64_t kill_count;
+};
+
+// Per-import state of host call tracing. The first fields are used by the thunk in trace.c.
+struct ee_trace_record {
+    void *target; // counting thunk or import
+    uint64_t saved_ret;
+    uint64_t saved_rbx;
+    struct execution_engine *ee;
+    uint32_t index;
+};
+
 struct execution_engine {
     struct vmctx ctx;
     struct local_table local_table_backing;
@@ -79,29 +179,145 @@ struct execution_engine {
     struct module_resolver resolver;
     uint64_t *local_global_backing;
     uint64_t **local_global_ptr_backing;
+    uint32_t global_count;
+    uint32_t imported_func_count;
+    uint32_t dynamic_sigindice_count;
+    struct code_image *code_image;
     uint8_t *code;
     uint32_t code_len;
     uint8_t *stack_begin;
     uint8_t *stack_end;
-    uint8_t *stack_backing;
+    struct ee_stack *stack;
+    unsigned long stack_size; // requested, 0 for STACK_SIZE
     struct vmctx *ctx_indirect;
+    struct ee_shell *shell;
 
     struct vm_struct *static_memory_vm;
     struct page **memory_pages;
-    int memory_page_count;
+    int memory_page_count; // mapped
+    int memory_page_reserved; // allocated, >= memory_page_count
+    struct list_head file_maps; // sorted by offset
+    uint32_t file_map_count;
 
     struct preempt_notifier preempt_notifier;
-    uint64_t preempt_in_count, preempt_out_count;
+    int fpu_free; // runs without kernel FPU sections; see `struct ee_load_options`
+    int bounds_checked; // see `struct ee_load_options`
+    struct fpu *guest_fpu; // guest FPU state while its runner is scheduled out in a call (EE_FPU_SWITCH only)
+    int guest_fpu_saved;
+
+    struct ee_stats_cpu __percpu *stats;
+    uint64_t __percpu *host_call_counts; // one per import
+    void **host_call_targets; // real import functions, if counting thunks are installed
+    uint8_t *host_call_thunks;
+    struct ee_trace_record *trace_records; // one per import, if host calls are traced
+    uint8_t *trace_thunks;
+    uint32_t id; // also the name of the debugfs stats file
+    uint64_t run_start_ns; // 0 if not running
+    uint64_t last_run_time_ns;
+    uint64_t sched_out_ns;
+    uint64_t run_preempted_ns; // off CPU during the current or last call
+    struct dentry *debugfs_entry;
+
+    // Budget of the call being run, if any; see `ee_budget_start`.
+    struct hrtimer budget_timer;
+    int budget_kind;
+    uint64_t budget_ns;
+    struct semaphore *budget_wake;
+    int budget_exceeded;
+
+    struct ee_snapshot *snapshot; // if created from one; owns the shared dynamic sigindices
+    int no_sleep; // run from a packet hook, where memory.grow fails; see hook.c
+    struct sched_task *async_task; // if run by an async runner
+};
+
+// Page cache pages of a file mapped read-only into the static memory area, outside linear memory.
+struct ee_file_map {
+    struct list_head list;
+    unsigned long offset; // from memory_base
+    unsigned long page_count;
+    struct page **pages;
+};
+
+// A frozen copy of the state of an initialized execution engine, from which new engines can be created
+// without going through userspace again.
+//
+// Linear memory pages that were all zero at snapshot time are stored as NULL, so that creating an engine
+// from the snapshot only copies pages that have ever been written to.
+struct ee_snapshot {
+    struct kref ref;
+    struct code_image *code_image;
+    struct page **memory_pages;
+    unsigned long memory_len;
+    uint64_t *globals;
+    uint32_t global_count;
+    void **imported_funcs;
+    uint32_t imported_func_count;
+    uint32_t *dynamic_sigindices;
+    uint32_t dynamic_sigindice_count;
+    struct table_entry_request *table;
+    uint32_t table_count;
+    int fpu_free;
+    int bounds_checked;
+    unsigned long stack_size;
+};
+
+// Set on a session with WASM_SET_LOAD_OPTION, and applied when its module is loaded.
+struct ee_load_options {
+    // The module does not execute any x87, SSE or AVX instruction, so the FPU state of the
+    // runner does not need to be managed. Trusted: a module lying about it corrupts the FPU
+    // state of other tasks.
+    int fpu_free;
+    // The code checks linear memory accesses against `memory_bound` instead of relying on guard pages,
+    // so it never faults on them. Trusted, like `fpu_free`; required by packet hooks.
+    int bounds_checked;
+    // Size of the guest stack, a power of two from MIN_STACK_SIZE to STACK_SIZE. 0 for STACK_SIZE.
+    unsigned long stack_size;
+};
+
+struct persistent_runner;
+
+struct run_ring {
+    void *base;
+    unsigned long size;
+    struct run_ring_header *header;
+    struct run_ring_sqe *sqes;
+    struct run_ring_cqe *cqes;
+    uint32_t mask;
+
+    // Private copies of the kernel-owned indices, never read back from shared memory.
+    uint32_t sq_head;
+    uint32_t cq_tail;
+};
+
+// Files to read the code and initial memory of a module from, in place of the pointers of its load
+// request. NULL members are read from userspace as usual.
+struct ee_load_files {
+    struct file *code;
+    loff_t code_offset;
+    struct file *memory;
+    loff_t memory_offset;
 };
 
 // We are assuming that no concurrent access to a session would ever happen - is this true?
 struct privileged_session {
     int ready;
     struct execution_engine ee;
+    struct persistent_runner *runner;
+    struct run_ring *ring;
+    struct ee_snapshot *instance_template; // state new instances are created from, taken on first use
+    int home_cpu; // CPU the session's runner threads are bound to, -1 if none yet
+    struct ee_load_options options;
+    struct wasm_hook *hook; // attached packet hook, if any
 };
 
 static inline void init_privileged_session(struct privileged_session *sess) {
     sess->ready = 0;
+    sess->runner = NULL;
+    sess->ring = NULL;
+    sess->instance_template = NULL;
+    sess->home_cpu = -1;
+    sess->hook = NULL;
+    memset(&sess->options, 0, sizeof(struct ee_load_options));
 }
 
 static inline unsigned long round_up_to_page_size(unsigned long x) {
@@ -120,6 +336,18 @@ static inline uint8_t *vmctx_get_memory_slice(struct vmctx *ctx, uint32_t offset
     return (uint8_t *) begin;
 }
 
+// Makes the next function prologue of the guest fail its stack check and trap, which kills the runner
+// as a fault on its code would, but without changing page attributes.
+// Loops that make no call are not interrupted; see `ee_make_code_nx` for the fallback.
+static inline void ee_interrupt(struct execution_engine *ee) {
+    WRITE_ONCE(ee->ctx.stack_lower_bound, (uint8_t *) ~0ul);
+}
+
+static inline void ee_interrupt_clear(struct execution_engine *ee) {
+    WRITE_ONCE(ee->ctx.stack_lower_bound, ee->stack_begin + STACK_HOST_RESERVE);
+}
+
+// Only affects the private code mapping of `ee`; engines sharing its code image keep running.
 static inline void ee_make_code_nx(struct execution_engine *ee) {
     set_memory_nx((unsigned long) ee->code, round_up_to_page_size(ee->code_len) / 4096);
 }
@@ -128,7 +356,72 @@ static inline void ee_make_code_x(struct execution_engine *ee) {
     set_memory_x((unsigned long) ee->code, round_up_to_page_size(ee->code_len) / 4096);
 }
 
+// Returns the function import `i` resolved to, looking through host call counting and tracing thunks.
+static inline void *ee_imported_func_target(struct execution_engine *ee, uint32_t i) {
+    return ee->host_call_targets ? ee->host_call_targets[i] : ee->ctx.imported_funcs[i].func;
+}
+
 int vm_unshare_executor_files(void);
-int init_execution_engine(const struct load_code_request *request, struct execution_engine *ee);
+void vm_put_executor_files(struct files_struct *files);
+void executor_enter_guest_context(struct execution_engine *ee);
+void executor_leave_guest_context(struct execution_engine *ee);
+struct code_image *code_image_get(const uint8_t __user *code, uint32_t code_len, uint64_t import_hash);
+int kwasm_read_file(struct file *f, void *dst, size_t len, loff_t pos);
+struct code_image *code_image_get_from_file(struct file *f, loff_t pos, uint32_t code_len, uint64_t import_hash);
+void code_image_ref(struct code_image *img);
+void code_image_put(struct code_image *img);
+uint8_t *code_image_map(struct code_image *img);
+void code_image_unmap(struct code_image *img, uint8_t *code);
+int code_image_set_symbols(struct code_image *img, const struct symbol_entry_request __user *symbols, uint32_t count);
+void code_cache_debugfs_init(struct dentry *dir);
+uint64_t code_import_hash_update(uint64_t hash, const struct import_request *req);
+struct ee_shell *ee_shell_alloc(void);
+void ee_shell_free(struct ee_shell *shell);
+struct ee_shell *ee_shell_get(void);
+void ee_shell_put(struct ee_shell *shell);
+struct ee_stack *ee_stack_alloc(unsigned long size);
+void ee_stack_free(struct ee_stack *stack);
+struct ee_stack *ee_stack_get(unsigned long size);
+void ee_stack_put(struct ee_stack *stack);
+struct page *ee_zero_page_get(void);
+int init_execution_engine(
+    const struct load_code_request *request,
+    const struct ee_load_options *options,
+    const struct ee_load_files *files,
+    struct execution_engine *ee
+);
+int init_execution_engine_from_snapshot(struct ee_snapshot *snap, struct execution_engine *ee);
 void destroy_execution_engine(struct execution_engine *ee);
+struct ee_snapshot *ee_snapshot_create(struct execution_engine *ee);
+void ee_snapshot_put(struct ee_snapshot *snap);
+int ee_snapshot_install_fd(struct ee_snapshot *snap);
+struct ee_snapshot *ee_snapshot_get_from_fd(int fd);
+struct wasm_hook;
+struct wasm_hook *hook_attach(struct execution_engine *ee, const struct attach_hook_request *req);
+void hook_detach(struct wasm_hook *hook);
 uint64_t ee_call0(struct execution_engine *ee, uint32_t offset);
+uint64_t ee_call(struct execution_engine *ee, uint32_t offset, const uint64_t *params, uint32_t param_count);
+int ee_stats_init(struct execution_engine *ee);
+void ee_stats_release(struct execution_engine *ee);
+void ee_stats_run_begin(struct execution_engine *ee);
+void ee_stats_run_end(struct execution_engine *ee);
+void ee_stats_record_kill(struct execution_engine *ee);
+void ee_stats_sched_in(struct execution_engine *ee);
+void ee_stats_sched_out(struct execution_engine *ee);
+void ee_stats_read(struct execution_engine *ee, struct stats_request *out, uint64_t *host_call_counts);
+int ee_trace_init(struct execution_engine *ee);
+void ee_trace_release(struct execution_engine *ee);
+void ee_stats_run_usage(struct execution_engine *ee, uint64_t *wall_time_ns, uint64_t *cpu_time_ns);
+void ee_budget_start(struct execution_engine *ee, int kind, uint64_t budget_ns, struct semaphore *wake);
+int ee_budget_stop(struct execution_engine *ee);
+int sched_session_cpu_get(void);
+void sched_session_cpu_put(int cpu);
+int sched_run_begin(int home, int may_move);
+void sched_run_end(int cpu);
+struct sched_task *sched_task_create(struct execution_engine *ee, int cpu, CoEntry entry, void *data);
+void sched_task_wait(struct sched_task *t);
+void sched_task_kill(struct sched_task *t, long grace);
+void sched_task_destroy(struct sched_task *t);
+struct run_ring *run_ring_create(uint32_t entries);
+void run_ring_destroy(struct run_ring *ring);
+uint32_t run_ring_drain(struct run_ring *ring, struct execution_engine *ee);
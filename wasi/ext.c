@@ -2,6 +2,8 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 #include <linux/fdtable.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
 #include "../kapi.h"
 #include "../vm.h"
 #include "def.h"
@@ -36,6 +38,29 @@ struct import_resolver *resolver;
         return 1; \
     }
 
+static int wasi_errno(int err) {
+    switch(-err) {
+        case 0: return __WASI_ESUCCESS;
+        case EACCES: return __WASI_EACCES;
+        case EBADF: return __WASI_EBADF;
+        case EEXIST: return __WASI_EEXIST;
+        case EFAULT: return __WASI_EFAULT;
+        case EINVAL: return __WASI_EINVAL;
+        case EIO: return __WASI_EIO;
+        case EISDIR: return __WASI_EISDIR;
+        case ELOOP: return __WASI_ELOOP;
+        case ENAMETOOLONG: return __WASI_ENAMETOOLONG;
+        case ENOENT: return __WASI_ENOENT;
+        case ENOMEM: return __WASI_ENOMEM;
+        case ENOSYS: return __WASI_ENOSYS;
+        case ENOTDIR: return __WASI_ENOTDIR;
+        case EOVERFLOW: return __WASI_EOVERFLOW;
+        case EPERM: return __WASI_EPERM;
+        case ESPIPE: return __WASI_ESPIPE;
+        default: return __WASI_EIO;
+    }
+}
+
 int __wasi_fd_prestat_get(
     struct vmctx *ctx,
     __wasi_fd_t fd,
@@ -173,106 +198,176 @@ static inline void file_pos_write(struct file *file, loff_t pos)
 	file->f_pos = pos;
 }
 
-int __wasi_fd_write(
+// Translates a guest iovec array into kernel vectors over linear memory.
+// Returns the number of vectors, or a negative WASI error.
+static int wasi_iovs_to_kvec(
     struct vmctx *ctx,
-    __wasi_fd_t fd,
     wasm_pointer_t iovs,
     uint32_t iovs_len,
-    wasm_pointer_t nwritten
+    struct kvec *vec,
+    size_t *total
 ) {
-    int ret;
     uint32_t i;
     __wasi_ciovec_t *iov;
     uint8_t *buf;
-    loff_t pos;
-    struct file *f;
-    uint32_t *nwritten_p;
 
-    nwritten_p = (void *) vmctx_get_memory_slice(ctx, nwritten, sizeof(uint32_t));
-    if(!nwritten_p) {
-        return __WASI_EFAULT;
-    }
-    *nwritten_p = 0;
-
-    f = fget(fd);
-    if(!f) {
-        return __WASI_EBADF;
-    }
+    iov = (void *) vmctx_get_memory_slice(ctx, iovs, sizeof(__wasi_ciovec_t) * iovs_len);
+    if(!iov) return -__WASI_EFAULT;
 
+    *total = 0;
     for(i = 0; i < iovs_len; i++) {
-        iov = (void *) vmctx_get_memory_slice(ctx, iovs + sizeof(__wasi_ciovec_t) * i, sizeof(__wasi_ciovec_t));
-        if(!iov) {
-            fput(f);
-            return __WASI_EFAULT;
-        }
-        buf = (void *) vmctx_get_memory_slice(ctx, iov->buf, iov->buf_len);
-        if(!buf) {
-            fput(f);
-            return __WASI_EFAULT;
-        }
-        pos = file_pos_read(f);
-        ret = kernel_write(f, buf, iov->buf_len, &pos);
-        if(ret < 0) {
-            fput(f);
-            return __WASI_EPIPE;
-        }
-        *nwritten_p += ret;
-        file_pos_write(f, pos);
+        // Zero-length buffers may point anywhere.
+        buf = iov[i].buf_len ? (void *) vmctx_get_memory_slice(ctx, iov[i].buf, iov[i].buf_len) : NULL;
+        if(iov[i].buf_len && !buf) return -__WASI_EFAULT;
+        vec[i].iov_base = buf;
+        vec[i].iov_len = iov[i].buf_len;
+        *total += iov[i].buf_len;
     }
+    return iovs_len;
+}
 
-    fput(f);
-    return 0;
+// Files without iterator support (e.g. ttys on older kernels) get one call per vector,
+// stopping at the first short transfer like readv/writev would.
+static ssize_t wasi_rw_fallback(struct file *f, struct kvec *vec, uint32_t count, loff_t *pos, int write) {
+    ssize_t ret, done = 0;
+    uint32_t i;
+
+    for(i = 0; i < count; i++) {
+        if(!vec[i].iov_len) continue;
+        if(write) ret = kernel_write(f, vec[i].iov_base, vec[i].iov_len, pos);
+        else ret = kernel_read(f, vec[i].iov_base, vec[i].iov_len, pos);
+        if(ret < 0) return done ? done : ret;
+        done += ret;
+        if(ret < vec[i].iov_len) break;
+    }
+    return done;
 }
 
-int __wasi_fd_read(
+// Performs a vectored read or write on `fd` with a single VFS call over linear memory.
+// Uses and updates the file position unless `offset` is given.
+static int wasi_fd_rw(
     struct vmctx *ctx,
     __wasi_fd_t fd,
     wasm_pointer_t iovs,
     uint32_t iovs_len,
-    wasm_pointer_t nread
+    wasm_pointer_t nout,
+    int write,
+    const __wasi_filesize_t *offset
 ) {
-    int ret;
-    uint32_t i;
-    __wasi_ciovec_t *iov;
-    uint8_t *buf;
+    struct kvec fast_vec[UIO_FASTIOV];
+    struct kvec *vec = fast_vec;
+    struct iov_iter iter;
+    struct fd f;
+    uint32_t *nout_p;
+    size_t total;
+    ssize_t ret;
     loff_t pos;
-    struct file *f;
-    uint32_t *nread_p;
+    int err;
 
-    nread_p = (void *) vmctx_get_memory_slice(ctx, nread, sizeof(uint32_t));
-    if(!nread_p) {
+    nout_p = (void *) vmctx_get_memory_slice(ctx, nout, sizeof(uint32_t));
+    if(!nout_p) {
         return __WASI_EFAULT;
     }
-    *nread_p = 0;
+    *nout_p = 0;
 
-    f = fget(fd);
-    if(!f) {
+    if(iovs_len > UIO_MAXIOV) {
+        return __WASI_EINVAL;
+    }
+
+    f = fdget(fd);
+    if(!f.file) {
         return __WASI_EBADF;
     }
+    if(iovs_len == 0) {
+        fdput(f);
+        return __WASI_ESUCCESS;
+    }
 
-    for(i = 0; i < iovs_len; i++) {
-        iov = (void *) vmctx_get_memory_slice(ctx, iovs + sizeof(__wasi_ciovec_t) * i, sizeof(__wasi_ciovec_t));
-        if(!iov) {
-            fput(f);
-            return __WASI_EFAULT;
+    if(iovs_len > UIO_FASTIOV) {
+        vec = kmalloc_array(iovs_len, sizeof(struct kvec), GFP_KERNEL);
+        if(!vec) {
+            fdput(f);
+            return __WASI_ENOMEM;
         }
-        buf = (void *) vmctx_get_memory_slice(ctx, iov->buf, iov->buf_len);
-        if(!buf) {
-            fput(f);
-            return __WASI_EFAULT;
+    }
+
+    if((err = wasi_iovs_to_kvec(ctx, iovs, iovs_len, vec, &total)) < 0) {
+        err = -err;
+        goto out;
+    }
+
+    if(offset) {
+        if(!(f.file->f_mode & (write ? FMODE_PWRITE : FMODE_PREAD))) {
+            err = __WASI_ESPIPE;
+            goto out;
         }
-        pos = file_pos_read(f);
-        ret = kernel_read(f, buf, iov->buf_len, &pos);
-        if(ret < 0) {
-            fput(f);
-            return __WASI_EPIPE;
+        pos = *offset;
+    } else {
+        pos = file_pos_read(f.file);
+    }
+
+    // Async guests wait for pipes, sockets and terminals to be ready rather than blocking their executor.
+    if(kwasm_is_async(ctx) && !S_ISREG(file_inode(f.file)->i_mode) && !(f.file->f_flags & O_NONBLOCK)) {
+        if(kwasm_wait_file(ctx, f.file, write ? POLLOUT : POLLIN, MAX_SCHEDULE_TIMEOUT) < 0) {
+            err = __WASI_EINTR;
+            goto out;
         }
-        *nread_p += ret;
-        file_pos_write(f, pos);
     }
 
-    fput(f);
-    return 0;
+    if(write && f.file->f_op->write_iter) {
+        iov_iter_kvec(&iter, WRITE, vec, iovs_len, total);
+        file_start_write(f.file);
+        ret = vfs_iter_write(f.file, &iter, &pos, 0);
+        file_end_write(f.file);
+    } else if(!write && f.file->f_op->read_iter) {
+        iov_iter_kvec(&iter, READ, vec, iovs_len, total);
+        ret = vfs_iter_read(f.file, &iter, &pos, 0);
+    } else {
+        ret = wasi_rw_fallback(f.file, vec, iovs_len, &pos, write);
+    }
+    if(ret < 0) {
+        err = __WASI_EPIPE;
+        goto out;
+    }
+    if(!offset) file_pos_write(f.file, pos);
+    *nout_p = ret;
+    err = __WASI_ESUCCESS;
+
+    out:
+    if(vec != fast_vec) kfree(vec);
+    fdput(f);
+    return err;
+}
+
+int __wasi_fd_write(
+    struct vmctx *ctx,
+    __wasi_fd_t fd,
+    wasm_pointer_t iovs,
+    uint32_t iovs_len,
+    wasm_pointer_t nwritten
+) {
+    return wasi_fd_rw(ctx, fd, iovs, iovs_len, nwritten, 1, NULL);
+}
+
+int __wasi_fd_read(
+    struct vmctx *ctx,
+    __wasi_fd_t fd,
+    wasm_pointer_t iovs,
+    uint32_t iovs_len,
+    wasm_pointer_t nread
+) {
+    return wasi_fd_rw(ctx, fd, iovs, iovs_len, nread, 0, NULL);
+}
+
+int __wasi_fd_pread(
+    struct vmctx *ctx,
+    __wasi_fd_t fd,
+    wasm_pointer_t iovs,
+    uint32_t iovs_len,
+    __wasi_filesize_t offset,
+    wasm_pointer_t nread
+) {
+    return wasi_fd_rw(ctx, fd, iovs, iovs_len, nread, 0, &offset);
 }
 
 int __wasi_fd_seek(
@@ -283,14 +378,33 @@ int __wasi_fd_seek(
     wasm_pointer_t newoffset
 ) {
     __wasi_filesize_t *newoffset_p;
+    struct fd f;
+    loff_t ret;
+    int origin;
 
     newoffset_p = (void *) vmctx_get_memory_slice(ctx, newoffset, sizeof(__wasi_filesize_t));
     if(!newoffset_p) {
         return __WASI_EFAULT;
     }
 
-    // FIXME: not implemented
-    *newoffset_p = 0;
+    switch(whence) {
+        case __WASI_WHENCE_CUR: origin = SEEK_CUR; break;
+        case __WASI_WHENCE_END: origin = SEEK_END; break;
+        case __WASI_WHENCE_SET: origin = SEEK_SET; break;
+        default: return __WASI_EINVAL;
+    }
+
+    f = fdget_pos(fd);
+    if(!f.file) {
+        return __WASI_EBADF;
+    }
+    ret = vfs_llseek(f.file, offset, origin);
+    fdput_pos(f);
+
+    if(ret < 0) {
+        return wasi_errno(ret);
+    }
+    *newoffset_p = ret;
     return __WASI_ESUCCESS;
 }
 
@@ -302,10 +416,28 @@ int __wasi_random_get(
     return __WASI_ESUCCESS;
 }
 
+// Paths are resolved relative to `dirfd` and may not be absolute or contain `..` components.
+// Symbolic links inside the directory tree are followed.
+static int wasi_check_relative_path(const char *path, uint32_t len) {
+    uint32_t i, begin = 0;
+
+    if(len == 0) return __WASI_ENOENT;
+    if(path[0] == '/') return __WASI_ENOTCAPABLE;
+
+    for(i = 0; i <= len; i++) {
+        if(i < len && path[i] == 0) return __WASI_EINVAL;
+        if(i == len || path[i] == '/') {
+            if(i - begin == 2 && path[begin] == '.' && path[begin + 1] == '.') return __WASI_ENOTCAPABLE;
+            begin = i + 1;
+        }
+    }
+    return __WASI_ESUCCESS;
+}
+
 int __wasi_path_open(
     struct vmctx *ctx,
     __wasi_fd_t dirfd,
-    __wasi_fd_t dirflags,
+    __wasi_lookupflags_t dirflags,
     wasm_pointer_t path,
     uint32_t path_len,
     __wasi_oflags_t o_flags,
@@ -315,86 +447,132 @@ int __wasi_path_open(
     wasm_pointer_t fd_out
 ) {
     uint8_t *path_p;
+    char *kpath;
+    __wasi_fd_t *fd_out_p;
+    struct fd dir;
+    struct file *f;
+    int flags = O_LARGEFILE, err, fd;
+    int can_read = !!(fs_rights_base & __WASI_RIGHT_FD_READ);
+    int can_write = !!(fs_rights_base & __WASI_RIGHT_FD_WRITE);
+
+    if(path_len >= PATH_MAX) return __WASI_ENAMETOOLONG;
 
     path_p = vmctx_get_memory_slice(ctx, path, path_len);
     if(!path_p) return __WASI_EFAULT;
+    fd_out_p = (void *) vmctx_get_memory_slice(ctx, fd_out, sizeof(__wasi_fd_t));
+    if(!fd_out_p) return __WASI_EFAULT;
 
-    printk(KERN_INFO "path_open dirfd=%d path=%.*s\n", (int) dirfd, path_len, (char *) path_p);
-    return __WASI_EINVAL;
-}
+    if((err = wasi_check_relative_path((const char *) path_p, path_len)) != __WASI_ESUCCESS) {
+        return err;
+    }
 
-GEN_POLYFILL_2(_fd_fdstat_get);
+    if(can_read && can_write) flags |= O_RDWR;
+    else if(can_write) flags |= O_WRONLY;
+    else flags |= O_RDONLY;
+
+    if(o_flags & __WASI_O_CREAT) flags |= O_CREAT;
+    if(o_flags & __WASI_O_DIRECTORY) flags |= O_DIRECTORY;
+    if(o_flags & __WASI_O_EXCL) flags |= O_EXCL;
+    if(o_flags & __WASI_O_TRUNC) flags |= O_TRUNC;
+    if(fs_flags & __WASI_FDFLAG_APPEND) flags |= O_APPEND;
+    if(fs_flags & __WASI_FDFLAG_DSYNC) flags |= O_DSYNC;
+    if(fs_flags & __WASI_FDFLAG_NONBLOCK) flags |= O_NONBLOCK;
+    if(fs_flags & (__WASI_FDFLAG_RSYNC | __WASI_FDFLAG_SYNC)) flags |= O_SYNC;
+    if(!(dirflags & __WASI_LOOKUP_SYMLINK_FOLLOW)) flags |= O_NOFOLLOW;
+
+    kpath = kmemdup_nul((const char *) path_p, path_len, GFP_KERNEL);
+    if(!kpath) return __WASI_ENOMEM;
+
+    dir = fdget(dirfd);
+    if(!dir.file) {
+        kfree(kpath);
+        return __WASI_EBADF;
+    }
+    if(!d_is_dir(dir.file->f_path.dentry)) {
+        fdput(dir);
+        kfree(kpath);
+        return __WASI_ENOTDIR;
+    }
 
-int do_resolve(struct import_resolver_instance *self, const char *name, struct import_info *out) {
-    if(strcmp(name, "wasi_unstable##fd_prestat_get") == 0) {
-        out->fn = __wasi_fd_prestat_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_prestat_dir_name") == 0) {
-        out->fn = __wasi_fd_prestat_dir_name;
-        out->param_count = 3;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##environ_sizes_get") == 0) {
-        out->fn = __wasi_environ_sizes_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##environ_get") == 0) {
-        out->fn = __wasi_environ_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##args_sizes_get") == 0) {
-        out->fn = __wasi_args_sizes_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##args_get") == 0) {
-        out->fn = __wasi_args_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##random_get") == 0) {
-        out->fn = __wasi_random_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_write") == 0) {
-        out->fn = __wasi_fd_write;
-        out->param_count = 4;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_read") == 0) {
-        out->fn = __wasi_fd_read;
-        out->param_count = 4;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##proc_exit") == 0) {
-        out->fn = __wasi_proc_exit;
-        out->param_count = 1;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_fdstat_get") == 0) {
-        out->fn = _fd_fdstat_get;
-        out->param_count = 2;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_close") == 0) {
-        out->fn = __wasi_fd_close;
-        out->param_count = 1;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##path_open") == 0) {
-        out->fn = __wasi_path_open;
-        out->param_count = 9;
-        return 0;
-    } else if(strcmp(name, "wasi_unstable##fd_seek") == 0) {
-        out->fn = __wasi_fd_seek;
-        out->param_count = 4;
-        return 0;
-    } else {
-        return -EINVAL;
+    f = file_open_root(dir.file->f_path.dentry, dir.file->f_path.mnt, kpath, flags, 0644);
+    fdput(dir);
+    kfree(kpath);
+    if(IS_ERR(f)) {
+        return wasi_errno(PTR_ERR(f));
+    }
+
+    fd = get_unused_fd_flags(flags);
+    if(fd < 0) {
+        fput(f);
+        return wasi_errno(fd);
     }
+    fd_install(fd, f);
+
+    *fd_out_p = fd;
+    return __WASI_ESUCCESS;
 }
 
-int get_instance(struct execution_engine *ee, struct import_resolver *self, struct import_resolver_instance *out) {
-    out->resolve = do_resolve;
-    return 0;
+// kwasm extension: maps `len` bytes of `fd` at the page-aligned `offset` read-only into the guest address space,
+// above linear memory, and writes the address of the mapping to `addr_out`. The guest reads it with plain loads.
+int __kwasm_fd_map(
+    struct vmctx *ctx,
+    __wasi_fd_t fd,
+    __wasi_filesize_t offset,
+    uint32_t len,
+    wasm_pointer_t addr_out
+) {
+    wasm_pointer_t *addr_out_p;
+    struct fd f;
+    uint32_t addr;
+    int err;
+
+    addr_out_p = (void *) vmctx_get_memory_slice(ctx, addr_out, sizeof(wasm_pointer_t));
+    if(!addr_out_p) return __WASI_EFAULT;
+
+    f = fdget(fd);
+    if(!f.file) return __WASI_EBADF;
+    err = kwasm_map_file((struct execution_engine *) ctx, f.file, offset, len, &addr);
+    fdput(f);
+    if(err < 0) return wasi_errno(err);
+
+    *addr_out_p = addr;
+    return __WASI_ESUCCESS;
 }
 
+int __kwasm_fd_unmap(
+    struct vmctx *ctx,
+    wasm_pointer_t addr
+) {
+    int err = kwasm_unmap_file((struct execution_engine *) ctx, addr);
+    return err < 0 ? wasi_errno(err) : __WASI_ESUCCESS;
+}
+
+GEN_POLYFILL_2(_fd_fdstat_get);
+
+static const struct import_entry wasi_imports[] = {
+    { "wasi_unstable##fd_prestat_get", __wasi_fd_prestat_get, 2 },
+    { "wasi_unstable##fd_prestat_dir_name", __wasi_fd_prestat_dir_name, 3 },
+    { "wasi_unstable##environ_sizes_get", __wasi_environ_sizes_get, 2 },
+    { "wasi_unstable##environ_get", __wasi_environ_get, 2 },
+    { "wasi_unstable##args_sizes_get", __wasi_args_sizes_get, 2 },
+    { "wasi_unstable##args_get", __wasi_args_get, 2 },
+    { "wasi_unstable##random_get", __wasi_random_get, 2 },
+    { "wasi_unstable##fd_write", __wasi_fd_write, 4 },
+    { "wasi_unstable##fd_read", __wasi_fd_read, 4 },
+    { "wasi_unstable##proc_exit", __wasi_proc_exit, 1 },
+    { "wasi_unstable##fd_fdstat_get", _fd_fdstat_get, 2 },
+    { "wasi_unstable##fd_close", __wasi_fd_close, 1 },
+    { "wasi_unstable##path_open", __wasi_path_open, 9 },
+    { "wasi_unstable##fd_seek", __wasi_fd_seek, 4 },
+    { "wasi_unstable##fd_pread", __wasi_fd_pread, 5 },
+    { "kwasm##fd_map", __kwasm_fd_map, 4 },
+    { "kwasm##fd_unmap", __kwasm_fd_unmap, 1 },
+};
+
 int __init init_module(void) {
     struct import_resolver tmp = {
-        .get_instance = get_instance
+        .imports = wasi_imports,
+        .import_count = ARRAY_SIZE(wasi_imports),
     };
     resolver = kwasm_resolver_register(&tmp);
     if(IS_ERR(resolver)) {